@@ -0,0 +1,254 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "bench_lib.h"
+
+/* Benchmarks of the generated code and libjs2c. Each result is printed on
+   its own line as a JSON object:
+   {"bench": "<name>", "value": <number>, "unit": "<unit>"} */
+
+void js_nop(void);
+void js_nop_handle(void);
+int64_t js_fib(int64_t);
+int32_t js_add_int(int32_t, int32_t);
+double js_add_double(double, double);
+size_t js_concat(const char *, char *, size_t);
+double js_sum_array(const double *, uint32_t);
+int js_make_array(double *, uint32_t);
+int32_t js_checksum(uint8_t *, size_t);
+int64_t js_inc(int64_t);
+int js_inc_batch(const int64_t *, int64_t *, size_t);
+int js_inc_typed(const double *, double *, size_t);
+
+/* bundles of increasing size, generated by CMakeLists.txt */
+#define BUNDLE_LIST(DEF) \
+    DEF(small)           \
+    DEF(medium)          \
+    DEF(large)
+
+#define DEF(name)                                                       \
+    void init_bundle_##name(); void cleanup_bundle_##name();            \
+    struct bundle_##name##_instance *bundle_##name##_create();          \
+    int bundle_##name##_reset(struct bundle_##name##_instance *);       \
+    void bundle_##name##_destroy(struct bundle_##name##_instance *);
+BUNDLE_LIST(DEF)
+#undef DEF
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double value, const char *unit) {
+    printf("{\"bench\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}\n",
+           name, value, unit);
+    fflush(stdout);
+}
+
+static long file_size(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) < 0)
+        return -1;
+    return st.st_size;
+}
+
+#define CALL_COUNT 200000
+#define ARRAY_LEN 100
+#define RECORD_SIZE (4 * 1024 * 1024)
+#define BATCH_LEN 1000
+
+static int64_t batch_in[BATCH_LEN], batch_out[BATCH_LEN];
+static double batch_fin[BATCH_LEN], batch_fout[BATCH_LEN];
+
+/* same calls through the typed bindings generated from bench.sig */
+static void bench_calls_bound(void) {
+    bench_instance_t *inst;
+    char *str;
+    int64_t i64;
+    int32_t i32;
+    double d;
+    double t;
+    int i;
+
+    inst = bench_create();
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        bench_nop(inst);
+    report("bound_nop", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        bench_fib(inst, 1, &i64);
+    report("bound_fib_1", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        bench_add_int(inst, i, 1, &i32);
+    report("bound_int", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        bench_add_double(inst, i, 0.5, &d);
+    report("bound_double", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++) {
+        if (bench_concat(inst, "hello world", &str) == 0)
+            free(str);
+    }
+    report("bound_string", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    bench_destroy(inst);
+}
+
+static void bench_calls(void) {
+    char buf[64];
+    double tab[ARRAY_LEN];
+    uint8_t *record;
+    double t;
+    int i;
+
+    for (i = 0; i < ARRAY_LEN; i++)
+        tab[i] = i;
+
+    init_bench();
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_nop();
+    report("call_nop", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_nop_handle();
+    report("handle_nop", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_fib(1);
+    report("call_fib_1", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < 10; i++)
+        js_fib(20);
+    report("call_fib_20", (now() - t) * 1e6 / 10, "us");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_add_int(i, 1);
+    report("marshal_int", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_add_double(i, 0.5);
+    report("marshal_double", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        js_concat("hello world", buf, sizeof(buf));
+    report("marshal_string", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT / 10; i++)
+        js_sum_array(tab, ARRAY_LEN);
+    report("marshal_array_in_100", (now() - t) * 1e9 / (CALL_COUNT / 10), "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT / 10; i++)
+        js_make_array(tab, ARRAY_LEN);
+    report("marshal_array_out_100", (now() - t) * 1e9 / (CALL_COUNT / 10), "ns");
+
+    bench_calls_bound();
+
+    t = now();
+    for (i = 0; i < CALL_COUNT; i++)
+        batch_out[i % BATCH_LEN] = js_inc(i);
+    report("batch_loop", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    for (i = 0; i < BATCH_LEN; i++) {
+        batch_in[i] = i;
+        batch_fin[i] = i;
+    }
+    t = now();
+    for (i = 0; i < CALL_COUNT / BATCH_LEN; i++)
+        js_inc_batch(batch_in, batch_out, BATCH_LEN);
+    report("batch_int64", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    t = now();
+    for (i = 0; i < CALL_COUNT / BATCH_LEN; i++)
+        js_inc_typed(batch_fin, batch_fout, BATCH_LEN);
+    report("batch_typed", (now() - t) * 1e9 / CALL_COUNT, "ns");
+
+    record = calloc(1, RECORD_SIZE);
+    t = now();
+    for (i = 0; i < CALL_COUNT / 100; i++)
+        js_checksum(record, RECORD_SIZE);
+    report("marshal_buffer_4m", (now() - t) * 1e9 / (CALL_COUNT / 100), "ns");
+    free(record);
+
+    cleanup_bench();
+}
+
+#define INIT_COUNT 20
+
+static void bench_init(void) {
+    double t;
+    int i;
+
+#define DEF(bname)                                                      \
+    report("bundle_" #bname "_bytes",                                   \
+           file_size(BENCH_DIR "/bundle_" #bname ".js"), "B");          \
+    t = now();                                                          \
+    for (i = 0; i < INIT_COUNT; i++) {                                  \
+        init_bundle_##bname();                                          \
+        cleanup_bundle_##bname();                                       \
+    }                                                                   \
+    report("init_cleanup_" #bname, (now() - t) * 1e6 / INIT_COUNT, "us"); \
+    {                                                                   \
+        struct bundle_##bname##_instance *inst = bundle_##bname##_create(); \
+        t = now();                                                      \
+        for (i = 0; i < INIT_COUNT; i++)                                \
+            bundle_##bname##_reset(inst);                               \
+        report("reset_" #bname, (now() - t) * 1e6 / INIT_COUNT, "us");  \
+        bundle_##bname##_destroy(inst);                                 \
+    }
+    BUNDLE_LIST(DEF)
+#undef DEF
+}
+
+#define COMPILE_COUNT 3
+
+static void bench_compile(void) {
+    const char *input = BENCH_DIR "/bundle_large.js";
+    char cmd[1024];
+    double t;
+    long size;
+    int i;
+
+    size = file_size(input);
+    snprintf(cmd, sizeof(cmd), "\"%s\" -e -o \"%s/compile_out.c\" \"%s\"",
+             JS2C_PATH, BENCH_DIR, input);
+    t = now();
+    for (i = 0; i < COMPILE_COUNT; i++) {
+        if (system(cmd) != 0) {
+            fprintf(stderr, "could not run '%s'\n", cmd);
+            return;
+        }
+    }
+    t = (now() - t) / COMPILE_COUNT;
+    report("compile_time", t * 1e3, "ms");
+    report("compile_throughput", size / t / (1024 * 1024), "MB/s");
+}
+
+int main(int argc, char *argv[]) {
+    bench_calls();
+    bench_init();
+    bench_compile();
+    return 0;
+}
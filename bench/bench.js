@@ -0,0 +1,55 @@
+/* functions called by the benchmark wrappers */
+function nop() {
+}
+
+function fib(n) {
+    if (n <= 0)
+        return 0;
+    else if (n == 1)
+        return 1;
+    else
+        return fib(n - 1) + fib(n - 2);
+}
+
+function add_int(a, b) {
+    return a + b;
+}
+
+function add_double(a, b) {
+    return a + b;
+}
+
+function concat(s) {
+    return s + "!";
+}
+
+function sum_array(a) {
+    var i, s = 0;
+    for (i = 0; i < a.length; i++)
+        s += a[i];
+    return s;
+}
+
+function make_array(n) {
+    var i, a = [];
+    for (i = 0; i < n; i++)
+        a.push(i * 0.5);
+    return a;
+}
+
+function checksum(a) {
+    var i, s = 0;
+    for (i = 0; i < a.length; i += 4096)
+        s = (s + a[i]) | 0;
+    return s;
+}
+
+function inc(x) {
+    return x + 1;
+}
+
+function inc_all(a, r) {
+    var i;
+    for (i = 0; i < a.length; i++)
+        r[i] = a[i] + 1;
+}
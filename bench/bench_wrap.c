@@ -0,0 +1,164 @@
+#include <inttypes.h>
+#include <string.h>
+
+/* wrappers in the style of example/fib.c, each call looks the function up
+   on the global object */
+
+static JSValue call_global(const char *name, int argc, JSValueConst *argv) {
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSValue func = JS_GetPropertyStr(ctx, global_obj, name);
+    JSValue val = JS_Call(ctx, func, global_obj, argc, argv);
+
+    if (JS_IsException(val))
+        js_std_dump_error(ctx);
+    JS_FreeValue(ctx, func);
+    JS_FreeValue(ctx, global_obj);
+    return val;
+}
+
+void js_nop(void) {
+    JS_FreeValue(ctx, call_global("nop", 0, NULL));
+}
+
+/* same call through the export table */
+void js_nop_handle(void) {
+    JS_FreeValue(ctx, bench_call(current_instance, bench_fn_nop, 0, NULL));
+}
+
+int64_t js_fib(int64_t x) {
+    int64_t rc;
+    JSValueConst args[1];
+
+    args[0] = JS_NewInt64(ctx, x);
+    JSValue val = call_global("fib", 1, args);
+    if (JS_ToInt64(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    return rc;
+}
+
+int32_t js_add_int(int32_t a, int32_t b) {
+    int32_t rc;
+    JSValueConst args[2];
+
+    args[0] = JS_NewInt32(ctx, a);
+    args[1] = JS_NewInt32(ctx, b);
+    JSValue val = call_global("add_int", 2, args);
+    if (JS_ToInt32(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    return rc;
+}
+
+double js_add_double(double a, double b) {
+    double rc;
+    JSValueConst args[2];
+
+    args[0] = JS_NewFloat64(ctx, a);
+    args[1] = JS_NewFloat64(ctx, b);
+    JSValue val = call_global("add_double", 2, args);
+    if (JS_ToFloat64(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    return rc;
+}
+
+/* returns the length of the result, which is copied to buf */
+size_t js_concat(const char *s, char *buf, size_t buf_size) {
+    size_t len = 0;
+    const char *str;
+    JSValueConst args[1];
+
+    args[0] = JS_NewString(ctx, s);
+    JSValue val = call_global("concat", 1, args);
+    str = JS_ToCString(ctx, val);
+    if (str) {
+        len = strlen(str);
+        if (buf_size > 0) {
+            if (len >= buf_size)
+                len = buf_size - 1;
+            memcpy(buf, str, len);
+            buf[len] = '\0';
+        }
+        JS_FreeCString(ctx, str);
+    }
+    JS_FreeValue(ctx, val);
+    JS_FreeValue(ctx, args[0]);
+    return len;
+}
+
+double js_sum_array(const double *tab, uint32_t len) {
+    double rc;
+    uint32_t i;
+    JSValueConst args[1];
+
+    args[0] = JS_NewArray(ctx);
+    for (i = 0; i < len; i++)
+        JS_SetPropertyUint32(ctx, args[0], i, JS_NewFloat64(ctx, tab[i]));
+    JSValue val = call_global("sum_array", 1, args);
+    if (JS_ToFloat64(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    JS_FreeValue(ctx, args[0]);
+    return rc;
+}
+
+/* fills tab with the array built by make_array(len) */
+int js_make_array(double *tab, uint32_t len) {
+    uint32_t i;
+    int rc = 0;
+    JSValueConst args[1];
+
+    args[0] = JS_NewInt32(ctx, len);
+    JSValue val = call_global("make_array", 1, args);
+    for (i = 0; i < len && rc == 0; i++) {
+        JSValue v = JS_GetPropertyUint32(ctx, val, i);
+        if (JS_ToFloat64(ctx, &tab[i], v))
+            rc = -1;
+        JS_FreeValue(ctx, v);
+    }
+    JS_FreeValue(ctx, val);
+    return rc;
+}
+
+/* lends buf to JS without copying it */
+int32_t js_checksum(uint8_t *buf, size_t len) {
+    int32_t rc;
+    JSValueConst args[1];
+
+    args[0] = js_std_new_typed_array(ctx, JS_STD_UINT8_ARRAY, buf, len,
+                                     NULL, NULL);
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSValue func = JS_GetPropertyStr(ctx, global_obj, "checksum");
+    JSValue val = js_std_call_detach(ctx, func, global_obj, 1, args);
+    if (JS_IsException(val))
+        js_std_dump_error(ctx);
+    if (JS_ToInt32(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    JS_FreeValue(ctx, func);
+    JS_FreeValue(ctx, global_obj);
+    JS_FreeValue(ctx, args[0]);
+    return rc;
+}
+
+int64_t js_inc(int64_t x) {
+    int64_t rc;
+    JSValueConst args[1];
+
+    args[0] = JS_NewInt64(ctx, x);
+    JSValue val = call_global("inc", 1, args);
+    if (JS_ToInt64(ctx, &rc, val))
+        rc = -1;
+    JS_FreeValue(ctx, val);
+    return rc;
+}
+
+int js_inc_batch(const int64_t *in, int64_t *out, size_t n) {
+    return js_std_call_batch_int64(ctx, "inc", in, out, n);
+}
+
+int js_inc_typed(const double *in, double *out, size_t n) {
+    return js_std_call_batch_typed(ctx, "inc_all", JS_STD_FLOAT64_ARRAY,
+                                   in, out, n);
+}
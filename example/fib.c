@@ -3,17 +3,15 @@
 int64_t js_fib(int64_t x) {
     int64_t rc;
 
-    JSValue global_obj = JS_GetGlobalObject(ctx);
-    JSValue fib_func = JS_GetPropertyStr(ctx, global_obj, "fib");
-
     JSValueConst args[1];
     args[0] = JS_NewInt64(ctx, x);
 
-    JSValue val = JS_Call(ctx, fib_func, global_obj, 1, args);
+    /* fib_fn_fib indexes the table of functions of the instance bound by
+       init_fib() */
+    JSValue val = fib_call(current_instance, fib_fn_fib, 1, args);
     if (JS_IsException(val)) {
         js_std_dump_error(ctx);
-        rc = -1;
-        goto cleanup;
+        return -1;
     }
 
     if (JS_ToInt64(ctx, &rc, val)) {
@@ -21,9 +19,10 @@ int64_t js_fib(int64_t x) {
     }
 
     JS_FreeValue(ctx, val);
-cleanup:
-    JS_FreeValue(ctx, fib_func);
-    JS_FreeValue(ctx, global_obj);
-    JS_FreeValue(ctx, args[0]);
     return rc;
 }
+
+/* fib of n values in one call, the function is looked up once */
+int js_fib_batch(const int64_t *x, int64_t *out, size_t n) {
+    return js_std_call_batch_int64(ctx, "fib", x, out, n);
+}
@@ -1,7 +1,10 @@
 #include <inttypes.h>
+#include <stddef.h>
 
 void init_fib();
 
 void cleanup_fib();
 
 int64_t js_fib(int64_t);
+
+int js_fib_batch(const int64_t *, int64_t *, size_t);
@@ -9,10 +9,21 @@
 #if !defined(_WIN32)
 #include <sys/wait.h>
 #endif
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "cutils.h"
 
 #include "js_std.h"
+#include "js_lz.h"
+#include "js_shake.h"
+#include "js_report.h"
 
 #include <string.h>  // strlen(), memcmp()
 
@@ -42,8 +53,56 @@ typedef struct namelist_t {
 static namelist_t cname_list;
 static namelist_t cmodule_list;
 static namelist_t init_module_list;
-static FILE *outfile;
+static namelist_t module_list;
 static BOOL byte_swap;
+static BOOL lazy_modules;
+static BOOL compress_code;
+static size_t code_size, compressed_code_size;
+/* entries of the js2c_modules table used by the lazy module loader */
+static DynBuf module_table;
+static BOOL preeval;
+/* compile with JS_EVAL_FLAG_STRIP: no line numbers, filenames or
+   function source in the emitted bytecode */
+static BOOL strip_debug;
+/* scratch context used by -v to measure the heap used by the loaded
+   bytecode */
+static JSContext *measure_ctx;
+static size_t loaded_code_size, loaded_heap_size;
+/* when set, bytecode is written to binary files which the generated C
+   includes with the assembler .incbin directive instead of hex arrays */
+static const char *blob_prefix;
+static BOOL blob_cleanup_registered;
+static const char *cache_dir;
+/* -C of the compile server, the default of its requests */
+static const char *server_cache_dir;
+/* -l: the modules loaded by the entries, and those only reached with
+   import() with the heap they use once read (-v) */
+static namelist_t static_module_list;
+static namelist_t lazy_module_list;
+/* -B: output a module set instead of a library */
+static BOOL module_set;
+/* modules imported from module sets (-U), the short name is the set */
+static namelist_t set_module_list;
+static namelist_t set_list;
+/* -T: sources of the ES modules without their unreachable code */
+static js_shake_t *shake;
+/* -R: JSON description of the emitted blobs */
+static js_report_t *report;
+
+/* kind of an emitted blob, stored in the cname_list flags */
+enum {
+    CODE_EVAL,      /* script or entry module, evaluated at init */
+    CODE_MODULE,    /* imported module, only loaded */
+    CODE_SNAPSHOT,  /* global bindings computed at compile time */
+};
+
+/* cname_list flag of the CODE_EVAL blobs of global scripts, whose
+   bytecode can be read once and run in several contexts (-n) */
+#define CODE_FLAG_SCRIPT 0x100
+/* -n: generate the host and tenant API */
+static BOOL tenants;
+/* -d: generate the dispatcher API */
+static BOOL dispatcher;
 
 void namelist_add(namelist_t *lp, const char *name, const char *short_name,
                   int flags) {
@@ -107,31 +166,541 @@ static void dump_hex(FILE *f, const uint8_t *buf, size_t len) {
         fprintf(f, "\n");
 }
 
-static void output_object_code(JSContext *ctx,
-                               FILE *fo, JSValueConst obj, const char *c_name,
-                               BOOL load_only) {
-    uint8_t *out_buf;
-    size_t out_buf_len;
+static void get_blob_filename(char *buf, size_t buf_size, const char *c_name) {
+    snprintf(buf, buf_size, "%s%s.bin", blob_prefix, c_name);
+}
+
+/* remove the blob files, also registered with atexit() for the error
+   paths */
+static void remove_blob_files(void) {
+    char filename[1024];
+    int i;
+
+    if (!blob_prefix)
+        return;
+    for (i = 0; i < cname_list.count; i++) {
+        get_blob_filename(filename, sizeof(filename), cname_list.array[i].name);
+        unlink(filename);
+    }
+}
+
+/* output the bytecode and return its embedded size */
+static size_t output_blob(FILE *fo, const char *c_name,
+                          const uint8_t *raw_buf, size_t raw_len) {
+    char filename[1024];
+    const uint8_t *buf;
+    uint8_t *lz_buf;
+    size_t len;
+    FILE *f;
+
+    buf = raw_buf;
+    len = raw_len;
+    lz_buf = NULL;
+    if (compress_code) {
+        lz_buf = malloc(js_lz_compress_bound(raw_len));
+        if (lz_buf)
+            len = js_lz_compress(lz_buf, raw_buf, raw_len);
+        if (!lz_buf || len == 0) {
+            fprintf(stderr, "Could not compress '%s'\n", c_name);
+            exit(1);
+        }
+        buf = lz_buf;
+        fprintf(fo, "static const uint32_t %s_raw_size = %u;\n",
+                c_name, (unsigned int)raw_len);
+    }
+    code_size += raw_len;
+    compressed_code_size += len;
+
+    /* blobs are local so that several libraries can be linked together */
+    fprintf(fo, "static const uint32_t %s_size = %u;\n\n",
+            c_name, (unsigned int)len);
+    if (!blob_prefix) {
+        fprintf(fo, "static const uint8_t %s[%u] = {\n",
+                c_name, (unsigned int)len);
+        dump_hex(fo, buf, len);
+        fprintf(fo, "};\n\n");
+        free(lz_buf);
+        return len;
+    }
+
+    get_blob_filename(filename, sizeof(filename), c_name);
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    if (fwrite(buf, 1, len, f) != len || fclose(f) != 0) {
+        perror(filename);
+        exit(1);
+    }
+    /* the assembler copies the file, the C compiler never sees the bytes */
+    fprintf(fo, "extern const uint8_t %s[%u];\n",
+            c_name, (unsigned int)len);
+    fprintf(fo, "__asm__(\"\\t.pushsection .rodata\\n\"\n"
+            "        \"\\t.type %s, %%object\\n\"\n"
+            "        \"\\t.size %s, %u\\n\"\n"
+            "        \"%s:\\n\"\n"
+            "        \"\\t.incbin \\\"%s\\\"\\n\"\n"
+            "        \"\\t.popsection\\n\");\n\n",
+            c_name, c_name, (unsigned int)len, c_name, filename);
+    free(lz_buf);
+    return len;
+}
+
+/* output a C string literal */
+static void dbuf_put_c_string(DynBuf *b, const char *str) {
+    const char *p;
+    dbuf_putc(b, '"');
+    for (p = str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\')
+            dbuf_putc(b, '\\');
+        dbuf_putc(b, *p);
+    }
+    dbuf_putc(b, '"');
+}
+
+/* bytecode produced by the compilation of one input file. It is kept in
+   memory so that files can be compiled in parallel and still be output in
+   the order of the command line. */
+typedef struct {
+    char *module_name;
+    int kind;
+    uint8_t *buf;
+    size_t len;
+} code_entry_t;
+
+typedef struct {
+    const char *filename;
+    int module;
+    code_entry_t *array;   /* imported modules first, then the file itself */
+    int count;
+    int size;
+    /* -l: entries before the modules only reached with import() */
+    int static_count;
+    namelist_t init_modules;
+    int cache_hits;
+    int cache_misses;
+    int ret;
+} compile_unit_t;
+
+struct compile_queue_t;
+
+/* a compilation runtime, one per worker thread */
+typedef struct {
+    JSRuntime *rt;
+    JSContext *ctx;
+    compile_unit_t *unit;   /* unit receiving the output */
+    struct compile_queue_t *queue; /* NULL without other workers */
+    int id;
+} compiler_t;
+
+static void unit_add_code(compile_unit_t *unit, const char *module_name,
+                          int kind, const uint8_t *buf, size_t len) {
+    code_entry_t *e;
+    if (unit->count == unit->size) {
+        size_t newsize = unit->size + (unit->size >> 1) + 4;
+        code_entry_t *a =
+            realloc(unit->array, sizeof(unit->array[0]) * newsize);
+        /* XXX: check for realloc failure */
+        unit->array = a;
+        unit->size = newsize;
+    }
+    e = &unit->array[unit->count++];
+    e->module_name = strdup(module_name);
+    e->kind = kind;
+    e->buf = malloc(len);
+    memcpy(e->buf, buf, len);
+    e->len = len;
+}
+
+static void unit_free(compile_unit_t *unit) {
+    while (unit->count > 0) {
+        code_entry_t *e = &unit->array[--unit->count];
+        free(e->module_name);
+        free(e->buf);
+    }
+    free(unit->array);
+    unit->array = NULL;
+    unit->size = 0;
+    namelist_free(&unit->init_modules);
+}
+
+/* Bytecode cache: the output for a source is stored in cache_dir under a
+   hash of the source, its name, the compile options and the QuickJS
+   version, so that unchanged sources are not compiled again. */
+
+/* compile options changing the output, part of the cache key */
+#define CACHE_FLAG_MODULE   (1 << 0)
+#define CACHE_FLAG_BSWAP    (1 << 1)
+#define CACHE_FLAG_PREEVAL  (1 << 2)
+#define CACHE_FLAG_STRIP    (1 << 3)
+
+#define CACHE_MAGIC "JS2C"
+#define CACHE_FORMAT 1
+
+typedef struct {
+    const char *name;
+    int flags;
+    uint64_t source_hash;
+    uint64_t source_len;
+    uint64_t hash;          /* of the whole key */
+    char path[1024];
+} cache_key_t;
+
+typedef struct {
+    uint8_t *data;          /* content of the cache file */
+    int kind;
+    const uint8_t *native;  /* bytecode in host byte order */
+    uint32_t native_len;
+    const uint8_t *code;    /* bytecode to output */
+    uint32_t code_len;
+} cache_entry_t;
+
+/* 64 bit FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static void cache_init_key(cache_key_t *key, const char *name, int flags,
+                           const uint8_t *buf, size_t buf_len) {
+    uint64_t h;
+
+    key->name = name;
+    key->flags = flags;
+    key->source_hash = hash_bytes(HASH_INIT, buf, buf_len);
+    key->source_len = buf_len;
+
+    h = hash_bytes(HASH_INIT, CONFIG_VERSION, sizeof(CONFIG_VERSION));
+    h = hash_bytes(h, name, strlen(name) + 1);
+    h = hash_bytes(h, &key->flags, sizeof(key->flags));
+    h = hash_bytes(h, &key->source_hash, sizeof(key->source_hash));
+    h = hash_bytes(h, &key->source_len, sizeof(key->source_len));
+    key->hash = h;
+    snprintf(key->path, sizeof(key->path), "%s/%016" PRIx64 ".jsbc",
+             cache_dir, h);
+}
+
+/* In server mode (-S) the cache is also kept in memory by the server.
+   The processes compiling the requests are forked from it, so they see
+   the entries known when they started, and send the entries they create
+   back to the server through cache_pipe_fd. */
+
+typedef struct mem_cache_entry_t {
+    struct mem_cache_entry_t *next;
+    uint64_t hash;
+    uint32_t len;
+    uint8_t data[0];        /* same content as a cache file */
+} mem_cache_entry_t;
+
+#define MEM_CACHE_BUCKETS 4096
+
+static BOOL use_mem_cache;
+static mem_cache_entry_t *mem_cache[MEM_CACHE_BUCKETS];
+static int cache_pipe_fd = -1;
+static pthread_mutex_t cache_pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mem_cache_add(uint64_t hash, const uint8_t *data, uint32_t len) {
+    mem_cache_entry_t **pe, *e;
+
+    for (pe = &mem_cache[hash % MEM_CACHE_BUCKETS]; *pe; pe = &(*pe)->next) {
+        if ((*pe)->hash == hash) {
+            e = *pe;
+            *pe = e->next;
+            free(e);
+            break;
+        }
+    }
+    e = malloc(sizeof(*e) + len);
+    if (!e)
+        return;
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->data, data, len);
+    e->next = mem_cache[hash % MEM_CACHE_BUCKETS];
+    mem_cache[hash % MEM_CACHE_BUCKETS] = e;
+}
+
+static uint8_t *mem_cache_get(uint64_t hash, size_t *plen) {
+    mem_cache_entry_t *e;
+    uint8_t *data;
+
+    for (e = mem_cache[hash % MEM_CACHE_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash) {
+            data = malloc(e->len);
+            if (!data)
+                return NULL;
+            memcpy(data, e->data, e->len);
+            *plen = e->len;
+            return data;
+        }
+    }
+    return NULL;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* send an entry to the server: the key hash, the length and the data */
+static void cache_send(uint64_t hash, const uint8_t *data, uint32_t len) {
+    pthread_mutex_lock(&cache_pipe_lock);
+    if (write_full(cache_pipe_fd, &hash, sizeof(hash)) < 0 ||
+        write_full(cache_pipe_fd, &len, sizeof(len)) < 0 ||
+        write_full(cache_pipe_fd, data, len) < 0) {
+        close(cache_pipe_fd);
+        cache_pipe_fd = -1;
+    }
+    pthread_mutex_unlock(&cache_pipe_lock);
+}
+
+static BOOL cache_read(const uint8_t **pp, const uint8_t *end,
+                       void *buf, size_t len) {
+    if (end - *pp < len)
+        return FALSE;
+    memcpy(buf, *pp, len);
+    *pp += len;
+    return TRUE;
+}
+
+static BOOL cache_read_str(const uint8_t **pp, const uint8_t *end,
+                           const char *str) {
+    size_t len = strlen(str) + 1;
+    if (end - *pp < len || memcmp(*pp, str, len))
+        return FALSE;
+    *pp += len;
+    return TRUE;
+}
+
+/* the whole key is stored in the entry and checked, a hash collision can
+   only go unnoticed if the sources have the same length and hash */
+static BOOL cache_get(const cache_key_t *key, cache_entry_t *entry) {
+    const uint8_t *p, *end;
+    size_t len;
+    uint32_t format, flags, kind;
+    uint64_t source_hash, source_len;
+
+    entry->data = NULL;
+    if (use_mem_cache)
+        entry->data = mem_cache_get(key->hash, &len);
+    if (!entry->data && cache_dir) {
+        entry->data = js_load_file(NULL, &len, key->path);
+        /* the server keeps it in memory for the next requests */
+        if (entry->data && cache_pipe_fd >= 0)
+            cache_send(key->hash, entry->data, len);
+    }
+    if (!entry->data)
+        return FALSE;
+    p = entry->data;
+    end = p + len;
+    if (!cache_read_str(&p, end, CACHE_MAGIC) ||
+        !cache_read(&p, end, &format, sizeof(format)) ||
+        format != CACHE_FORMAT ||
+        !cache_read_str(&p, end, CONFIG_VERSION) ||
+        !cache_read_str(&p, end, key->name) ||
+        !cache_read(&p, end, &flags, sizeof(flags)) ||
+        flags != key->flags ||
+        !cache_read(&p, end, &source_hash, sizeof(source_hash)) ||
+        source_hash != key->source_hash ||
+        !cache_read(&p, end, &source_len, sizeof(source_len)) ||
+        source_len != key->source_len ||
+        !cache_read(&p, end, &kind, sizeof(kind)) ||
+        !cache_read(&p, end, &entry->native_len, sizeof(entry->native_len)) ||
+        !cache_read(&p, end, &entry->code_len, sizeof(entry->code_len)) ||
+        end - p != (size_t)entry->native_len + entry->code_len) {
+        free(entry->data);
+        return FALSE;
+    }
+    entry->kind = kind;
+    entry->native = p;
+    entry->code = p + entry->native_len;
+    return TRUE;
+}
+
+static void cache_put(const cache_key_t *key, int kind,
+                      const uint8_t *native, uint32_t native_len,
+                      const uint8_t *code, uint32_t code_len) {
+    char tmp_path[1024 + 8];
+    uint32_t format, flags, kind32;
+    DynBuf b;
+    FILE *f;
+    int fd;
+    BOOL ok;
+
+    format = CACHE_FORMAT;
+    flags = key->flags;
+    kind32 = kind;
+    dbuf_init(&b);
+    dbuf_put(&b, (const uint8_t *)CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    dbuf_put(&b, (const uint8_t *)&format, sizeof(format));
+    dbuf_put(&b, (const uint8_t *)CONFIG_VERSION, sizeof(CONFIG_VERSION));
+    dbuf_put(&b, (const uint8_t *)key->name, strlen(key->name) + 1);
+    dbuf_put(&b, (const uint8_t *)&flags, sizeof(flags));
+    dbuf_put(&b, (const uint8_t *)&key->source_hash, sizeof(key->source_hash));
+    dbuf_put(&b, (const uint8_t *)&key->source_len, sizeof(key->source_len));
+    dbuf_put(&b, (const uint8_t *)&kind32, sizeof(kind32));
+    dbuf_put(&b, (const uint8_t *)&native_len, sizeof(native_len));
+    dbuf_put(&b, (const uint8_t *)&code_len, sizeof(code_len));
+    dbuf_put(&b, native, native_len);
+    dbuf_put(&b, code, code_len);
+    if (b.error) {
+        dbuf_free(&b);
+        return;
+    }
+
+    if (cache_pipe_fd >= 0)
+        cache_send(key->hash, b.buf, b.size);
+
+    if (cache_dir) {
+        /* written under a temporary name and renamed, so that concurrent
+           builds never read a partial entry */
+        snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", key->path);
+        fd = mkstemp(tmp_path);
+        if (fd >= 0) {
+            f = fdopen(fd, "wb");
+            if (!f) {
+                close(fd);
+                unlink(tmp_path);
+            } else {
+                ok = fwrite(b.buf, 1, b.size, f) == b.size;
+                if (fclose(f) != 0)
+                    ok = FALSE;
+                if (!ok || rename(tmp_path, key->path) != 0)
+                    unlink(tmp_path);
+            }
+        }
+    }
+    dbuf_free(&b);
+}
+
+static int output_object_code(JSContext *ctx, compile_unit_t *unit,
+                              JSValueConst obj, const char *module_name,
+                              int kind, const cache_key_t *key) {
+    uint8_t *out_buf, *native_buf;
+    size_t out_buf_len, native_buf_len;
     int flags;
     flags = JS_WRITE_OBJ_BYTECODE;
     if (byte_swap)
         flags |= JS_WRITE_OBJ_BSWAP;
     out_buf = JS_WriteObject(ctx, &out_buf_len, obj, flags);
-    if (!out_buf) {
-        js_std_dump_error(ctx);
-        exit(1);
-    }
+    if (!out_buf)
+        return -1;
 
-    namelist_add(&cname_list, c_name, NULL, load_only);
-    
-    fprintf(fo, "const uint32_t %s_size = %u;\n\n", 
-            c_name, (unsigned int)out_buf_len);
-    fprintf(fo, "const uint8_t %s[%u] = {\n",
-            c_name, (unsigned int)out_buf_len);
-    dump_hex(fo, out_buf, out_buf_len);
-    fprintf(fo, "};\n\n");
+    unit_add_code(unit, module_name, kind, out_buf, out_buf_len);
+
+    if (key) {
+        /* byte swapped bytecode cannot be read back to find the imports
+           of a module, so the host version is cached too */
+        native_buf = out_buf;
+        native_buf_len = out_buf_len;
+        if (byte_swap) {
+            native_buf = JS_WriteObject(ctx, &native_buf_len, obj,
+                                        JS_WRITE_OBJ_BYTECODE);
+        }
+        if (native_buf) {
+            cache_put(key, kind, native_buf, native_buf_len,
+                      out_buf, out_buf_len);
+        }
+        if (native_buf != out_buf)
+            js_free(ctx, native_buf);
+        unit->cache_misses++;
+    }
 
     js_free(ctx, out_buf);
+    return 0;
+}
+
+/* output a cached entry. The imports of a module are resolved like the
+   compilation would have done, so that they are output before it. */
+static int output_cached_code(compiler_t *c, const cache_key_t *key,
+                              cache_entry_t *entry, JSModuleDef **pm) {
+    JSContext *ctx = c->ctx;
+    JSValue obj;
+
+    if (key->flags & CACHE_FLAG_MODULE) {
+        obj = JS_ReadObject(ctx, entry->native, entry->native_len,
+                            JS_READ_OBJ_BYTECODE);
+        if (JS_IsException(obj))
+            goto fail;
+        if (JS_ResolveModule(ctx, obj) < 0) {
+            JS_FreeValue(ctx, obj);
+            goto fail;
+        }
+        /* the module is already referenced, so we must free it */
+        if (pm)
+            *pm = JS_VALUE_GET_PTR(obj);
+        JS_FreeValue(ctx, obj);
+    }
+    unit_add_code(c->unit, key->name, entry->kind,
+                  entry->code, entry->code_len);
+    c->unit->cache_hits++;
+    free(entry->data);
+    return 0;
+ fail:
+    free(entry->data);
+    return -1;
+}
+
+/* load a source file, as modified by the tree shaking if enabled */
+static uint8_t *load_source(JSContext *ctx, size_t *pbuf_len,
+                            const char *filename) {
+    const char *src;
+    uint8_t *buf;
+
+    if (shake) {
+        src = js_shake_get_source(shake, filename, pbuf_len);
+        if (src) {
+            buf = js_malloc(ctx, *pbuf_len + 1);
+            if (!buf)
+                return NULL;
+            memcpy(buf, src, *pbuf_len + 1);
+            return buf;
+        }
+    }
+    return js_load_file(ctx, pbuf_len, filename);
+}
+
+/* modules which are not compiled from JS sources */
+static int shake_is_external(const char *module_name, void *opaque) {
+    return namelist_find(&set_module_list, module_name) ||
+        namelist_find(&cmodule_list, module_name) ||
+        has_suffix(module_name, ".so");
 }
 
 static int js_module_dummy_init(JSContext *ctx, JSModuleDef *m) {
@@ -139,16 +708,188 @@ static int js_module_dummy_init(JSContext *ctx, JSModuleDef *m) {
     abort();
 }
 
+/* With -j, the modules are shared by the workers through the queue: the
+   first worker importing a module claims it and publishes its bytecode,
+   the others read it back like a cache entry instead of compiling it. A
+   worker waits for a module claimed by another one, unless that worker
+   is itself waiting, directly or not, for a module this one claimed (an
+   import cycle split between them): it then compiles the module too. */
+
+enum {
+    MODULE_CLAIMED,
+    MODULE_DONE,
+    MODULE_FAILED,
+};
+
+typedef struct {
+    char *name;
+    int state;
+    int owner;              /* worker compiling it */
+    uint8_t *native;        /* bytecode in host byte order */
+    size_t native_len;
+    uint8_t *code;          /* bytecode to output */
+    size_t code_len;
+} shared_module_t;
+
+typedef struct compile_queue_t {
+    compile_unit_t *units;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    int worker_count;
+    shared_module_t *modules;
+    int module_count, module_size;
+    int *waiting;           /* module waited for by each worker, or -1 */
+    pthread_cond_t module_cond;
+} compile_queue_t;
+
+/* returns TRUE if the module was compiled by another worker, otherwise
+   *pidx is the index of the module if this worker must publish it, or -1 */
+static BOOL module_claim(compiler_t *c, const char *name, int *pidx) {
+    compile_queue_t *q = c->queue;
+    shared_module_t *sm;
+    BOOL ret;
+    int i, w;
+
+    *pidx = -1;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        for (i = 0; i < q->module_count; i++) {
+            if (!strcmp(q->modules[i].name, name))
+                break;
+        }
+        if (i == q->module_count) {
+            if (q->module_count == q->module_size) {
+                q->module_size = q->module_size + (q->module_size >> 1) + 4;
+                /* XXX: check for realloc failure */
+                q->modules = realloc(q->modules,
+                                     sizeof(q->modules[0]) * q->module_size);
+            }
+            sm = &q->modules[q->module_count++];
+            memset(sm, 0, sizeof(*sm));
+            sm->name = strdup(name);
+            sm->state = MODULE_CLAIMED;
+            sm->owner = c->id;
+            *pidx = i;
+            ret = FALSE;
+            break;
+        }
+        sm = &q->modules[i];
+        if (sm->state == MODULE_DONE) {
+            *pidx = i;
+            ret = TRUE;
+            break;
+        }
+        /* a failed module is compiled again for its error message */
+        ret = FALSE;
+        if (sm->state == MODULE_FAILED)
+            break;
+        for (w = sm->owner; w >= 0 && w != c->id; ) {
+            i = q->waiting[w];
+            w = (i >= 0 && q->modules[i].state == MODULE_CLAIMED) ?
+                q->modules[i].owner : -1;
+        }
+        if (w == c->id)
+            break;
+        q->waiting[c->id] = sm - q->modules;
+        pthread_cond_wait(&q->module_cond, &q->lock);
+        q->waiting[c->id] = -1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/* publish a claimed module, m is NULL if it could not be compiled. Its
+   output is the last code of the unit. */
+static void module_publish(compiler_t *c, int idx, JSModuleDef *m) {
+    compile_queue_t *q = c->queue;
+    code_entry_t *e;
+    uint8_t *code, *native, *buf;
+    size_t code_len, native_len;
+
+    code = native = NULL;
+    code_len = native_len = 0;
+    if (m) {
+        e = &c->unit->array[c->unit->count - 1];
+        code_len = e->len;
+        code = malloc(code_len);
+        if (code)
+            memcpy(code, e->buf, code_len);
+        native = code;
+        native_len = code_len;
+        if (byte_swap) {
+            /* the module has not been evaluated, it can be written again */
+            buf = JS_WriteObject(c->ctx, &native_len,
+                                 JS_MKPTR(JS_TAG_MODULE, m),
+                                 JS_WRITE_OBJ_BYTECODE);
+            native = buf ? malloc(native_len) : NULL;
+            if (native)
+                memcpy(native, buf, native_len);
+            js_free(c->ctx, buf);
+        }
+        if (!code || !native) {
+            free(code);
+            if (native != code)
+                free(native);
+            code = native = NULL;
+        }
+    }
+    pthread_mutex_lock(&q->lock);
+    q->modules[idx].state = code ? MODULE_DONE : MODULE_FAILED;
+    q->modules[idx].code = code;
+    q->modules[idx].code_len = code_len;
+    q->modules[idx].native = native;
+    q->modules[idx].native_len = native_len;
+    pthread_cond_broadcast(&q->module_cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* output a module compiled by another worker. Its imports are resolved
+   first, so that they are output before it as if it was compiled. */
+static int output_shared_module(compiler_t *c, int idx,
+                                const char *module_name, JSModuleDef **pm) {
+    compile_queue_t *q = c->queue;
+    shared_module_t sm;
+    JSValue obj;
+
+    /* a published module is not modified anymore */
+    pthread_mutex_lock(&q->lock);
+    sm = q->modules[idx];
+    pthread_mutex_unlock(&q->lock);
+    obj = JS_ReadObject(c->ctx, sm.native, sm.native_len,
+                        JS_READ_OBJ_BYTECODE);
+    if (JS_IsException(obj))
+        return -1;
+    if (JS_ResolveModule(c->ctx, obj) < 0) {
+        JS_FreeValue(c->ctx, obj);
+        return -1;
+    }
+    /* the module is already referenced, so we must free it */
+    *pm = JS_VALUE_GET_PTR(obj);
+    JS_FreeValue(c->ctx, obj);
+    unit_add_code(c->unit, module_name, CODE_MODULE, sm.code, sm.code_len);
+    return 0;
+}
+
 JSModuleDef *jsc_module_loader(JSContext *ctx,
                               const char *module_name, void *opaque) {
+    compiler_t *c = opaque;
     JSModuleDef *m;
     namelist_entry_t *e;
 
+    /* modules of a set are loaded at run time, so they only need to be
+       declared */
+    e = namelist_find(&set_module_list, module_name);
+    if (e) {
+        m = JS_NewCModule(ctx, module_name, js_module_dummy_init);
+        return m;
+    }
+
     /* check if it is a declared C or system module */
     e = namelist_find(&cmodule_list, module_name);
     if (e) {
         /* add in the static init module list */
-        namelist_add(&init_module_list, e->name, e->short_name, 0);
+        namelist_add(&c->unit->init_modules, e->name, e->short_name, 0);
         /* create a dummy module */
         m = JS_NewCModule(ctx, module_name, js_module_dummy_init);
     } else if (has_suffix(module_name, ".so")) {
@@ -159,102 +900,2037 @@ JSModuleDef *jsc_module_loader(JSContext *ctx,
         size_t buf_len;
         uint8_t *buf;
         JSValue func_val;
-        char *cname;
-        
-        buf = js_load_file(ctx, &buf_len, module_name);
+        cache_key_t key, *pkey;
+        cache_entry_t entry;
+        int shared;
+
+        /* the modules imported by the units of several workers are only
+           compiled once */
+        shared = -1;
+        if (c->queue && module_claim(c, module_name, &shared)) {
+            if (output_shared_module(c, shared, module_name, &m) < 0)
+                return NULL;
+            return m;
+        }
+
+        m = NULL;
+        buf = load_source(ctx, &buf_len, module_name);
         if (!buf) {
             JS_ThrowReferenceError(ctx, "could not load module filename '%s'",
                                    module_name);
-            return NULL;
+            goto done;
+        }
+
+        pkey = NULL;
+        if (cache_dir || use_mem_cache) {
+            cache_init_key(&key, module_name, CACHE_FLAG_MODULE |
+                           (byte_swap ? CACHE_FLAG_BSWAP : 0) |
+                           (strip_debug ? CACHE_FLAG_STRIP : 0),
+                           buf, buf_len);
+            if (cache_get(&key, &entry)) {
+                js_free(ctx, buf);
+                if (output_cached_code(c, &key, &entry, &m) < 0)
+                    m = NULL;
+                goto done;
+            }
+            pkey = &key;
         }
         
         /* compile the module */
         func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name,
-                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY |
+                           (strip_debug ? JS_EVAL_FLAG_STRIP : 0));
         js_free(ctx, buf);
         if (JS_IsException(func_val))
-            return NULL;
-        get_c_name(&cname);
-        output_object_code(ctx, outfile, func_val, cname, TRUE);
+            goto done;
+        if (output_object_code(ctx, c->unit, func_val, module_name,
+                               CODE_MODULE, pkey) < 0) {
+            JS_FreeValue(ctx, func_val);
+            goto done;
+        }
         
         /* the module is already referenced, so we must free it */
         m = JS_VALUE_GET_PTR(func_val);
         JS_FreeValue(ctx, func_val);
+    done:
+        if (shared >= 0)
+            module_publish(c, shared, m);
     }
     return m;
 }
 
-static void compile_file(JSContext *ctx, FILE *fo,
-                         const char *filename,
-                         int module) {
+typedef BOOL scan_func_t(const char *ident, size_t len, int prev,
+                         const char *p, const char *end, void *opaque);
+
+/* crude scan calling func for each identifier outside of any block, prev
+   is the last character before it which is not a space or a comment (0
+   at the start) and p points after it. Comments and strings are
+   skipped. The scan stops when func returns TRUE. */
+static BOOL scan_top_level(const char *buf, size_t buf_len,
+                           scan_func_t *func, void *opaque) {
+    const char *p, *end, *start;
+    int depth, prev;
+    char quote;
+
+    p = buf;
+    end = buf + buf_len;
+    depth = 0;
+    prev = 0;
+    while (p < end) {
+        if (p[0] == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (p[0] == '/' && p + 1 < end && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            p += 2;
+        } else if (*p == '"' || *p == '\'' || *p == '`') {
+            quote = *p++;
+            while (p < end && *p != quote) {
+                if (*p == '\\')
+                    p++;
+                p++;
+            }
+            p++;
+            prev = quote;
+        } else if (*p == '{') {
+            depth++;
+            prev = *p++;
+        } else if (*p == '}') {
+            depth--;
+            prev = *p++;
+        } else if (*p == '_' || *p == '$' ||
+                   (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')) {
+            start = p;
+            while (p < end && (*p == '_' || *p == '$' ||
+                               (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                               (*p >= '0' && *p <= '9')))
+                p++;
+            if (depth == 0 && func(start, p - start, prev, p, end, opaque))
+                return TRUE;
+            prev = p[-1];
+        } else {
+            if (!strchr(" \t\r\n", *p))
+                prev = *p;
+            p++;
+        }
+    }
+    return FALSE;
+}
+
+static const char *skip_js_space(const char *p, const char *end,
+                                 BOOL *newline) {
+    while (p < end) {
+        if (*p == '\n') {
+            *newline = TRUE;
+            p++;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        } else if (p + 1 < end && p[0] == '/' && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (p + 1 < end && p[0] == '/' && p[1] == '*') {
+            for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++) {
+                if (*p == '\n')
+                    *newline = TRUE;
+            }
+            p = p + 2 < end ? p + 2 : end;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/* TRUE if the directive prologue of the script, the string literal
+   statements at its start, contains the directive */
+static BOOL has_directive(const char *buf, size_t buf_len,
+                          const char *directive) {
+    const char *p, *end = buf + buf_len, *start;
+    size_t len = strlen(directive);
+    BOOL newline, found;
+    char quote;
+
+    p = buf;
+    if (buf_len >= 2 && p[0] == '#' && p[1] == '!') {
+        while (p < end && *p != '\n')
+            p++;
+    }
+    found = FALSE;
+    for (;;) {
+        p = skip_js_space(p, end, &newline);
+        if (p == end || (*p != '"' && *p != '\''))
+            break;
+        quote = *p++;
+        start = p;
+        while (p < end && *p != quote && *p != '\n') {
+            if (*p == '\\')
+                p++;
+            p++;
+        }
+        if (p >= end || *p != quote)
+            break;
+        if (p - start == len && !memcmp(start, directive, len))
+            found = TRUE;
+        newline = FALSE;
+        p = skip_js_space(p + 1, end, &newline);
+        /* a string followed by anything else is an expression */
+        if (p < end && *p == ';')
+            p++;
+        else if (p < end && !newline)
+            break;
+        if (found)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* returns a function telling if the builtins were modified since it was
+   created: their properties, prototype and extensibility are compared,
+   and the new globals must be enumerable to be in the snapshot. The
+   functions it uses are taken before the script runs. */
+static const char preeval_builtins_source[] =
+    "(function () {\n"
+    "  var ownKeys = Reflect.ownKeys, getDesc = Object.getOwnPropertyDescriptor;\n"
+    "  var getProto = Object.getPrototypeOf, isExt = Object.isExtensible;\n"
+    "  var is = Object.is, g = globalThis, objs = [], seen = new Set();\n"
+    "  var globalKeys = ownKeys(g), known = new Set(globalKeys);\n"
+    "  var has = Set.prototype.has, before, i, v;\n"
+    "  function add(o) {\n"
+    "    if (((typeof o === 'object' && o !== null) || typeof o === 'function') &&\n"
+    "        !seen.has(o)) {\n"
+    "      seen.add(o);\n"
+    "      objs.push(o);\n"
+    "    }\n"
+    "  }\n"
+    "  function state(o, keys) {\n"
+    "    var s = [getProto(o), isExt(o)], n = 2, d, i;\n"
+    "    for (i = 0; i < keys.length; i++) {\n"
+    "      d = getDesc(o, keys[i]);\n"
+    "      if (!d) {\n"
+    "        s[n++] = undefined;\n"
+    "        continue;\n"
+    "      }\n"
+    "      s[n++] = keys[i]; s[n++] = d.value; s[n++] = d.get; s[n++] = d.set;\n"
+    "      s[n++] = d.writable; s[n++] = d.enumerable; s[n++] = d.configurable;\n"
+    "    }\n"
+    "    return s;\n"
+    "  }\n"
+    "  add(g);\n"
+    "  for (i = 0; i < globalKeys.length; i++) {\n"
+    "    v = getDesc(g, globalKeys[i]).value;\n"
+    "    add(v);\n"
+    "    if (typeof v === 'function' && getDesc(v, 'prototype'))\n"
+    "      add(getDesc(v, 'prototype').value);\n"
+    "  }\n"
+    "  for (i = 0; i < objs.length; i++)\n"
+    "    add(getProto(objs[i]));\n"
+    "  before = objs.map(function (o) {\n"
+    "    return state(o, o === g ? globalKeys : ownKeys(o));\n"
+    "  });\n"
+    "  return function () {\n"
+    "    var i, j, s, t, keys;\n"
+    "    for (i = 0; i < objs.length; i++) {\n"
+    "      s = before[i];\n"
+    "      t = state(objs[i], objs[i] === g ? globalKeys : ownKeys(objs[i]));\n"
+    "      if (s.length !== t.length)\n"
+    "        return true;\n"
+    "      for (j = 0; j < s.length; j++) {\n"
+    "        if (!is(s[j], t[j]))\n"
+    "          return true;\n"
+    "      }\n"
+    "    }\n"
+    "    /* Set.prototype.has is unchanged once the builtins are */\n"
+    "    keys = ownKeys(g);\n"
+    "    for (i = 0; i < keys.length; i++) {\n"
+    "      if (!has.call(known, keys[i]) && !getDesc(g, keys[i]).enumerable)\n"
+    "        return true;\n"
+    "    }\n"
+    "    return false;\n"
+    "  };\n"
+    "})()\n"
+    ;
+
+/* checks that the new global bindings are plain data which survive a
+   JS_WriteObject()/JS_ReadObject() round trip unchanged: no functions,
+   accessors, symbols, class instances or shared references */
+static const char preeval_check_source[] =
+    "(function (bindings) {\n"
+    "  var seen = new Set();\n"
+    "  function check(v) {\n"
+    "    var proto, keys, d, i;\n"
+    "    if (typeof v === 'function' || typeof v === 'symbol')\n"
+    "      return false;\n"
+    "    if (typeof v !== 'object' || v === null)\n"
+    "      return true;\n"
+    "    if (seen.has(v))\n"
+    "      return false;\n"
+    "    seen.add(v);\n"
+    "    proto = Object.getPrototypeOf(v);\n"
+    "    if (proto !== Object.prototype && proto !== Array.prototype)\n"
+    "      return false;\n"
+    "    if (Object.getOwnPropertySymbols(v).length != 0)\n"
+    "      return false;\n"
+    "    keys = Object.getOwnPropertyNames(v);\n"
+    "    for (i = 0; i < keys.length; i++) {\n"
+    "      d = Object.getOwnPropertyDescriptor(v, keys[i]);\n"
+    "      if (!('value' in d) || !check(d.value))\n"
+    "        return false;\n"
+    "    }\n"
+    "    return true;\n"
+    "  }\n"
+    "  return check(bindings);\n"
+    "})\n"
+    ;
+
+/* run a global script in its own context and output the global bindings it
+   defines. Return 0 if the result cannot be captured as plain data, 1 if
+   it was output and -1 on error. The context has no host functions
+   (print, timers...), so a script with such side effects throws and is
+   kept as bytecode, as are the scripts throwing, modifying the builtins or
+   leaving jobs pending. */
+static int preeval_file(JSContext *ctx, compile_unit_t *unit,
+                        const uint8_t *buf, size_t buf_len,
+                        const cache_key_t *key) {
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    JSContext *ectx, *ctx1;
+    JSValue global_obj, snapshot, val, check, modified;
+    JSPropertyEnum *before, *after;
+    uint32_t before_len, after_len, i, j;
+    int ret, count;
+
+    if (js_shake_has_lexical_decl((const char *)buf, buf_len))
+        return 0;
+
+    ectx = JS_NewContext(rt);
+    if (!ectx)
+        return -1;
+    global_obj = JS_GetGlobalObject(ectx);
+    before = after = NULL;
+    before_len = after_len = 0;
+    snapshot = JS_UNDEFINED;
+    modified = JS_Eval(ectx, preeval_builtins_source,
+                       sizeof(preeval_builtins_source) - 1, "<preeval>",
+                       JS_EVAL_TYPE_GLOBAL);
+    if (JS_IsException(modified))
+        goto exception;
+    if (JS_GetOwnPropertyNames(ectx, &before, &before_len, global_obj,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0)
+        goto exception;
+
+    ret = 0;
+    val = JS_Eval(ectx, (const char *)buf, buf_len, unit->filename,
+                  JS_EVAL_TYPE_GLOBAL);
+    if (JS_IsException(val))
+        goto done;
+    JS_FreeValue(ectx, val);
+    if (JS_IsJobPending(rt)) {
+        /* the jobs would not run when the snapshot is read */
+        while (JS_ExecutePendingJob(rt, &ctx1) != 0)
+            continue;
+        goto done;
+    }
+    val = JS_Call(ectx, modified, JS_UNDEFINED, 0, NULL);
+    if (JS_IsException(val) || JS_ToBool(ectx, val)) {
+        JS_FreeValue(ectx, val);
+        goto done;
+    }
+
+    if (JS_GetOwnPropertyNames(ectx, &after, &after_len, global_obj,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0)
+        goto exception;
+    snapshot = JS_NewObject(ectx);
+    count = 0;
+    for (i = 0; i < after_len; i++) {
+        for (j = 0; j < before_len; j++) {
+            if (before[j].atom == after[i].atom)
+                break;
+        }
+        if (j < before_len)
+            continue;
+        JS_DefinePropertyValue(ectx, snapshot, after[i].atom,
+                               JS_GetProperty(ectx, global_obj, after[i].atom),
+                               JS_PROP_C_W_E);
+        count++;
+    }
+    /* nothing to embed, the script only has side effects */
+    if (count == 0)
+        goto done;
+
+    check = JS_Eval(ectx, preeval_check_source, sizeof(preeval_check_source) - 1,
+                    "<preeval>", JS_EVAL_TYPE_GLOBAL);
+    val = JS_Call(ectx, check, JS_UNDEFINED, 1, (JSValueConst *)&snapshot);
+    ret = !JS_IsException(val) && JS_ToBool(ectx, val);
+    JS_FreeValue(ectx, val);
+    JS_FreeValue(ectx, check);
+    if (ret && output_object_code(ectx, unit, snapshot, unit->filename,
+                                  CODE_SNAPSHOT, key) < 0)
+        goto exception;
+ done:
+    /* the exception of the script, if any, is not an error */
+    JS_FreeValue(ectx, JS_GetException(ectx));
+    if (0) {
+    exception:
+        js_std_dump_error(ectx);
+        ret = -1;
+    }
+    for (i = 0; i < before_len; i++)
+        JS_FreeAtom(ectx, before[i].atom);
+    js_free(ectx, before);
+    for (i = 0; i < after_len; i++)
+        JS_FreeAtom(ectx, after[i].atom);
+    js_free(ectx, after);
+    JS_FreeValue(ectx, snapshot);
+    JS_FreeValue(ectx, modified);
+    JS_FreeValue(ectx, global_obj);
+    JS_FreeContext(ectx);
+    return ret;
+}
+
+/* -l: the modules imported with import('literal') by the output of the
+   unit are compiled after it, through the module loader, and are not
+   loaded at init. A module which cannot be found is left to the runtime,
+   with a warning. */
+static void compile_dynamic_imports(compiler_t *c, compile_unit_t *unit) {
+    JSContext *ctx = c->ctx;
+    char **names, *importer;
     uint8_t *buf;
-    char *c_name;
-    int eval_flags;
+    size_t buf_len;
+    DynBuf b;
+    JSValue obj;
+    int i, j, count;
+
+    c->unit = unit;
+    dbuf_init(&b);
+    /* the unit grows with the modules compiled in the loop */
+    for (i = 0; i < unit->count; i++) {
+        if (unit->array[i].kind == CODE_SNAPSHOT)
+            continue;
+        importer = strdup(unit->array[i].module_name);
+        buf = load_source(ctx, &buf_len, importer);
+        count = 0;
+        names = NULL;
+        if (buf) {
+            count = js_shake_dynamic_imports(importer, (const char *)buf,
+                                             buf_len, &names);
+            js_free(ctx, buf);
+        }
+        if (count < 0) {
+            fprintf(stderr, "Warning: '%s' cannot be analyzed, its dynamic "
+                    "imports are not embedded\n", importer);
+        }
+        for (j = 0; j < count; j++) {
+            /* a module importing it, compiled with the loader like the
+               static imports */
+            b.size = 0;
+            dbuf_putstr(&b, "import ");
+            dbuf_put_c_string(&b, names[j]);
+            dbuf_putstr(&b, ";");
+            dbuf_putc(&b, '\0');
+            obj = JS_Eval(ctx, (const char *)b.buf, b.size - 1,
+                          "<dynamic import>",
+                          JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+            if (JS_IsException(obj)) {
+                JS_FreeValue(ctx, JS_GetException(ctx));
+                fprintf(stderr, "Warning: '%s' imported by '%s' cannot be "
+                        "embedded, it is left to the runtime\n",
+                        names[j], importer);
+            }
+            JS_FreeValue(ctx, obj);
+            free(names[j]);
+        }
+        free(names);
+        free(importer);
+    }
+    dbuf_free(&b);
+}
+
+static int compile_file(compiler_t *c, compile_unit_t *unit) {
+    JSContext *ctx = c->ctx;
+    const char *filename = unit->filename;
+    uint8_t *buf;
+    int eval_flags, module, ret;
     JSValue obj;
     size_t buf_len;
+    cache_key_t key, *pkey;
+    cache_entry_t entry;
     
-    buf = js_load_file(ctx, &buf_len, filename);
+    c->unit = unit;
+    buf = load_source(ctx, &buf_len, filename);
     if (!buf) {
         fprintf(stderr, "Could not load '%s'\n", filename);
-        exit(1);
+        return -1;
     }
     eval_flags = JS_EVAL_FLAG_COMPILE_ONLY;
+    if (strip_debug)
+        eval_flags |= JS_EVAL_FLAG_STRIP;
+    module = unit->module;
     if (module < 0) {
         module = (has_suffix(filename, ".mjs") ||
                   JS_DetectModule((const char *)buf, buf_len));
+        unit->module = module;
+    }
+    pkey = NULL;
+    if (cache_dir || use_mem_cache) {
+        cache_init_key(&key, filename,
+                       (module ? CACHE_FLAG_MODULE : 0) |
+                       (byte_swap ? CACHE_FLAG_BSWAP : 0) |
+                       (strip_debug ? CACHE_FLAG_STRIP : 0) |
+                       (!module && preeval ? CACHE_FLAG_PREEVAL : 0),
+                       buf, buf_len);
+        if (cache_get(&key, &entry)) {
+            js_free(ctx, buf);
+            ret = output_cached_code(c, &key, &entry, NULL);
+            if (ret < 0)
+                js_std_dump_error(ctx);
+            return ret;
+        }
+        pkey = &key;
+    }
+    if (!module && preeval &&
+        !has_directive((const char *)buf, buf_len, "use no-preeval")) {
+        ret = preeval_file(ctx, unit, buf, buf_len, pkey);
+        if (ret != 0) {
+            js_free(ctx, buf);
+            return ret < 0 ? -1 : 0;
+        }
+        fprintf(stderr, "Warning: '%s' cannot be pre-evaluated, "
+                "its bytecode is used instead\n", filename);
     }
     if (module)
         eval_flags |= JS_EVAL_TYPE_MODULE;
     else
         eval_flags |= JS_EVAL_TYPE_GLOBAL;
     obj = JS_Eval(ctx, (const char *)buf, buf_len, filename, eval_flags);
+    js_free(ctx, buf);
     if (JS_IsException(obj)) {
         js_std_dump_error(ctx);
-        exit(1);
+        return -1;
     }
-    js_free(ctx, buf);
-    get_c_name(&c_name);
-    output_object_code(ctx, fo, obj, c_name, FALSE);
+    ret = output_object_code(ctx, unit, obj, filename, CODE_EVAL, pkey);
+    if (ret < 0)
+        js_std_dump_error(ctx);
     JS_FreeValue(ctx, obj);
+    return ret;
 }
 
-static const char init_c_header[] =
-    "#include \"quickjs.h\"\n"
+static void compiler_init(compiler_t *c) {
+    c->rt = JS_NewRuntime();
+    c->ctx = JS_NewContextRaw(c->rt);
+    JS_AddIntrinsicEval(c->ctx);
+    JS_AddIntrinsicRegExpCompiler(c->ctx);
+    c->unit = NULL;
+    c->queue = NULL;
+    c->id = 0;
+    
+    /* loader for ES6 modules */
+    JS_SetModuleLoaderFunc(c->rt, NULL, jsc_module_loader, c);
+}
+
+static void compiler_free(compiler_t *c) {
+    JS_FreeContext(c->ctx);
+    JS_FreeRuntime(c->rt);
+}
+
+/* compile the next pending units of the queue in a private runtime. A
+   worker takes the units in command line order, so that the modules it
+   emits for a unit are the ones a single runtime would have emitted,
+   minus the ones already emitted by earlier units (see output_unit()).
+   The modules compiled by other workers are read from the queue. */
+static void *compile_worker(void *opaque) {
+    compile_queue_t *q = opaque;
+    compiler_t c;
+    int i, j, *done, done_count;
+
+    /* the units compiled by this worker, whose dynamic imports are
+       compiled once the static imports of all of them are loaded: a
+       module is then only output after the static imports if none of
+       the units import it statically */
+    done = malloc(sizeof(done[0]) * max_int(q->count, 1));
+    done_count = 0;
+    compiler_init(&c);
+    pthread_mutex_lock(&q->lock);
+    c.id = q->worker_count++;
+    pthread_mutex_unlock(&q->lock);
+    if (q->waiting)
+        c.queue = q;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (i >= q->count)
+            break;
+        q->units[i].ret = compile_file(&c, &q->units[i]);
+        q->units[i].static_count = q->units[i].count;
+        if (done)
+            done[done_count++] = i;
+    }
+    for (j = 0; lazy_modules && j < done_count; j++) {
+        i = done[j];
+        if (q->units[i].ret == 0)
+            compile_dynamic_imports(&c, &q->units[i]);
+    }
+    free(done);
+    compiler_free(&c);
+    return NULL;
+}
+
+static void compile_units(compile_unit_t *units, int count, int jobs) {
+    compile_queue_t q;
+    pthread_t *threads;
+    int i, n;
+
+    memset(&q, 0, sizeof(q));
+    q.units = units;
+    q.count = count;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.module_cond, NULL);
+
+    if (jobs > count)
+        jobs = count;
+    if (jobs > 1) {
+        q.waiting = malloc(sizeof(q.waiting[0]) * jobs);
+        /* without it, each worker compiles the modules it imports */
+        if (q.waiting) {
+            for (i = 0; i < jobs; i++)
+                q.waiting[i] = -1;
+        }
+    }
+    threads = malloc(sizeof(threads[0]) * (jobs > 1 ? jobs - 1 : 1));
+    n = 0;
+    for (i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[n], NULL, compile_worker, &q) != 0)
+            break;
+        n++;
+    }
+    /* the main thread is a worker too */
+    compile_worker(&q);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    for (i = 0; i < q.module_count; i++) {
+        free(q.modules[i].name);
+        if (q.modules[i].native != q.modules[i].code)
+            free(q.modules[i].native);
+        free(q.modules[i].code);
+    }
+    free(q.modules);
+    free(q.waiting);
+    pthread_cond_destroy(&q.module_cond);
+    pthread_mutex_destroy(&q.lock);
+}
+
+/* add the size of a blob and the heap used once it is read, which is
+   returned */
+static size_t measure_code(const uint8_t *buf, size_t len) {
+    JSMemoryUsage before, after;
+    JSRuntime *rt = JS_GetRuntime(measure_ctx);
+    JSValue obj;
+    size_t heap_size;
+
+    JS_ComputeMemoryUsage(rt, &before);
+    obj = JS_ReadObject(measure_ctx, buf, len, JS_READ_OBJ_BYTECODE);
+    if (JS_IsException(obj)) {
+        js_std_dump_error(measure_ctx);
+        return 0;
+    }
+    JS_ComputeMemoryUsage(rt, &after);
+    /* modules stay referenced by the context, so they are not freed */
+    JS_FreeValue(measure_ctx, obj);
+    heap_size = after.memory_used_size - before.memory_used_size;
+    loaded_code_size += len;
+    loaded_heap_size += heap_size;
+    return heap_size;
+}
+
+static const char *code_kind_names[] = {
+    "eval", "module", "snapshot",
+};
+
+/* output the bytecode of a unit, skipping the modules output by the
+   previous units */
+static void output_unit(FILE *fo, compile_unit_t *unit) {
+    int i, flags;
+    size_t len, heap_size;
+    char *c_name;
+
+    for (i = 0; i < unit->count; i++) {
+        code_entry_t *e = &unit->array[i];
+        /* in a module set the input files are modules like their imports */
+        if (e->kind == CODE_MODULE || module_set) {
+            if (namelist_find(&module_list, e->module_name))
+                continue;
+            namelist_add(&module_list, e->module_name, NULL, 0);
+        }
+        /* a module reached with a static import by a unit is loaded at
+           init, even if another reaches it with import() first */
+        if (lazy_modules && e->kind == CODE_MODULE && i < unit->static_count &&
+            !namelist_find(&static_module_list, e->module_name))
+            namelist_add(&static_module_list, e->module_name, NULL, 0);
+        get_c_name(&c_name);
+        flags = e->kind;
+        if (e->kind == CODE_EVAL && !unit->module && !module_set) {
+            /* with -n, the scripts with template objects are read by each
+               tenant rather than once by the host */
+            if (!tenants || js_report_shareable(e->buf, e->len, byte_swap))
+                flags |= CODE_FLAG_SCRIPT;
+        }
+        namelist_add(&cname_list, c_name, e->module_name, flags);
+        len = output_blob(fo, c_name, e->buf, e->len);
+        heap_size = 0;
+        if (measure_ctx)
+            heap_size = measure_code(e->buf, e->len);
+        if (lazy_modules && e->kind == CODE_MODULE && i >= unit->static_count)
+            namelist_add(&lazy_module_list, e->module_name, NULL, heap_size);
+        if (report) {
+            js_report_add(report, c_name, e->module_name,
+                          code_kind_names[e->kind], e->buf, e->len, len);
+        }
+        if (module_set || (lazy_modules && e->kind == CODE_MODULE)) {
+            dbuf_putstr(&module_table, "  { ");
+            dbuf_put_c_string(&module_table, e->module_name);
+            dbuf_printf(&module_table, ", %s, %u, %u },\n", c_name,
+                        (unsigned int)len,
+                        compress_code ? (unsigned int)e->len : 0);
+        }
+        free(c_name);
+    }
+    for (i = 0; i < unit->init_modules.count; i++) {
+        namelist_entry_t *e = &unit->init_modules.array[i];
+        if (!namelist_find(&init_module_list, e->name))
+            namelist_add(&init_module_list, e->name, e->short_name, 0);
+    }
+}
+
+static const char init_c_includes[] =
+    "#include \"quickjs.h\"\n"
+    "#include \"js_std.h\"\n"
+    "#include <inttypes.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    ;
+
+static const char init_c_header[] =
+    "typedef struct @_instance {\n"
+    "  js_std_runtime_t *srt;\n"
+    "  JSRuntime *rt;\n"
+    "  JSContext *ctx;\n"
+    "  struct @_host *host; /* NULL if the instance owns its runtime */\n"
+    "  const JSValue *code; /* scripts run by @_reset(), NULL to read them */\n"
+    "  int64_t budget_us; /* deadline of the calls, see @_set_budget() */\n"
+    ;
+
+static const char init_c_header_end[] =
+    "} @_instance_t;\n"
+    "\n"
+    "/* instance bound to the calling thread, see @_use() */\n"
+    "static __thread @_instance_t *current_instance;\n"
+    "static __thread JSContext *ctx;\n"
+    "static __thread JSRuntime *rt;\n"
+    "\n"
+    ;
+
+static const char init_c_create[] =
+    "@_instance_t *@_create2(const js_std_runtime_options_t *options)\n"
+    "{\n"
+    "  @_instance_t *inst;\n"
+    "  JSContext *ctx;\n"
+    "\n"
+    "  inst = malloc(sizeof(*inst));\n"
+    "  if (!inst)\n"
+    "    return NULL;\n"
+    "  inst->srt = js_std_new_runtime(options);\n"
+    "  if (!inst->srt) {\n"
+    "    free(inst);\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  inst->rt = js_std_get_runtime(inst->srt);\n"
+    "  inst->host = NULL;\n"
+    "  inst->code = NULL;\n"
+    "  inst->budget_us = -1;\n"
+    "  inst->ctx = js_std_new_context(inst->srt);\n"
+    "  if (!inst->ctx) {\n"
+    "    js_std_free_runtime(inst->srt);\n"
+    "    free(inst);\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  ctx = inst->ctx;\n"
+    ;
+
+static const char init_c_footer[] =
+    "  js_std_init(ctx);\n"
+    "  return inst;\n"
+    "}\n"
+    "\n"
+    "@_instance_t *@_create()\n"
+    "{\n"
+    "  return @_create2(NULL);\n"
+    "}\n"
+    "\n"
+    "void @_destroy(@_instance_t *inst)\n"
+    "{\n"
+    "  if (!inst)\n"
+    "    return;\n"
+    "  if (inst == current_instance) {\n"
+    "    current_instance = NULL;\n"
+    "    ctx = NULL;\n"
+    "    rt = NULL;\n"
+    "  }\n"
+    ;
+
+static const char init_c_destroy[] =
+    "  js_std_cleanup(inst->ctx);\n"
+    "  JS_FreeContext(inst->ctx);\n"
+    "  if (!inst->host)\n"
+    "    js_std_free_runtime(inst->srt);\n"
+    "  free(inst);\n"
+    "}\n"
+    "\n"
+    "int @_loop(@_instance_t *inst, int64_t budget_ms)\n"
+    "{\n"
+    "  return js_std_loop(inst->ctx, budget_ms);\n"
+    "}\n"
+    "\n"
+    "void @_stats(@_instance_t *inst, js_std_stats_t *stats, int heap)\n"
+    "{\n"
+    "  js_std_get_stats(inst->ctx, stats, heap);\n"
+    "}\n"
+    "\n"
+    "int @_profile_start(@_instance_t *inst,\n"
+    "                    const js_std_profile_options_t *options)\n"
+    "{\n"
+    "  return js_std_profile_start(inst->ctx, options);\n"
+    "}\n"
+    "\n"
+    "int @_profile_dump(@_instance_t *inst, FILE *f)\n"
+    "{\n"
+    "  return js_std_profile_dump(inst->ctx, f);\n"
+    "}\n"
+    "\n"
+    "void @_profile_stop(@_instance_t *inst)\n"
+    "{\n"
+    "  js_std_profile_stop(inst->ctx);\n"
+    "}\n"
+    "\n"
+    "void @_set_budget(@_instance_t *inst, int64_t budget_us)\n"
+    "{\n"
+    "  inst->budget_us = budget_us;\n"
+    "}\n"
+    "\n"
+    "@_instance_t *@_use(@_instance_t *inst)\n"
+    "{\n"
+    "  @_instance_t *prev = current_instance;\n"
+    "  current_instance = inst;\n"
+    "  ctx = inst ? inst->ctx : NULL;\n"
+    "  rt = inst ? inst->rt : NULL;\n"
+    "  return prev;\n"
+    "}\n"
+    "\n"
+    "void init_@()\n"
+    "{\n"
+    "  @_use(@_create());\n"
+    "}\n"
+    "\n"
+    "void cleanup_@()\n"
+    "{\n"
+    "  @_destroy(@_use(NULL));\n"
+    "}\n"
+    ;
+
+/* new context replacing the one of an instance, on the same runtime: the
+   intrinsics are created again but the atoms and, for a tenant, the
+   bytecode of the scripts are reused */
+static const char init_c_reset[] =
+    "\n"
+    "/* restore the instance to its state after its creation, returns -1 and\n"
+    "   keeps the instance as is if out of memory */\n"
+    "int @_reset(@_instance_t *inst)\n"
+    "{\n"
+    "  JSContext *new_ctx;\n"
+    "\n"
+    "  new_ctx = js_std_new_context(inst->srt);\n"
+    "  if (!new_ctx)\n"
+    "    return -1;\n"
+    ;
+
+static const char init_c_reset_load[] =
+    "  js_std_cleanup(inst->ctx);\n"
+    "  JS_FreeContext(inst->ctx);\n"
+    "  inst->ctx = new_ctx;\n"
+    "  if (inst == current_instance)\n"
+    "    ctx = new_ctx;\n"
+    "  js2c_load(new_ctx, inst->code);\n"
+    ;
+
+/* -n: the scripts are read once by a host, owning the runtime, and run in
+   each tenant, an instance with its own context on the runtime of the
+   host */
+static const char init_c_host[] =
+    "typedef struct @_host {\n"
+    "  js_std_runtime_t *srt;\n"
+    "  JSRuntime *rt;\n"
+    "  JSContext *ctx; /* context the scripts are read in */\n"
+    ;
+
+static const char init_c_host_create[] =
+    "} @_host_t;\n"
+    "\n"
+    "@_host_t *@_host_create2(const js_std_runtime_options_t *options)\n"
+    "{\n"
+    "  @_host_t *host;\n"
+    "\n"
+    "  host = malloc(sizeof(*host));\n"
+    "  if (!host)\n"
+    "    return NULL;\n"
+    "  host->srt = js_std_new_runtime(options);\n"
+    "  if (!host->srt) {\n"
+    "    free(host);\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  host->rt = js_std_get_runtime(host->srt);\n"
+    "  host->ctx = js_std_new_context(host->srt);\n"
+    "  if (!host->ctx) {\n"
+    "    js_std_free_runtime(host->srt);\n"
+    "    free(host);\n"
+    "    return NULL;\n"
+    "  }\n"
+    ;
+
+static const char init_c_tenant[] =
+    "  return host;\n"
+    "}\n"
+    "\n"
+    "@_host_t *@_host_create()\n"
+    "{\n"
+    "  return @_host_create2(NULL);\n"
+    "}\n"
+    "\n"
+    "/* the tenants must be destroyed first */\n"
+    "void @_host_destroy(@_host_t *host)\n"
+    "{\n"
+    "  int i;\n"
+    "\n"
+    "  if (!host)\n"
+    "    return;\n"
+    "  for (i = 0; i < sizeof(host->code) / sizeof(host->code[0]); i++)\n"
+    "    JS_FreeValue(host->ctx, host->code[i]);\n"
+    "  JS_FreeContext(host->ctx);\n"
+    "  js_std_free_runtime(host->srt);\n"
+    "  free(host);\n"
+    "}\n"
+    "\n"
+    "@_instance_t *@_tenant_create(@_host_t *host)\n"
+    "{\n"
+    "  @_instance_t *inst;\n"
+    "  JSContext *ctx;\n"
+    "\n"
+    "  inst = malloc(sizeof(*inst));\n"
+    "  if (!inst)\n"
+    "    return NULL;\n"
+    "  inst->srt = host->srt;\n"
+    "  inst->rt = host->rt;\n"
+    "  inst->host = host;\n"
+    "  inst->code = host->code;\n"
+    "  inst->budget_us = -1;\n"
+    "  inst->ctx = js_std_new_context(host->srt);\n"
+    "  if (!inst->ctx) {\n"
+    "    free(inst);\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  ctx = inst->ctx;\n"
+    "  js2c_load(ctx, host->code);\n"
+    ;
+
+/* -d: a JS thread owning an instance, running the calls posted by the
+   other threads */
+static const char init_c_dispatcher[] =
+    "\n"
+    "static JSContext *js2c_dispatch_init(void *arg, void **popaque)\n"
+    "{\n"
+    "  @_instance_t *inst;\n"
+    "\n"
+    "  inst = @_create2(arg);\n"
+    "  if (!inst)\n"
+    "    return NULL;\n"
+    "  @_use(inst);\n"
+    "  *popaque = inst;\n"
+    "  return inst->ctx;\n"
+    "}\n"
+    "\n"
+    "static void js2c_dispatch_fini(void *opaque)\n"
+    "{\n"
+    "  @_use(NULL);\n"
+    "  @_destroy(opaque);\n"
+    "}\n"
+    "\n"
+    "/* the requests receive the instance as opaque */\n"
+    "js_std_dispatcher_t *@_dispatcher_start(const js_std_runtime_options_t *options)\n"
+    "{\n"
+    "  return js_std_dispatcher_start(js2c_dispatch_init, js2c_dispatch_fini,\n"
+    "                                 (void *)options);\n"
+    "}\n"
+    ;
+
+static const char bind_h_dispatcher[] =
+    "js_std_dispatcher_t *@_dispatcher_start(const js_std_runtime_options_t *);\n"
+    "\n"
+    ;
+
+/* -n: tenants created ahead of time, handed out by @_pool_get() */
+static const char init_c_pool[] =
+    "\n"
+    "typedef struct @_pool {\n"
+    "  @_host_t *host;\n"
+    "  int size;\n"
+    "  int count;\n"
+    "  @_instance_t **tab;\n"
+    "} @_pool_t;\n"
+    "\n"
+    "/* create up to count tenants (all if negative) until the pool is full,\n"
+    "   meant to be called when the thread of the host is idle. Returns the\n"
+    "   number of tenants in the pool. */\n"
+    "int @_pool_refill(@_pool_t *pool, int count)\n"
+    "{\n"
+    "  @_instance_t *inst;\n"
+    "\n"
+    "  while (pool->count < pool->size && count-- != 0) {\n"
+    "    inst = @_tenant_create(pool->host);\n"
+    "    if (!inst)\n"
+    "      break;\n"
+    "    pool->tab[pool->count++] = inst;\n"
+    "  }\n"
+    "  return pool->count;\n"
+    "}\n"
+    "\n"
+    "@_pool_t *@_pool_create(@_host_t *host, int size)\n"
+    "{\n"
+    "  @_pool_t *pool;\n"
+    "\n"
+    "  pool = malloc(sizeof(*pool));\n"
+    "  if (!pool)\n"
+    "    return NULL;\n"
+    "  pool->tab = malloc(sizeof(pool->tab[0]) * (size > 0 ? size : 1));\n"
+    "  if (!pool->tab) {\n"
+    "    free(pool);\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  pool->host = host;\n"
+    "  pool->size = size;\n"
+    "  pool->count = 0;\n"
+    "  @_pool_refill(pool, -1);\n"
+    "  return pool;\n"
+    "}\n"
+    "\n"
+    "/* a tenant of the pool, or a new one if it is empty */\n"
+    "@_instance_t *@_pool_get(@_pool_t *pool)\n"
+    "{\n"
+    "  if (pool->count > 0)\n"
+    "    return pool->tab[--pool->count];\n"
+    "  return @_tenant_create(pool->host);\n"
+    "}\n"
+    "\n"
+    "/* reset a tenant and keep it in the pool, or destroy it if the pool is\n"
+    "   full */\n"
+    "void @_pool_put(@_pool_t *pool, @_instance_t *inst)\n"
+    "{\n"
+    "  if (pool->count < pool->size && @_reset(inst) == 0)\n"
+    "    pool->tab[pool->count++] = inst;\n"
+    "  else\n"
+    "    @_destroy(inst);\n"
+    "}\n"
+    "\n"
+    "void @_pool_destroy(@_pool_t *pool)\n"
+    "{\n"
+    "  if (!pool)\n"
+    "    return;\n"
+    "  while (pool->count > 0)\n"
+    "    @_destroy(pool->tab[--pool->count]);\n"
+    "  free(pool->tab);\n"
+    "  free(pool);\n"
+    "}\n"
+    ;
+
+static const char bind_h_tenant[] =
+    "typedef struct @_host @_host_t;\n"
+    "\n"
+    "@_host_t *@_host_create2(const js_std_runtime_options_t *);\n"
+    "\n"
+    "@_host_t *@_host_create();\n"
+    "\n"
+    "void @_host_destroy(@_host_t *);\n"
+    "\n"
+    "@_instance_t *@_tenant_create(@_host_t *);\n"
+    "\n"
+    "typedef struct @_pool @_pool_t;\n"
+    "\n"
+    "@_pool_t *@_pool_create(@_host_t *, int);\n"
+    "\n"
+    "int @_pool_refill(@_pool_t *, int);\n"
+    "\n"
+    "@_instance_t *@_pool_get(@_pool_t *);\n"
+    "\n"
+    "void @_pool_put(@_pool_t *, @_instance_t *);\n"
+    "\n"
+    "void @_pool_destroy(@_pool_t *);\n"
+    "\n"
+    ;
+
+/* output a code template, replacing each '@' with the library name */
+static void output_template(FILE *fo, const char *tmpl, const char *cname) {
+    const char *p;
+    for (p = tmpl; *p != '\0'; p++) {
+        if (*p == '@')
+            fputs(cname, fo);
+        else
+            fputc(*p, fo);
+    }
+}
+
+/* Typed bindings (-g): C wrappers calling global functions with fixed
+   argument and return types, declared in a signature file (-t) or with
+   JSDoc tags in the input scripts. The functions are looked up once per
+   instance, and the values are converted with the QuickJS fast paths
+   of their type instead of generic conversions. */
+
+enum {
+    BIND_VOID,
+    BIND_BOOL,
+    BIND_INT32,
+    BIND_UINT32,
+    BIND_INT64,
+    BIND_DOUBLE,
+    BIND_STRING,
+};
+
+static const struct {
+    const char *name;
+    int type;
+} bind_type_names[] = {
+    { "void", BIND_VOID },
+    { "undefined", BIND_VOID },
+    { "bool", BIND_BOOL },
+    { "boolean", BIND_BOOL },
+    { "int32", BIND_INT32 },
+    { "uint32", BIND_UINT32 },
+    { "int64", BIND_INT64 },
+    { "double", BIND_DOUBLE },
+    { "number", BIND_DOUBLE },
+    { "string", BIND_STRING },
+};
+
+/* C type of the arguments, the result is returned through a pointer to
+   the same type, except strings which are returned as a malloc()ed copy */
+static const char *bind_c_types[] = {
+    "void", "int", "int32_t", "uint32_t", "int64_t", "double", "const char",
+};
+
+#define BIND_MAX_ARGS 16
+
+typedef struct {
+    char *name;
+    int ret;
+    int argc;
+    int args[BIND_MAX_ARGS];
+} binding_t;
+
+static binding_t *bindings;
+static int binding_count, binding_size;
+
+static int bind_find_type(const char *name, size_t len) {
+    int i;
+    for (i = 0; i < countof(bind_type_names); i++) {
+        if (strlen(bind_type_names[i].name) == len &&
+            !memcmp(bind_type_names[i].name, name, len))
+            return bind_type_names[i].type;
+    }
+    return -1;
+}
+
+static BOOL is_ident_char(int c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9');
+}
+
+static BOOL is_c_ident(const char *p, size_t len) {
+    size_t i;
+    if (len == 0 || (p[0] >= '0' && p[0] <= '9'))
+        return FALSE;
+    for (i = 0; i < len; i++) {
+        if (!is_ident_char(p[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* names of the generated API, which the functions <>_<binding> and the
+   types and functions derived from them would collide with */
+static const char *bind_reserved_names[] = {
+    "H", "instance", "instance_t", "create", "create2", "destroy", "use",
+    "loop", "stats", "reset", "set_budget", "call", "lookup", "atom",
+    "function_count", "latency", "latency_reset", "dispatcher_start",
+    "host", "host_t", "host_create", "host_create2", "host_destroy",
+    "tenant_create", "pool", "pool_t", "pool_create", "pool_refill",
+    "pool_get", "pool_put", "pool_destroy",
+};
+
+static BOOL bind_is_reserved(const char *name) {
+    int i;
+    for (i = 0; i < countof(bind_reserved_names); i++) {
+        if (!strcmp(name, bind_reserved_names[i]))
+            return TRUE;
+    }
+    /* the profiler API, the function enum and the dispatcher requests */
+    return !strncmp(name, "profile_", 8) || !strncmp(name, "fn_", 3) ||
+        has_suffix(name, "_post") || has_suffix(name, "_call_t");
+}
+
+/* a declaration replaces a previous one of the same function, so the
+   signature file takes precedence over JSDoc */
+static void bind_add(const binding_t *b) {
+    int i;
+    for (i = 0; i < binding_count; i++) {
+        if (!strcmp(bindings[i].name, b->name)) {
+            free(bindings[i].name);
+            bindings[i] = *b;
+            return;
+        }
+    }
+    if (binding_count == binding_size) {
+        binding_size = binding_size + (binding_size >> 1) + 4;
+        /* XXX: check for realloc failure */
+        bindings = realloc(bindings, sizeof(bindings[0]) * binding_size);
+    }
+    bindings[binding_count++] = *b;
+}
+
+static void bind_free(void) {
+    int i;
+    for (i = 0; i < binding_count; i++)
+        free(bindings[i].name);
+    free(bindings);
+    bindings = NULL;
+    binding_count = binding_size = 0;
+}
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+static const char *skip_ident(const char *p, const char *end) {
+    while (p < end && is_ident_char(*p))
+        p++;
+    return p;
+}
+
+/* signature file: one function per line, as a C like prototype with the
+   type names of bind_type_names, e.g. "int64 fib(int64 n)". Parameter
+   names are optional, '#' starts a comment. */
+static void bind_read_signatures(const char *filename) {
+    char line[1024];
+    const char *p, *end, *q;
+    binding_t b;
+    int line_num, t;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        end = strchr(line, '#');
+        if (!end)
+            end = line + strlen(line);
+        p = skip_space(line, end);
+        if (p == end)
+            continue;
+        memset(&b, 0, sizeof(b));
+        q = skip_ident(p, end);
+        b.ret = bind_find_type(p, q - p);
+        if (b.ret < 0)
+            goto fail;
+        p = skip_space(q, end);
+        q = skip_ident(p, end);
+        if (!is_c_ident(p, q - p))
+            goto fail;
+        b.name = strndup(p, q - p);
+        if (bind_is_reserved(b.name)) {
+            fprintf(stderr, "%s:%d: '%s' collides with the generated API\n",
+                    filename, line_num, b.name);
+            exit(1);
+        }
+        p = skip_space(q, end);
+        if (p == end || *p++ != '(')
+            goto fail;
+        p = skip_space(p, end);
+        while (p < end && *p != ')') {
+            if (b.argc == BIND_MAX_ARGS)
+                goto fail;
+            q = skip_ident(p, end);
+            t = bind_find_type(p, q - p);
+            if (t < 0 || t == BIND_VOID)
+                goto fail;
+            b.args[b.argc++] = t;
+            /* optional name */
+            p = skip_space(skip_ident(skip_space(q, end), end), end);
+            if (p < end && *p == ',')
+                p = skip_space(p + 1, end);
+            else if (p == end || *p != ')')
+                goto fail;
+        }
+        if (p == end || skip_space(p + 1, end) != end)
+            goto fail;
+        bind_add(&b);
+    }
+    fclose(f);
+    return;
+ fail:
+    fprintf(stderr, "%s:%d: invalid signature\n", filename, line_num);
+    exit(1);
+}
+
+/* JSDoc: a comment with @param {type} and @return(s) {type} tags
+   followed by "function name(". Only the functions declared in the global
+   scope of a script can be bound: the functions of an ES module, exported
+   or not, are not properties of the global object. */
+static void bind_scan_jsdoc(const char *filename, BOOL module) {
+    const char *buf, *p, *end, *c_end, *q, *tag;
+    binding_t b;
+    size_t len;
+    BOOL valid, exported;
+    int t, tag_count;
+
+    buf = (const char *)js_load_file(NULL, &len, filename);
+    if (!buf) {
+        fprintf(stderr, "Could not load '%s'\n", filename);
+        exit(1);
+    }
+    end = buf + len;
+    for (p = buf; (p = memmem(p, end - p, "/**", 3)) != NULL; p = c_end) {
+        c_end = memmem(p + 3, end - p - 3, "*/", 2);
+        if (!c_end)
+            break;
+        c_end += 2;
+        memset(&b, 0, sizeof(b));
+        valid = TRUE;
+        tag_count = 0;
+        for (q = p; (q = memmem(q, c_end - q, "@", 1)) != NULL; ) {
+            tag = ++q;
+            q = skip_ident(q, c_end);
+            if (!((q - tag == 5 && !memcmp(tag, "param", 5)) ||
+                  (q - tag == 6 && !memcmp(tag, "return", 6)) ||
+                  (q - tag == 7 && !memcmp(tag, "returns", 7))))
+                continue;
+            tag_count++;
+            q = skip_space(q, c_end);
+            if (q == c_end || *q != '{') {
+                valid = FALSE;
+                break;
+            }
+            q++;
+            t = bind_find_type(q, skip_ident(q, c_end) - q);
+            if (tag[0] == 'p') {
+                if (t < 0 || t == BIND_VOID || b.argc == BIND_MAX_ARGS)
+                    valid = FALSE;
+                else
+                    b.args[b.argc++] = t;
+            } else {
+                if (t < 0)
+                    valid = FALSE;
+                else
+                    b.ret = t;
+            }
+        }
+        if (tag_count == 0)
+            continue;
+        q = skip_space(c_end, end);
+        exported = FALSE;
+        if (end - q > 7 && !memcmp(q, "export", 6) && !is_ident_char(q[6])) {
+            q = skip_space(q + 6, end);
+            exported = TRUE;
+        }
+        if (!(end - q > 9 && !memcmp(q, "function", 8) &&
+              !is_ident_char(q[8])))
+            continue;
+        q = skip_space(q + 8, end);
+        tag = q;
+        q = skip_ident(q, end);
+        if (!is_c_ident(tag, q - tag) || skip_space(q, end) == end ||
+            *skip_space(q, end) != '(')
+            continue;
+        if (module || exported) {
+            fprintf(stderr, "Warning: '%.*s' in '%s' is not a global "
+                    "function, no binding is generated\n",
+                    (int)(q - tag), tag, filename);
+            continue;
+        }
+        if (!valid) {
+            fprintf(stderr, "Warning: '%.*s' in '%s' has unsupported JSDoc "
+                    "types, no binding is generated\n",
+                    (int)(q - tag), tag, filename);
+            continue;
+        }
+        b.name = strndup(tag, q - tag);
+        if (bind_is_reserved(b.name)) {
+            fprintf(stderr, "Warning: '%s' in '%s' collides with the "
+                    "generated API, no binding is generated\n",
+                    b.name, filename);
+            free(b.name);
+            continue;
+        }
+        bind_add(&b);
+    }
+    free((void *)buf);
+}
+
+/* Export table: the functions declared at the top level of the scripts,
+   and the functions with typed bindings, are looked up once when an
+   instance is created and kept in a table indexed by a generated enum,
+   see <>_call(). Their names are interned as atoms at the same time,
+   and found at run time with a perfect hash built at compile time. */
+
+static namelist_t export_list;
+
+static void export_add(const char *name, size_t len) {
+    char *s = strndup(name, len);
+    if (!namelist_find(&export_list, s))
+        namelist_add(&export_list, s, NULL, 0);
+    free(s);
+}
+
+static BOOL add_global_function(const char *ident, size_t len, int prev,
+                                const char *p, const char *end, void *opaque) {
+    const char *q, *name;
+
+    if (!(len == 8 && !memcmp(ident, "function", 8)))
+        return FALSE;
+    /* a function after an operator is an expression */
+    if (prev != 0 && strchr("=(,:?!|&+-*/[<>~^%", prev))
+        return FALSE;
+    /* generators and names which are not C identifiers are left out */
+    name = skip_space(p, end);
+    q = skip_ident(name, end);
+    if (is_c_ident(name, q - name) && skip_space(q, end) < end &&
+        *skip_space(q, end) == '(')
+        export_add(name, q - name);
+    return FALSE;
+}
+
+static void export_scan(const char *filename) {
+    uint8_t *buf;
+    size_t len;
+
+    buf = js_load_file(NULL, &len, filename);
+    if (!buf) {
+        fprintf(stderr, "Could not load '%s'\n", filename);
+        exit(1);
+    }
+    scan_top_level((const char *)buf, len, add_global_function, NULL);
+    free(buf);
+}
+
+/* must be the same as the js2c_hash() of export_c_lookup */
+static uint32_t export_hash(const char *s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    return h;
+}
+
+#define EXPORT_SEED(d) ((uint32_t)(d) * 0x9e3779b9u)
+#define EXPORT_MAX_DISP 65536
+#define EXPORT_MAX_BUCKET 64
+
+/* hash and displace: the names are split in buckets by a first hash, and
+   each bucket gets the seed of a second hash placing all its names in
+   free slots. Large buckets are placed first. */
+typedef struct {
+    int *disp;
+    int disp_size;
+    int *slots;         /* index of the name, -1 if free */
+    int slot_size;
+} export_hash_t;
+
+typedef struct {
+    int bucket;
+    int count;
+    int start;          /* first name of the bucket in keys */
+} export_bucket_t;
+
+static int export_bucket_cmp(const void *a, const void *b) {
+    const export_bucket_t *ba = a, *bb = b;
+    if (ba->count != bb->count)
+        return bb->count - ba->count;
+    return ba->bucket - bb->bucket;
+}
+
+static BOOL export_place(export_hash_t *ph, const export_bucket_t *bk,
+                         const int *keys) {
+    uint32_t pos[EXPORT_MAX_BUCKET];
+    int i, j, d;
+
+    for (d = 1; d < EXPORT_MAX_DISP; d++) {
+        for (i = 0; i < bk->count; i++) {
+            pos[i] = export_hash(export_list.array[keys[bk->start + i]].name,
+                                 EXPORT_SEED(d)) & (ph->slot_size - 1);
+            if (ph->slots[pos[i]] >= 0)
+                break;
+            for (j = 0; j < i && pos[j] != pos[i]; j++)
+                continue;
+            if (j < i)
+                break;
+        }
+        if (i == bk->count) {
+            ph->disp[bk->bucket] = d;
+            for (i = 0; i < bk->count; i++)
+                ph->slots[pos[i]] = keys[bk->start + i];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL export_try_hash(export_hash_t *ph) {
+    int n = export_list.count;
+    export_bucket_t *bk;
+    int *keys, *fill, i, b;
+    BOOL ret;
+
+    bk = calloc(ph->disp_size, sizeof(bk[0]));
+    keys = malloc(sizeof(keys[0]) * n);
+    fill = calloc(ph->disp_size, sizeof(fill[0]));
+    for (b = 0; b < ph->disp_size; b++)
+        bk[b].bucket = b;
+    for (i = 0; i < n; i++) {
+        b = export_hash(export_list.array[i].name, 0) & (ph->disp_size - 1);
+        bk[b].count++;
+    }
+    for (b = 1; b < ph->disp_size; b++)
+        bk[b].start = bk[b - 1].start + bk[b - 1].count;
+    for (i = 0; i < n; i++) {
+        b = export_hash(export_list.array[i].name, 0) & (ph->disp_size - 1);
+        keys[bk[b].start + fill[b]++] = i;
+    }
+    qsort(bk, ph->disp_size, sizeof(bk[0]), export_bucket_cmp);
+
+    for (i = 0; i < ph->slot_size; i++)
+        ph->slots[i] = -1;
+    memset(ph->disp, 0, sizeof(ph->disp[0]) * ph->disp_size);
+    ret = bk[0].count <= EXPORT_MAX_BUCKET;
+    for (b = 0; ret && b < ph->disp_size && bk[b].count > 0; b++)
+        ret = export_place(ph, &bk[b], keys);
+    free(fill);
+    free(keys);
+    free(bk);
+    return ret;
+}
+
+static void export_build_hash(export_hash_t *ph) {
+    ph->slot_size = 1;
+    while (ph->slot_size < export_list.count)
+        ph->slot_size <<= 1;
+    for (;;) {
+        ph->disp_size = max_int(ph->slot_size / 4, 1);
+        ph->disp = malloc(sizeof(ph->disp[0]) * ph->disp_size);
+        ph->slots = malloc(sizeof(ph->slots[0]) * ph->slot_size);
+        if (export_try_hash(ph))
+            break;
+        free(ph->disp);
+        free(ph->slots);
+        ph->slot_size <<= 1;
+    }
+}
+
+static void output_int_table(FILE *fo, const char *decl, const int *tab,
+                             int len) {
+    int i;
+    fprintf(fo, "%s[%d] = {", decl, len);
+    for (i = 0; i < len; i++) {
+        if (i % 12 == 0)
+            fprintf(fo, "\n ");
+        fprintf(fo, " %d,", tab[i]);
+    }
+    fprintf(fo, "\n};\n\n");
+}
+
+/* enum and API of the export table, before the instance and the input C
+   files which can use them */
+static void output_export_decl(FILE *fo, const char *cname) {
+    int i;
+    fprintf(fo, "/* exported functions, see %s_call() */\n"
+            "enum {\n", cname);
+    for (i = 0; i < export_list.count; i++)
+        fprintf(fo, "  %s_fn_%s,\n", cname, export_list.array[i].name);
+    fprintf(fo, "  %s_function_count\n"
+            "};\n\n", cname);
+    fprintf(fo, "struct %s_instance;\n\n"
+            "JSValue %s_call(struct %s_instance *inst, int idx, int argc, JSValueConst *argv);\n\n"
+            "int %s_lookup(const char *name);\n\n"
+            "JSAtom %s_atom(struct %s_instance *inst, int idx);\n\n"
+            "int %s_latency(struct %s_instance *inst, int idx, js_std_latency_t *lat);\n\n"
+            "void %s_latency_reset(struct %s_instance *inst);\n\n",
+            cname, cname, cname, cname, cname, cname, cname, cname, cname,
+            cname);
+}
+
+static const char export_c_lookup[] =
+    "static uint32_t js2c_hash(const char *s, uint32_t seed)\n"
+    "{\n"
+    "  uint32_t h = 2166136261u ^ seed;\n"
+    "  while (*s) {\n"
+    "    h ^= (uint8_t)*s++;\n"
+    "    h *= 16777619;\n"
+    "  }\n"
+    "  h ^= h >> 16;\n"
+    "  h *= 0x7feb352d;\n"
+    "  h ^= h >> 15;\n"
+    "  return h;\n"
+    "}\n"
+    "\n"
+    "/* called by @_create() and @_reset() once the code is evaluated */\n"
+    "static void js2c_bind(@_instance_t *inst)\n"
+    "{\n"
+    "  JSValue global_obj = JS_GetGlobalObject(inst->ctx);\n"
+    "  int i;\n"
+    "\n"
+    "  for (i = 0; i < @_function_count; i++) {\n"
+    "    inst->atoms[i] = JS_NewAtom(inst->ctx, js2c_function_names[i]);\n"
+    "    inst->functions[i] = JS_GetProperty(inst->ctx, global_obj, inst->atoms[i]);\n"
+    "  }\n"
+    "  JS_FreeValue(inst->ctx, global_obj);\n"
+    "}\n"
+    "\n"
+    "static void js2c_unbind(@_instance_t *inst)\n"
+    "{\n"
+    "  int i;\n"
+    "\n"
+    "  for (i = 0; i < @_function_count; i++) {\n"
+    "    JS_FreeValue(inst->ctx, inst->functions[i]);\n"
+    "    JS_FreeAtom(inst->ctx, inst->atoms[i]);\n"
+    "  }\n"
+    "}\n"
+    "\n"
+    ;
+
+/* the functions take the instance like the typed bindings */
+static const char export_c_api[] =
+    "\n"
+    "JSValue @_call(@_instance_t *inst, int idx, int argc, JSValueConst *argv)\n"
+    "{\n"
+    "  if ((unsigned int)idx >= @_function_count)\n"
+    "    return JS_ThrowRangeError(inst->ctx, \"invalid function index %d\", idx);\n"
+    "  return js_std_call_timed(inst->ctx, inst->functions[idx],\n"
+    "                           JS_UNDEFINED, argc, argv, inst->budget_us,\n"
+    "                           &inst->latency[idx]);\n"
+    "}\n"
+    "\n"
+    "JSAtom @_atom(@_instance_t *inst, int idx)\n"
+    "{\n"
+    "  if ((unsigned int)idx >= @_function_count)\n"
+    "    return JS_ATOM_NULL;\n"
+    "  return inst->atoms[idx];\n"
+    "}\n"
+    "\n"
+    "int @_latency(@_instance_t *inst, int idx, js_std_latency_t *lat)\n"
+    "{\n"
+    "  if ((unsigned int)idx >= @_function_count)\n"
+    "    return -1;\n"
+    "  *lat = inst->latency[idx];\n"
+    "  return 0;\n"
+    "}\n"
+    "\n"
+    "void @_latency_reset(@_instance_t *inst)\n"
+    "{\n"
+    "  memset(inst->latency, 0, sizeof(inst->latency));\n"
+    "}\n"
+    ;
+
+static void output_export_table(FILE *fo, const char *cname) {
+    export_hash_t ph;
+    int i;
+
+    fprintf(fo, "static const char *const js2c_function_names[] = {\n");
+    for (i = 0; i < export_list.count; i++)
+        fprintf(fo, "  \"%s\",\n", export_list.array[i].name);
+    fprintf(fo, "};\n\n");
+    export_build_hash(&ph);
+    output_int_table(fo, "static const uint32_t js2c_function_disp",
+                     ph.disp, ph.disp_size);
+    output_int_table(fo, "static const int js2c_function_slots",
+                     ph.slots, ph.slot_size);
+    output_template(fo, export_c_lookup, cname);
+    fprintf(fo, "int %s_lookup(const char *name)\n"
+            "{\n"
+            "  uint32_t d;\n"
+            "  int i;\n"
+            "\n"
+            "  d = js2c_function_disp[js2c_hash(name, 0) & %d];\n"
+            "  i = js2c_function_slots[js2c_hash(name, d * 0x9e3779b9u) & %d];\n"
+            "  if (i < 0 || strcmp(js2c_function_names[i], name) != 0)\n"
+            "    return -1;\n"
+            "  return i;\n"
+            "}\n\n", cname, ph.disp_size - 1, ph.slot_size - 1);
+    free(ph.disp);
+    free(ph.slots);
+}
+
+static void output_bind_prototype(FILE *fo, const char *cname,
+                                  const binding_t *b, BOOL names) {
+    int i;
+    fprintf(fo, "int %s_%s(%s_instance_t *%s", cname, b->name, cname,
+            names ? "inst" : "");
+    for (i = 0; i < b->argc; i++) {
+        fprintf(fo, ", %s%s", bind_c_types[b->args[i]],
+                b->args[i] == BIND_STRING ? " *" : "");
+        if (names)
+            fprintf(fo, "%sa%d", b->args[i] == BIND_STRING ? "" : " ", i);
+    }
+    if (b->ret == BIND_STRING)
+        fprintf(fo, ", char **%s", names ? "ret" : "");
+    else if (b->ret != BIND_VOID)
+        fprintf(fo, ", %s *%s", bind_c_types[b->ret], names ? "ret" : "");
+    fprintf(fo, ")");
+}
+
+static void output_bind_arg(FILE *fo, int i, int type) {
+    fprintf(fo, "  argv[%d] = ", i);
+    switch (type) {
+    case BIND_BOOL:
+        fprintf(fo, "JS_NewBool(ctx, a%d);\n", i);
+        break;
+    case BIND_INT32:
+        fprintf(fo, "JS_NewInt32(ctx, a%d);\n", i);
+        break;
+    case BIND_UINT32:
+        fprintf(fo, "a%d <= INT32_MAX ? JS_NewInt32(ctx, a%d) : "
+                "JS_NewFloat64(ctx, a%d);\n", i, i, i);
+        break;
+    case BIND_INT64:
+        fprintf(fo, "JS_NewInt64(ctx, a%d);\n", i);
+        break;
+    case BIND_DOUBLE:
+        fprintf(fo, "JS_NewFloat64(ctx, a%d);\n", i);
+        break;
+    case BIND_STRING:
+        fprintf(fo, "JS_NewString(ctx, a%d);\n", i);
+        break;
+    }
+}
+
+/* convert val to *ret, jumping to fail on error */
+static void output_bind_ret(FILE *fo, int type) {
+    static const char *to_int[] = {
+        [BIND_INT32] = "JS_ToInt32",
+        [BIND_UINT32] = "JS_ToUint32",
+        [BIND_INT64] = "JS_ToInt64",
+    };
+
+    switch (type) {
+    case BIND_VOID:
+        break;
+    case BIND_BOOL:
+        fprintf(fo, "  if (JS_VALUE_GET_TAG(val) == JS_TAG_BOOL) {\n"
+                "    *ret = JS_VALUE_GET_BOOL(val);\n"
+                "  } else {\n"
+                "    *ret = JS_ToBool(ctx, val);\n"
+                "    if (*ret < 0) {\n"
+                "      JS_FreeValue(ctx, val);\n"
+                "      goto fail;\n"
+                "    }\n"
+                "  }\n");
+        break;
+    case BIND_INT32:
+    case BIND_UINT32:
+    case BIND_INT64:
+        fprintf(fo, "  if (JS_VALUE_GET_TAG(val) == JS_TAG_INT) {\n"
+                "    *ret = JS_VALUE_GET_INT(val);\n"
+                "  } else if (%s(ctx, ret, val)) {\n"
+                "    JS_FreeValue(ctx, val);\n"
+                "    goto fail;\n"
+                "  }\n", to_int[type]);
+        break;
+    case BIND_DOUBLE:
+        fprintf(fo, "  if (JS_VALUE_GET_TAG(val) == JS_TAG_INT) {\n"
+                "    *ret = JS_VALUE_GET_INT(val);\n"
+                "  } else if (JS_TAG_IS_FLOAT64(JS_VALUE_GET_TAG(val))) {\n"
+                "    *ret = JS_VALUE_GET_FLOAT64(val);\n"
+                "  } else if (JS_ToFloat64(ctx, ret, val)) {\n"
+                "    JS_FreeValue(ctx, val);\n"
+                "    goto fail;\n"
+                "  }\n");
+        break;
+    case BIND_STRING:
+        fprintf(fo, "  {\n"
+                "    const char *str = JS_ToCString(ctx, val);\n"
+                "    if (!str) {\n"
+                "      JS_FreeValue(ctx, val);\n"
+                "      goto fail;\n"
+                "    }\n"
+                "    *ret = strdup(str);\n"
+                "    JS_FreeCString(ctx, str);\n"
+                "  }\n");
+        break;
+    }
+}
+
+/* the wrappers return 0, or -1 if an exception was raised. Only string
+   arguments have to be freed, numbers are not reference counted. */
+static void output_bind_wrappers(FILE *fo, const char *cname) {
+    const binding_t *b;
+    int i, j, string_count;
+
+    for (i = 0; i < binding_count; i++) {
+        b = &bindings[i];
+        string_count = 0;
+        for (j = 0; j < b->argc; j++) {
+            if (b->args[j] == BIND_STRING)
+                string_count++;
+        }
+        fprintf(fo, "\n");
+        output_bind_prototype(fo, cname, b, TRUE);
+        fprintf(fo, "\n{\n"
+                "  JSContext *ctx = inst->ctx;\n"
+                "  JSValue argv[%d], val;\n"
+                "\n", max_int(b->argc, 1));
+        for (j = 0; j < b->argc; j++)
+            output_bind_arg(fo, j, b->args[j]);
+        if (string_count > 0) {
+            fprintf(fo, "  if (");
+            for (j = 0; j < b->argc; j++) {
+                if (b->args[j] != BIND_STRING)
+                    continue;
+                fprintf(fo, "JS_IsException(argv[%d])", j);
+                if (--string_count > 0)
+                    fprintf(fo, " ||\n      ");
+            }
+            fprintf(fo, ")\n"
+                    "    val = JS_EXCEPTION;\n"
+                    "  else\n"
+                    "    val = js_std_call_timed(ctx, inst->functions[%s_fn_%s], JS_UNDEFINED, %d, argv,\n"
+                    "                            inst->budget_us, &inst->latency[%s_fn_%s]);\n",
+                    cname, b->name, b->argc, cname, b->name);
+            for (j = 0; j < b->argc; j++) {
+                if (b->args[j] == BIND_STRING)
+                    fprintf(fo, "  JS_FreeValue(ctx, argv[%d]);\n", j);
+            }
+        } else {
+            fprintf(fo, "  val = js_std_call_timed(ctx, inst->functions[%s_fn_%s], JS_UNDEFINED, %d, argv,\n"
+                    "                          inst->budget_us, &inst->latency[%s_fn_%s]);\n",
+                    cname, b->name, b->argc, cname, b->name);
+        }
+        fprintf(fo, "  if (JS_IsException(val))\n"
+                "    goto fail;\n");
+        output_bind_ret(fo, b->ret);
+        fprintf(fo, "  JS_FreeValue(ctx, val);\n"
+                "  return 0;\n"
+                " fail:\n"
+                "  if (js_std_timed_out(ctx)) {\n"
+                "    JS_FreeValue(ctx, JS_GetException(ctx));\n"
+                "    return JS_STD_TIMEOUT;\n"
+                "  }\n"
+                "  js_std_dump_error(ctx);\n"
+                "  return -1;\n"
+                "}\n");
+    }
+}
+
+/* request of a typed binding posted to the dispatcher (-d), the arguments
+   and the result are fields following the js_std_request_t */
+static void output_bind_call_decl(FILE *fo, const char *cname,
+                                  const binding_t *b) {
+    int i;
+    fprintf(fo, "typedef struct %s_%s_call {\n"
+            "  js_std_request_t req;\n", cname, b->name);
+    for (i = 0; i < b->argc; i++) {
+        fprintf(fo, "  %s%sa%d;\n", bind_c_types[b->args[i]],
+                b->args[i] == BIND_STRING ? " *" : " ", i);
+    }
+    if (b->ret == BIND_STRING)
+        fprintf(fo, "  char *ret; /* free() it */\n");
+    else if (b->ret != BIND_VOID)
+        fprintf(fo, "  %s ret;\n", bind_c_types[b->ret]);
+    fprintf(fo, "} %s_%s_call_t;\n", cname, b->name);
+}
+
+static void output_bind_post_prototype(FILE *fo, const char *cname,
+                                       const binding_t *b, BOOL names) {
+    fprintf(fo, "int %s_%s_post(js_std_dispatcher_t *%s, %s_%s_call_t *%s,\n"
+            "    js_std_request_func *%s)",
+            cname, b->name, names ? "d" : "", cname, b->name,
+            names ? "call" : "", names ? "done" : "");
+}
+
+static void output_bind_posts(FILE *fo, const char *cname) {
+    const binding_t *b;
+    int i, j;
+
+    for (i = 0; i < binding_count; i++) {
+        b = &bindings[i];
+        fprintf(fo, "\n");
+        output_bind_call_decl(fo, cname, b);
+        fprintf(fo, "\n"
+                "static void js2c_run_%s(js_std_request_t *req, void *opaque)\n"
+                "{\n", b->name);
+        if (b->argc > 0 || b->ret != BIND_VOID) {
+            fprintf(fo, "  %s_%s_call_t *call = (%s_%s_call_t *)req;\n",
+                    cname, b->name, cname, b->name);
+        }
+        fprintf(fo, "  req->status = %s_%s(opaque", cname, b->name);
+        for (j = 0; j < b->argc; j++)
+            fprintf(fo, ", call->a%d", j);
+        if (b->ret != BIND_VOID)
+            fprintf(fo, ", &call->ret");
+        fprintf(fo, ");\n"
+                "}\n"
+                "\n");
+        output_bind_post_prototype(fo, cname, b, TRUE);
+        fprintf(fo, "\n{\n"
+                "  call->req.func = js2c_run_%s;\n"
+                "  call->req.done = done;\n"
+                "  return js_std_dispatcher_post(d, &call->req);\n"
+                "}\n", b->name);
+    }
+}
+
+static const char bind_h_header[] =
+    "/* File generated automatically by the QuickJS compiler. */\n"
+    "\n"
+    "#ifndef JS2C_@_H\n"
+    "#define JS2C_@_H\n"
+    "\n"
     "#include <inttypes.h>\n"
+    "#include \"js_std.h\"\n"
+    "\n"
+    "typedef struct @_instance @_instance_t;\n"
+    "\n"
+    "@_instance_t *@_create2(const js_std_runtime_options_t *);\n"
+    "\n"
+    "@_instance_t *@_create();\n"
+    "\n"
+    "void @_destroy(@_instance_t *);\n"
+    "\n"
+    "int @_loop(@_instance_t *, int64_t);\n"
     "\n"
-    "extern void js_std_init(JSContext *);\n"
-    "extern void js_std_eval_binary(JSContext *, const uint8_t *, size_t, int);\n"
-    "extern void js_std_dump_error(JSContext *);\n"
+    "void @_stats(@_instance_t *, js_std_stats_t *, int);\n"
     "\n"
-    "static JSContext *ctx;\n"
-    "static JSRuntime *rt;\n"
+    "int @_profile_start(@_instance_t *, const js_std_profile_options_t *);\n"
     "\n"
+    "int @_profile_dump(@_instance_t *, FILE *);\n"
+    "\n"
+    "void @_profile_stop(@_instance_t *);\n"
+    "\n"
+    "void @_set_budget(@_instance_t *, int64_t);\n"
+    "\n"
+    "int @_reset(@_instance_t *);\n"
+    "\n"
+    "@_instance_t *@_use(@_instance_t *);\n"
+    "\n"
+    "void init_@();\n"
+    "\n"
+    "void cleanup_@();\n"
     ;
 
-static const char init_c_template1[] =
-    "void init_"
-    ;
+static void output_bind_header(const char *filename, const char *cname) {
+    FILE *f;
+    int i;
 
-static const char init_c_template2[] =
-    "()\n"
-    "{\n"
-    "  rt = JS_NewRuntime();\n"
-    "  ctx = JS_NewContext(rt);\n"
-    ;
+    f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    output_template(f, bind_h_header, cname);
+    if (tenants)
+        output_template(f, bind_h_tenant, cname);
+    if (dispatcher)
+        output_template(f, bind_h_dispatcher, cname);
+    if (export_list.count > 0) {
+        fprintf(f, "\n");
+        output_export_decl(f, cname);
+    }
+    for (i = 0; i < binding_count; i++) {
+        fprintf(f, "\n");
+        output_bind_prototype(f, cname, &bindings[i], FALSE);
+        fprintf(f, ";\n");
+    }
+    for (i = 0; dispatcher && i < binding_count; i++) {
+        fprintf(f, "\n");
+        output_bind_call_decl(f, cname, &bindings[i]);
+        fprintf(f, "\n");
+        output_bind_post_prototype(f, cname, &bindings[i], FALSE);
+        fprintf(f, ";\n");
+    }
+    fprintf(f, "\n#endif\n");
+    fclose(f);
+}
 
-static const char init_c_template3[] =
-    "  js_std_init(ctx);\n"
-    "}\n"
-    "void cleanup_"
-    ;
+/* output the code setting the module loader of the runtime rt */
+static void output_module_loader(FILE *fo, const char *rt) {
+    if (set_list.count > 0) {
+        fprintf(fo, "  JS_SetModuleLoaderFunc(%s, NULL, js_std_module_set_loader,\n"
+                "                         (void *)js2c_module_sets);\n", rt);
+    } else if (lazy_modules) {
+        fprintf(fo, "  JS_SetModuleLoaderFunc(%s, NULL, js_std_module_loader,\n"
+                "                         (void *)js2c_modules);\n", rt);
+    }
+}
 
-static const char init_c_template4[] =
-    "()\n"
-    "{\n"
-    "  JS_FreeContext(ctx);\n"
-    "  JS_FreeRuntime(rt);\n"
-    "}\n"
-    ;
+/* output the evaluation of the blobs in ctx. With shared set, the scripts
+   are run from the code array of the host when it is not NULL. */
+static void output_eval_code(FILE *fo, BOOL shared) {
+    int i;
+
+    for (i = 0; i < init_module_list.count; i++) {
+        namelist_entry_t *e = &init_module_list.array[i];
+        /* initialize the static C modules */
+        
+        fprintf(fo,
+                "  {\n"
+                "    extern JSModuleDef *js_init_module_%s(JSContext *ctx, const char *name);\n"
+                "    js_init_module_%s(ctx, \"%s\");\n"
+                "  }\n",
+                e->short_name, e->short_name, e->name);
+    }
+
+    for (i = 0; i < cname_list.count; i++) {
+        namelist_entry_t *e = &cname_list.array[i];
+        const char *indent = "";
+        if (lazy_modules && e->flags == CODE_MODULE)
+            continue;
+        if (shared && (e->flags & CODE_FLAG_SCRIPT)) {
+            fprintf(fo, "  if (code)\n"
+                    "    js_std_eval_function(ctx, code[%d]);\n"
+                    "  else\n", i);
+            indent = "  ";
+        }
+        if (e->flags == CODE_SNAPSHOT && compress_code) {
+            fprintf(fo, "  js_std_eval_snapshot_lz(ctx, %s, %s_size, %s_raw_size);\n",
+                    e->name, e->name, e->name);
+        } else if (e->flags == CODE_SNAPSHOT) {
+            fprintf(fo, "  js_std_eval_snapshot(ctx, %s, %s_size);\n",
+                    e->name, e->name);
+        } else if (compress_code) {
+            fprintf(fo, "%s  js_std_eval_binary_lz(ctx, %s, %s_size, %s_raw_size, %s);\n",
+                    indent, e->name, e->name, e->name,
+                    e->flags == CODE_MODULE ? "1" : "0");
+        } else {
+            fprintf(fo, "%s  js_std_eval_binary(ctx, %s, %s_size, %s);\n",
+                    indent, e->name, e->name,
+                    e->flags == CODE_MODULE ? "1" : "0");
+        }
+    }
+}
 
 void help(void) {
     printf("QuickJS version " CONFIG_VERSION "\n"
@@ -265,10 +2941,41 @@ void help(void) {
            "-c          output to an object file\n"
            "            when generating a C file or an object file, manual linking with libjs2c is required\n"
            "-o output   set the output filename\n"
-           "-N cname    set the name to be used in init_<>(), and cleanup_<>() methods (default = \"js_library\")\n"
+           "-N cname    set the name to be used in init_<>(), cleanup_<>() and <>_create() methods (default = \"js_library\")\n"
            "-m          compile as Javascript module (default=autodetect)\n"
            "-M module_name[,cname] add initialization code for an external C module\n"
            "-x          byte swapped output\n"
+           "-H          embed bytecode as C hex arrays when generating a shared library or\n"
+           "            an object file (default is to include it with .incbin)\n"
+           "-z          compress the embedded bytecode\n"
+           "-s          strip the debug info (line numbers, file names and function\n"
+           "            source) from the bytecode\n"
+           "-l          also embed the modules imported with import('literal'), loaded\n"
+           "            on first import instead of at init\n"
+           "-B          output a module set named by -N: the input files and their\n"
+           "            imports, loaded by the libraries using it with -U\n"
+           "-U set:module[,module...] load the modules from the module set built\n"
+           "            with -B instead of embedding them\n"
+           "-T          remove the functions and imports of ES modules which cannot\n"
+           "            be reached from the input files (tree shaking), -v lists them\n"
+           "-j jobs     compile the input files with several threads\n"
+           "-C dir      cache the compiled bytecode in dir, unchanged sources are not\n"
+           "            compiled again\n"
+           "-S socket   run as a compile server listening on the Unix socket (- for\n"
+           "            stdin), js2c forwards its arguments to it when the JS2C_SERVER\n"
+           "            environment variable is set to the socket\n"
+           "-t sigfile  generate typed C wrappers for the functions declared in sigfile\n"
+           "-g header   generate typed C wrappers for the functions with JSDoc types (and\n"
+           "            those of -t), and write the library API to header\n"
+           "-d          also generate <>_dispatcher_start(), running an instance on its own\n"
+           "            thread with calls posted from any thread, and <>_<fn>_post() for\n"
+           "            the typed wrappers\n"
+           "-n          also generate <>_host_create() and <>_tenant_create(): tenants\n"
+           "            are contexts sharing one runtime and the bytecode of the scripts\n"
+           "-R file     write a JSON report of the emitted bytecode: size of each blob,\n"
+           "            of its functions, constant pools, atoms and strings\n"
+           "-p          run global scripts at compile time and embed the resulting global\n"
+           "            bindings (scripts containing \"use no-preeval\" are left alone)\n"
            );
     exit(1);
 }
@@ -369,29 +3076,55 @@ typedef enum {
     OUTPUT_OBJECT
 } OutputTypeEnum;
 
-int main(int argc, char **argv) {
+static int js2c_server(const char *path);
+
+static int js2c_main(int argc, char **argv) {
     int c, i, verbose;
-    const char *out_filename, *cname;
+    const char *out_filename, *cname, *server_path;
+    const char *sig_filename, *header_filename, *report_filename;
     char cfilename[1024];
+    char blob_dir[1024];
     FILE *fo;
     FILE *in_fo;
-    JSRuntime *rt;
-    JSContext *ctx;
-    BOOL use_lto;
+    JSRuntime *measure_rt;
+    JSContext *report_ctx;
+    compile_unit_t *units;
+    int unit_count, jobs, cache_hits, cache_misses;
+    BOOL use_lto, hex_output, tree_shaking;
     int module;
     OutputTypeEnum output_type;
     char byte;
     
     out_filename = NULL;
+    server_path = NULL;
+    sig_filename = NULL;
+    header_filename = NULL;
+    report_filename = NULL;
     output_type = OUTPUT_EXECUTABLE;
     cname = "js_library";
     module = -1;
     byte_swap = FALSE;
+    lazy_modules = FALSE;
+    compress_code = FALSE;
+    module_set = FALSE;
+    preeval = FALSE;
+    strip_debug = FALSE;
+    hex_output = FALSE;
+    tree_shaking = FALSE;
+    tenants = FALSE;
+    dispatcher = FALSE;
+    /* a request of the compile server starts from the options of the
+       server, not from those of the previous request */
+    cache_dir = server_cache_dir;
+    blob_prefix = NULL;
+    jobs = 1;
+    cache_hits = 0;
+    cache_misses = 0;
     verbose = 0;
     use_lto = FALSE;
 
     for (;;) {
-        c = getopt(argc, argv, "ho:cN:f:mxevM:");
+        c = getopt(argc, argv, "ho:cN:f:mxHzslBU:TndpR:j:C:S:t:g:evM:");
         if (c == -1)
             break;
         switch(c) {
@@ -425,6 +3158,76 @@ int main(int argc, char **argv) {
         case 'x':
             byte_swap = TRUE;
             break;
+        case 'H':
+            hex_output = TRUE;
+            break;
+        case 'z':
+            compress_code = TRUE;
+            break;
+        case 's':
+            strip_debug = TRUE;
+            break;
+        case 'l':
+            lazy_modules = TRUE;
+            break;
+        case 'B':
+            module_set = TRUE;
+            break;
+        case 'U':
+            {
+                char *set, *p, *q;
+                set = strdup(optarg);
+                p = strchr(set, ':');
+                if (!p || p == set || p[1] == '\0') {
+                    fprintf(stderr, "Invalid module set '%s', expecting "
+                            "set:module[,module...]\n", optarg);
+                    exit(1);
+                }
+                *p++ = '\0';
+                if (!namelist_find(&set_list, set))
+                    namelist_add(&set_list, set, NULL, 0);
+                for (; p != NULL; p = q) {
+                    q = strchr(p, ',');
+                    if (q)
+                        *q++ = '\0';
+                    if (*p != '\0')
+                        namelist_add(&set_module_list, p, set, 0);
+                }
+                free(set);
+            }
+            break;
+        case 'T':
+            tree_shaking = TRUE;
+            break;
+        case 'n':
+            tenants = TRUE;
+            break;
+        case 'd':
+            dispatcher = TRUE;
+            break;
+        case 'p':
+            preeval = TRUE;
+            break;
+        case 'R':
+            report_filename = optarg;
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'S':
+            server_path = optarg;
+            break;
+        case 't':
+            sig_filename = optarg;
+            break;
+        case 'g':
+            header_filename = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                jobs = 1;
+            break;
         case 'v':
             verbose++;
             break;
@@ -433,6 +3236,26 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (server_path) {
+        if (cache_pipe_fd >= 0) {
+            fprintf(stderr, "A compile server cannot be started by a request\n");
+            exit(1);
+        }
+        if (cache_dir && mkdir(cache_dir, 0777) < 0 && errno != EEXIST) {
+            perror(cache_dir);
+            exit(1);
+        }
+        /* the requests run in the directory of their client */
+        if (cache_dir) {
+            server_cache_dir = realpath(cache_dir, NULL);
+            if (!server_cache_dir) {
+                perror(cache_dir);
+                exit(1);
+            }
+        }
+        return js2c_server(server_path);
+    }
+
     if (optind >= argc)
         help();
 
@@ -456,28 +3279,114 @@ int main(int argc, char **argv) {
     } else {
         pstrcpy(cfilename, sizeof(cfilename), out_filename);
     }
+
+#if defined(__ELF__)
+    /* the generated C file is only temporary, so the bytecode can be put
+       in temporary files next to it */
+    if (output_type != OUTPUT_C && !hex_output) {
+        snprintf(blob_dir, sizeof(blob_dir), "%.*s_",
+                 (int)(strlen(cfilename) - 2), cfilename);
+        blob_prefix = blob_dir;
+        if (!blob_cleanup_registered) {
+            atexit(remove_blob_files);
+            blob_cleanup_registered = TRUE;
+        }
+    }
+#endif
     
+    if (cache_dir && mkdir(cache_dir, 0777) < 0 && errno != EEXIST) {
+        perror(cache_dir);
+        exit(1);
+    }
+
+    dbuf_init(&module_table);
+    units = calloc(argc - optind, sizeof(units[0]));
+    unit_count = 0;
+    for (i = optind; i < argc; i++) {
+        if (strend(argv[i], ".c"))
+            continue;
+        units[unit_count].filename = argv[i];
+        units[unit_count].module = module_set ? 1 : module;
+        unit_count++;
+    }
+    if (tree_shaking) {
+        shake = js_shake_new(shake_is_external, NULL);
+        for (i = 0; i < unit_count; i++) {
+            compile_unit_t *unit = &units[i];
+            if (unit->module < 0) {
+                size_t len;
+                uint8_t *buf = js_load_file(NULL, &len, unit->filename);
+                if (!buf)
+                    continue;
+                unit->module = (has_suffix(unit->filename, ".mjs") ||
+                                JS_DetectModule((const char *)buf, len));
+                free(buf);
+            }
+            if (unit->module)
+                js_shake_add_entry(shake, unit->filename);
+        }
+        if (js_shake_run(shake) == 0)
+            js_shake_report(shake, stderr, verbose);
+    }
+    compile_units(units, unit_count, jobs);
+    for (i = 0; i < unit_count; i++) {
+        if (units[i].ret < 0)
+            exit(1);
+    }
+
+    if (sig_filename || header_filename) {
+        if (module_set) {
+            fprintf(stderr, "A module set cannot have bindings\n");
+            exit(1);
+        }
+        for (i = 0; i < unit_count; i++)
+            bind_scan_jsdoc(units[i].filename, units[i].module);
+        if (sig_filename)
+            bind_read_signatures(sig_filename);
+    }
+    if (!module_set) {
+        for (i = 0; i < unit_count; i++) {
+            if (!units[i].module)
+                export_scan(units[i].filename);
+        }
+        for (i = 0; i < binding_count; i++)
+            export_add(bindings[i].name, strlen(bindings[i].name));
+    }
+
+    /* byte swapped bytecode cannot be read on this host */
+    if (verbose && !byte_swap) {
+        measure_ctx = JS_NewContext(JS_NewRuntime());
+    }
+    if (report_filename) {
+        report_ctx = JS_NewContext(JS_NewRuntime());
+        report = js_report_new(report_ctx, byte_swap);
+    }
+
     fo = fopen(cfilename, "w");
     if (!fo) {
         perror(cfilename);
         exit(1);
     }
-    outfile = fo;
-    
-    rt = JS_NewRuntime();
-    ctx = JS_NewContextRaw(rt);
-    JS_AddIntrinsicEval(ctx);
-    JS_AddIntrinsicRegExpCompiler(ctx);
-    
-    /* loader for ES6 modules */
-    JS_SetModuleLoaderFunc(rt, NULL, jsc_module_loader, NULL);
 
     fprintf(fo, "/* File generated automatically by the QuickJS compiler. */\n"
             "\n"
             );
     
-    fprintf(fo, init_c_header);
+    output_template(fo, init_c_includes, cname);
+    if (export_list.count > 0)
+        output_export_decl(fo, cname);
+    if (!module_set) {
+        output_template(fo, init_c_header, cname);
+        if (export_list.count > 0) {
+            fprintf(fo, "  JSValue functions[%s_function_count];\n"
+                    "  JSAtom atoms[%s_function_count];\n"
+                    "  js_std_latency_t latency[%s_function_count];\n",
+                    cname, cname, cname);
+        }
+        output_template(fo, init_c_header_end, cname);
+    }
 
+    unit_count = 0;
     for (i = optind; i < argc; i++) {
         const char *filename = argv[i];
         if (strend(filename, ".c")) {
@@ -492,39 +3401,177 @@ int main(int argc, char **argv) {
             }
             fclose(in_fo);
         } else {
-            compile_file(ctx, fo, filename, module);
+            output_unit(fo, &units[unit_count]);
+            cache_hits += units[unit_count].cache_hits;
+            cache_misses += units[unit_count].cache_misses;
+            unit_free(&units[unit_count]);
+            unit_count++;
         }
     }
+    free(units);
 
-    fputs(init_c_template1, fo);
-    fputs(cname, fo);
-    fputs(init_c_template2, fo);
+    if (module_set) {
+        if (init_module_list.count > 0) {
+            fprintf(stderr, "A module set cannot initialize C modules\n");
+            exit(1);
+        }
+        fprintf(fo, "static const js_std_module_t js2c_modules[] = {\n");
+        fwrite(module_table.buf, 1, module_table.size, fo);
+        fprintf(fo, "  { NULL, NULL, 0, 0 },\n"
+                "};\n\n");
+        fprintf(fo, "const js_std_module_set_t js2c_module_set_%s = {\n"
+                "  \"%s\", js2c_modules\n"
+                "};\n", cname, cname);
+        goto done;
+    }
 
-    for (i = 0; i < init_module_list.count; i++) {
-        namelist_entry_t *e = &init_module_list.array[i];
-        /* initialize the static C modules */
-        
-        fprintf(fo,
-                "  {\n"
-                "    extern JSModuleDef *js_init_module_%s(JSContext *ctx, const char *name);\n"
-                "    js_init_module_%s(ctx, \"%s\");\n"
-                "  }\n",
-                e->short_name, e->short_name, e->name);
+    if (lazy_modules) {
+        /* imported modules are read by js_std_module_loader() on demand */
+        fprintf(fo, "static const js_std_module_t js2c_modules[] = {\n");
+        fwrite(module_table.buf, 1, module_table.size, fo);
+        fprintf(fo, "  { NULL, NULL, 0, 0 },\n"
+                "};\n\n");
     }
 
-    for (i = 0; i < cname_list.count; i++) {
-        namelist_entry_t *e = &cname_list.array[i];
-        fprintf(fo, "  js_std_eval_binary(ctx, %s, %s_size, %s);\n",
-                e->name, e->name,
-                e->flags ? "1" : "0");
+    if (set_list.count > 0) {
+        /* the modules of this library are searched first */
+        if (lazy_modules) {
+            fprintf(fo, "static const js_std_module_set_t js2c_local_modules = {\n"
+                    "  \"%s\", js2c_modules\n"
+                    "};\n\n", cname);
+        }
+        for (i = 0; i < set_list.count; i++) {
+            fprintf(fo, "extern const js_std_module_set_t js2c_module_set_%s;\n",
+                    set_list.array[i].name);
+        }
+        fprintf(fo, "\nstatic const js_std_module_set_t *const js2c_module_sets[] = {\n");
+        if (lazy_modules)
+            fprintf(fo, "  &js2c_local_modules,\n");
+        for (i = 0; i < set_list.count; i++) {
+            fprintf(fo, "  &js2c_module_set_%s,\n", set_list.array[i].name);
+        }
+        fprintf(fo, "  NULL,\n"
+                "};\n\n");
     }
-    fputs(init_c_template3, fo);
-    fputs(cname, fo);
-    fputs(init_c_template4, fo);
-    
-    JS_FreeContext(ctx);
-    JS_FreeRuntime(rt);
 
+    if (export_list.count > 0)
+        output_export_table(fo, cname);
+
+    fprintf(fo, "/* evaluate the code of the library in ctx, the scripts are run from\n"
+            "   code if not NULL (-n) */\n"
+            "static void js2c_load(JSContext *ctx, const JSValue *code)\n"
+            "{\n");
+    output_eval_code(fo, tenants);
+    fprintf(fo, "}\n\n");
+
+    output_template(fo, init_c_create, cname);
+    output_module_loader(fo, "inst->rt");
+    fprintf(fo, "  js2c_load(ctx, NULL);\n");
+    if (export_list.count > 0) {
+        fprintf(fo, "  memset(inst->latency, 0, sizeof(inst->latency));\n"
+                "  js2c_bind(inst);\n");
+    }
+    output_template(fo, init_c_footer, cname);
+    if (export_list.count > 0)
+        fprintf(fo, "  js2c_unbind(inst);\n");
+    output_template(fo, init_c_destroy, cname);
+    output_template(fo, init_c_reset, cname);
+    if (export_list.count > 0)
+        fprintf(fo, "  js2c_unbind(inst);\n");
+    output_template(fo, init_c_reset_load, cname);
+    if (export_list.count > 0)
+        fprintf(fo, "  js2c_bind(inst);\n");
+    fprintf(fo, "  js_std_init(new_ctx);\n"
+            "  return 0;\n"
+            "}\n");
+    if (tenants) {
+        fprintf(fo, "\n");
+        output_template(fo, init_c_host, cname);
+        fprintf(fo, "  JSValue code[%d]; /* scripts, JS_UNDEFINED for the other blobs */\n",
+                max_int(cname_list.count, 1));
+        output_template(fo, init_c_host_create, cname);
+        output_module_loader(fo, "host->rt");
+        for (i = 0; i < cname_list.count; i++) {
+            namelist_entry_t *e = &cname_list.array[i];
+            if (!(e->flags & CODE_FLAG_SCRIPT)) {
+                fprintf(fo, "  host->code[%d] = JS_UNDEFINED;\n", i);
+            } else if (compress_code) {
+                fprintf(fo, "  host->code[%d] = js_std_read_binary(host->ctx, %s, %s_size, %s_raw_size);\n",
+                        i, e->name, e->name, e->name);
+            } else {
+                fprintf(fo, "  host->code[%d] = js_std_read_binary(host->ctx, %s, %s_size, 0);\n",
+                        i, e->name, e->name);
+            }
+        }
+        if (cname_list.count == 0)
+            fprintf(fo, "  host->code[0] = JS_UNDEFINED;\n");
+        output_template(fo, init_c_tenant, cname);
+        if (export_list.count > 0) {
+            fprintf(fo, "  memset(inst->latency, 0, sizeof(inst->latency));\n"
+                    "  js2c_bind(inst);\n");
+        }
+        fprintf(fo, "  js_std_init(ctx);\n"
+                "  return inst;\n"
+                "}\n");
+        output_template(fo, init_c_pool, cname);
+    }
+    if (export_list.count > 0)
+        output_template(fo, export_c_api, cname);
+    output_bind_wrappers(fo, cname);
+    if (dispatcher) {
+        output_template(fo, init_c_dispatcher, cname);
+        output_bind_posts(fo, cname);
+    }
+    if (header_filename)
+        output_bind_header(header_filename, cname);
+
+ done:
+    if (measure_ctx) {
+        printf("bytecode%s: %u bytes, %u bytes of heap once loaded\n",
+               strip_debug ? " (stripped)" : "",
+               (unsigned int)loaded_code_size,
+               (unsigned int)loaded_heap_size);
+        measure_rt = JS_GetRuntime(measure_ctx);
+        JS_FreeContext(measure_ctx);
+        JS_FreeRuntime(measure_rt);
+    }
+    if (report) {
+        if (js_report_write(report, report_filename, cname) < 0) {
+            perror(report_filename);
+            exit(1);
+        }
+        js_report_free(report);
+        measure_rt = JS_GetRuntime(report_ctx);
+        JS_FreeContext(report_ctx);
+        JS_FreeRuntime(measure_rt);
+    }
+    if (verbose && (cache_dir || use_mem_cache)) {
+        printf("bytecode cache: %d hits, %d misses\n",
+               cache_hits, cache_misses);
+    }
+    if (verbose && compress_code) {
+        printf("bytecode compressed from %u to %u bytes (%u%%)\n",
+               (unsigned int)code_size, (unsigned int)compressed_code_size,
+               code_size ? (unsigned int)(compressed_code_size * 100 / code_size) : 100);
+    }
+    if (verbose && lazy_modules) {
+        int lazy_count = 0;
+        size_t lazy_heap_size = 0;
+        for (i = 0; i < lazy_module_list.count; i++) {
+            namelist_entry_t *e = &lazy_module_list.array[i];
+            if (namelist_find(&static_module_list, e->name))
+                continue;
+            lazy_count++;
+            lazy_heap_size += e->flags;
+        }
+        printf("%d modules only reached with import() deferred from init",
+               lazy_count);
+        if (!byte_swap)
+            printf(", %u bytes of heap once loaded",
+                   (unsigned int)lazy_heap_size);
+        printf("\n");
+    }
+    
     fclose(fo);
 
     int rc = 0;
@@ -535,8 +3582,561 @@ int main(int argc, char **argv) {
         rc = output_executable(out_filename, cfilename, use_lto, verbose,
                                  argv[0], 1);
     }
+    remove_blob_files();
+    blob_prefix = NULL;
     namelist_free(&cname_list);
     namelist_free(&cmodule_list);
     namelist_free(&init_module_list);
+    namelist_free(&module_list);
+    namelist_free(&static_module_list);
+    namelist_free(&lazy_module_list);
+    namelist_free(&set_module_list);
+    namelist_free(&set_list);
+    if (shake)
+        js_shake_free(shake);
+    bind_free();
+    namelist_free(&export_list);
+    dbuf_free(&module_table);
     return rc;
 }
+
+/* Compile server (-S). A request is a u32 count followed by count strings
+   (u32 length and bytes): the working directory of the client, then its
+   arguments. Each request is compiled by a process forked from the
+   server, which keeps the in-memory cache between requests. The response
+   is a series of frames: a type byte, a u32 length and the data. The
+   frames are queued per connection and sent when the client can receive
+   them, so a client which stops reading only delays its own request. */
+
+#define FRAME_STDOUT 'o'
+#define FRAME_STDERR 'e'
+#define FRAME_EXIT   'x'
+
+#define REQUEST_MAX_STRINGS 4096
+#define REQUEST_MAX_STRING_LEN 65536
+/* the output of a compile process is not read while more than that is
+   queued for its client */
+#define SERVER_OUTPUT_MAX (1024 * 1024)
+
+enum {
+    PIPE_STDOUT,
+    PIPE_STDERR,
+    PIPE_CACHE,
+    PIPE_COUNT,
+};
+
+typedef struct server_conn_t {
+    struct server_conn_t *next;
+    int in_fd, out_fd;
+    pid_t pid;              /* 0 until the request is received */
+    int pipes[PIPE_COUNT];  /* -1 once closed */
+    DynBuf req_buf;         /* partially received request */
+    DynBuf cache_buf;       /* partially received cache entries */
+    DynBuf out_buf;         /* frames not sent to the client yet */
+    BOOL out_failed;        /* the client is gone, the output is dropped */
+    BOOL finished;          /* the exit frame is queued */
+    /* entries of the fds in the poll array, -1 if not polled */
+    int in_pfd, out_pfd, pipe_pfd[PIPE_COUNT];
+} server_conn_t;
+
+/* send the queued frames without blocking, the rest is sent once the
+   client can receive it */
+static void server_flush(server_conn_t *conn) {
+    DynBuf *b = &conn->out_buf;
+    size_t pos;
+    ssize_t len;
+
+    pos = 0;
+    while (pos < b->size) {
+        len = write(conn->out_fd, b->buf + pos, b->size - pos);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* the client may be gone, the compilation still completes */
+            conn->out_failed = TRUE;
+            dbuf_free(b);
+            return;
+        }
+        pos += len;
+    }
+    memmove(b->buf, b->buf + pos, b->size - pos);
+    b->size -= pos;
+}
+
+static void queue_frame(server_conn_t *conn, int type, const void *data,
+                        uint32_t len) {
+    DynBuf *b = &conn->out_buf;
+
+    if (conn->out_failed)
+        return;
+    if (dbuf_putc(b, type) ||
+        dbuf_put(b, (const uint8_t *)&len, sizeof(len)) ||
+        dbuf_put(b, data, len)) {
+        conn->out_failed = TRUE;
+        dbuf_free(b);
+        return;
+    }
+    server_flush(conn);
+}
+
+static int send_string(int fd, const char *str) {
+    uint32_t len = strlen(str);
+    if (write_full(fd, &len, sizeof(len)) < 0 ||
+        write_full(fd, str, len) < 0)
+        return -1;
+    return 0;
+}
+
+static void free_strings(char **tab, uint32_t count) {
+    uint32_t i;
+    for (i = 0; i < count; i++)
+        free(tab[i]);
+    free(tab);
+}
+
+/* number of bytes to read to reach the end of the next field of the
+   request received so far, 0 once it is complete, -1 if it is invalid.
+   Reading no more than that leaves the next request in the pipe. */
+static int64_t request_need(const uint8_t *buf, size_t size) {
+    uint32_t count, len, i;
+    size_t pos;
+
+    if (size < sizeof(count))
+        return sizeof(count) - size;
+    memcpy(&count, buf, sizeof(count));
+    if (count < 2 || count > REQUEST_MAX_STRINGS)
+        return -1;
+    pos = sizeof(count);
+    for (i = 0; i < count; i++) {
+        if (size - pos < sizeof(len))
+            return pos + sizeof(len) - size;
+        memcpy(&len, buf + pos, sizeof(len));
+        if (len > REQUEST_MAX_STRING_LEN)
+            return -1;
+        pos += sizeof(len);
+        if (size - pos < len)
+            return pos + len - size;
+        pos += len;
+    }
+    return 0;
+}
+
+/* the strings of a complete request, NULL terminated */
+static char **request_strings(const uint8_t *buf, uint32_t *pcount) {
+    uint32_t count, len, i;
+    size_t pos;
+    char **tab;
+
+    memcpy(&count, buf, sizeof(count));
+    tab = calloc(count + 1, sizeof(tab[0]));
+    if (!tab)
+        return NULL;
+    pos = sizeof(count);
+    for (i = 0; i < count; i++) {
+        memcpy(&len, buf + pos, sizeof(len));
+        pos += sizeof(len);
+        tab[i] = strndup((const char *)buf + pos, len);
+        if (!tab[i]) {
+            free_strings(tab, count);
+            return NULL;
+        }
+        pos += len;
+    }
+    *pcount = count;
+    return tab;
+}
+
+static server_conn_t *server_conns;
+
+static void server_close_conn(server_conn_t *conn) {
+    server_conn_t **pc;
+    int i;
+
+    for (i = 0; i < PIPE_COUNT; i++) {
+        if (conn->pipes[i] >= 0)
+            close(conn->pipes[i]);
+    }
+    if (conn->in_fd > 2)
+        close(conn->in_fd);
+    if (conn->out_fd > 2 && conn->out_fd != conn->in_fd)
+        close(conn->out_fd);
+    for (pc = &server_conns; *pc; pc = &(*pc)->next) {
+        if (*pc == conn) {
+            *pc = conn->next;
+            break;
+        }
+    }
+    dbuf_free(&conn->req_buf);
+    dbuf_free(&conn->cache_buf);
+    dbuf_free(&conn->out_buf);
+    free(conn);
+}
+
+/* fork the process compiling a received request */
+static int server_start_request(server_conn_t *conn, int listen_fd) {
+    int fds[PIPE_COUNT][2];
+    char **tab;
+    uint32_t count;
+    server_conn_t *c;
+    int i, n;
+
+    tab = request_strings(conn->req_buf.buf, &count);
+    dbuf_free(&conn->req_buf);
+    if (!tab)
+        return -1;
+    for (n = 0; n < PIPE_COUNT; n++) {
+        if (pipe(fds[n]) < 0)
+            goto fail;
+    }
+    fflush(NULL);
+    conn->pid = fork();
+    if (conn->pid < 0)
+        goto fail;
+    if (conn->pid == 0) {
+        /* the compile process only keeps its pipes */
+        if (listen_fd >= 0)
+            close(listen_fd);
+        for (c = server_conns; c; c = c->next) {
+            for (i = 0; i < PIPE_COUNT; i++) {
+                if (c->pipes[i] >= 0)
+                    close(c->pipes[i]);
+            }
+            if (c->in_fd > 2)
+                close(c->in_fd);
+            if (c->out_fd > 2 && c->out_fd != c->in_fd)
+                close(c->out_fd);
+        }
+        for (i = 0; i < PIPE_COUNT; i++)
+            close(fds[i][0]);
+        dup2(fds[PIPE_STDOUT][1], 1);
+        dup2(fds[PIPE_STDERR][1], 2);
+        close(fds[PIPE_STDOUT][1]);
+        close(fds[PIPE_STDERR][1]);
+        close(0);
+        cache_pipe_fd = fds[PIPE_CACHE][1];
+        if (chdir(tab[0]) < 0) {
+            perror(tab[0]);
+            exit(1);
+        }
+        optind = 1;
+        exit(js2c_main(count - 1, tab + 1));
+    }
+    for (i = 0; i < PIPE_COUNT; i++) {
+        close(fds[i][1]);
+        conn->pipes[i] = fds[i][0];
+    }
+    free_strings(tab, count);
+    return 0;
+ fail:
+    for (i = 0; i < n; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    free_strings(tab, count);
+    return -1;
+}
+
+/* read what the client sent without blocking the other requests, and
+   start the compilation once the request is complete. Returns -1 at the
+   end of the input or if the request is invalid. */
+static int server_read_request(server_conn_t *conn, int listen_fd) {
+    uint8_t buf[4096];
+    int64_t need;
+    ssize_t len;
+
+    need = request_need(conn->req_buf.buf, conn->req_buf.size);
+    if (need < 0)
+        return -1;
+    len = read(conn->in_fd, buf, min_int64(need, sizeof(buf)));
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (len <= 0 || dbuf_put(&conn->req_buf, buf, len))
+        return -1;
+    need = request_need(conn->req_buf.buf, conn->req_buf.size);
+    if (need < 0)
+        return -1;
+    if (need > 0)
+        return 0;
+    return server_start_request(conn, listen_fd);
+}
+
+/* add the complete cache entries received from a compile process */
+static void server_read_cache(server_conn_t *conn) {
+    DynBuf *b = &conn->cache_buf;
+    size_t pos;
+    uint64_t hash;
+    uint32_t len;
+
+    pos = 0;
+    while (b->size - pos >= sizeof(hash) + sizeof(len)) {
+        memcpy(&hash, b->buf + pos, sizeof(hash));
+        memcpy(&len, b->buf + pos + sizeof(hash), sizeof(len));
+        if (b->size - pos - sizeof(hash) - sizeof(len) < len)
+            break;
+        mem_cache_add(hash, b->buf + pos + sizeof(hash) + sizeof(len), len);
+        pos += sizeof(hash) + sizeof(len) + len;
+    }
+    memmove(b->buf, b->buf + pos, b->size - pos);
+    b->size -= pos;
+}
+
+/* queue the output of a compile process, returns TRUE once it is done */
+static BOOL server_read_pipe(server_conn_t *conn, int i) {
+    uint8_t buf[65536];
+    ssize_t len;
+    int status, code;
+
+    len = read(conn->pipes[i], buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+        return FALSE;
+    if (len <= 0) {
+        close(conn->pipes[i]);
+        conn->pipes[i] = -1;
+        for (i = 0; i < PIPE_COUNT; i++) {
+            if (conn->pipes[i] >= 0)
+                return FALSE;
+        }
+        code = 1;
+        if (waitpid(conn->pid, &status, 0) == conn->pid && WIFEXITED(status))
+            code = WEXITSTATUS(status);
+        queue_frame(conn, FRAME_EXIT, &code, sizeof(code));
+        conn->finished = TRUE;
+        return TRUE;
+    }
+    if (i == PIPE_CACHE) {
+        dbuf_put(&conn->cache_buf, buf, len);
+        server_read_cache(conn);
+    } else {
+        queue_frame(conn, i == PIPE_STDOUT ? FRAME_STDOUT : FRAME_STDERR,
+                    buf, len);
+    }
+    return FALSE;
+}
+
+static server_conn_t *server_new_conn(int in_fd, int out_fd) {
+    server_conn_t *conn;
+    int i;
+
+    conn = calloc(1, sizeof(*conn));
+    if (!conn)
+        return NULL;
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    for (i = 0; i < PIPE_COUNT; i++)
+        conn->pipes[i] = -1;
+    dbuf_init(&conn->req_buf);
+    dbuf_init(&conn->cache_buf);
+    dbuf_init(&conn->out_buf);
+    conn->next = server_conns;
+    server_conns = conn;
+    return conn;
+}
+
+static int js2c_server(const char *path) {
+    struct sockaddr_un addr;
+    struct pollfd *pfds;
+    server_conn_t *conn, *next;
+    int listen_fd, fd, npfds, i, n;
+    BOOL use_stdin, stdin_busy, poll_new;
+
+    use_stdin = !strcmp(path, "-");
+    listen_fd = -1;
+    if (!use_stdin) {
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Socket path too long: '%s'\n", path);
+            return 1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path);
+        if (listen_fd < 0 ||
+            bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, 64) < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    use_mem_cache = TRUE;
+    stdin_busy = FALSE;
+    pfds = NULL;
+
+    for (;;) {
+        /* one poll entry for new requests, then the requests being
+           received, the pipes and the pending output */
+        n = 1;
+        for (conn = server_conns; conn; conn = conn->next)
+            n += PIPE_COUNT + 2;
+        free(pfds);
+        pfds = calloc(n, sizeof(pfds[0]));
+        if (!pfds)
+            return 1;
+        npfds = 0;
+        if (!use_stdin) {
+            pfds[npfds].fd = listen_fd;
+            pfds[npfds++].events = POLLIN;
+        } else if (!stdin_busy) {
+            /* stdin requests are handled one at a time */
+            pfds[npfds].fd = 0;
+            pfds[npfds++].events = POLLIN;
+        }
+        /* stdin is also the input of the request it is reading */
+        poll_new = npfds > 0;
+        for (conn = server_conns; conn; conn = conn->next) {
+            conn->in_pfd = conn->out_pfd = -1;
+            for (i = 0; i < PIPE_COUNT; i++)
+                conn->pipe_pfd[i] = -1;
+            if (conn->out_buf.size > 0) {
+                conn->out_pfd = npfds;
+                pfds[npfds].fd = conn->out_fd;
+                pfds[npfds++].events = POLLOUT;
+            }
+            if (conn->pid == 0) {
+                conn->in_pfd = npfds;
+                pfds[npfds].fd = conn->in_fd;
+                pfds[npfds++].events = POLLIN;
+                continue;
+            }
+            for (i = 0; i < PIPE_COUNT; i++) {
+                /* the compile process waits while its client is slow */
+                if (conn->pipes[i] < 0 ||
+                    (i != PIPE_CACHE &&
+                     conn->out_buf.size >= SERVER_OUTPUT_MAX))
+                    continue;
+                conn->pipe_pfd[i] = npfds;
+                pfds[npfds].fd = conn->pipes[i];
+                pfds[npfds++].events = POLLIN;
+            }
+        }
+        if (poll(pfds, npfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        for (conn = server_conns; conn; conn = next) {
+            next = conn->next;
+            if (conn->out_pfd >= 0 && pfds[conn->out_pfd].revents)
+                server_flush(conn);
+            if (conn->pid == 0) {
+                if (conn->in_pfd < 0 || !pfds[conn->in_pfd].revents)
+                    continue;
+                if (server_read_request(conn, listen_fd) < 0) {
+                    /* end of input */
+                    if (conn->in_fd == 0)
+                        goto done;
+                    server_close_conn(conn);
+                }
+                continue;
+            }
+            for (i = 0; i < PIPE_COUNT; i++) {
+                if (conn->pipe_pfd[i] < 0 || !pfds[conn->pipe_pfd[i]].revents)
+                    continue;
+                if (server_read_pipe(conn, i))
+                    break;
+            }
+            /* the connection is closed once its response is sent */
+            if (conn->finished &&
+                (conn->out_failed || conn->out_buf.size == 0)) {
+                if (conn->in_fd == 0)
+                    stdin_busy = FALSE;
+                server_close_conn(conn);
+            }
+        }
+        if (poll_new && pfds[0].revents) {
+            if (use_stdin) {
+                /* the request is read by the next iterations */
+                if (!(pfds[0].revents & POLLIN) || !server_new_conn(0, 1))
+                    break;
+                stdin_busy = TRUE;
+            } else {
+                fd = accept(listen_fd, NULL, NULL);
+                if (fd < 0)
+                    continue;
+                /* stdout is left blocking, it is shared with the parent */
+                if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+                    !server_new_conn(fd, fd))
+                    close(fd);
+            }
+        }
+    }
+ done:
+    free(pfds);
+    return 0;
+}
+
+/* forward the arguments to the server listening on path. Returns -1 if it
+   cannot be reached, so that the compilation is done locally. */
+static int js2c_client(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    uint8_t type, buf[65536];
+    uint32_t count, len, n;
+    int fd, i, code;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || !getcwd(cwd, sizeof(cwd)))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    count = argc + 1;
+    if (write_full(fd, &count, sizeof(count)) < 0 || send_string(fd, cwd) < 0)
+        goto lost;
+    for (i = 0; i < argc; i++) {
+        if (send_string(fd, argv[i]) < 0)
+            goto lost;
+    }
+    for (;;) {
+        if (read_full(fd, &type, 1) < 0 ||
+            read_full(fd, &len, sizeof(len)) < 0)
+            goto lost;
+        if (type == FRAME_EXIT) {
+            if (len != sizeof(code) || read_full(fd, &code, sizeof(code)) < 0)
+                goto lost;
+            close(fd);
+            return code;
+        }
+        while (len > 0) {
+            n = min_uint32(len, sizeof(buf));
+            if (read_full(fd, buf, n) < 0)
+                goto lost;
+            fwrite(buf, 1, n, type == FRAME_STDERR ? stderr : stdout);
+            len -= n;
+        }
+    }
+ lost:
+    fprintf(stderr, "Lost the connection to the js2c server '%s'\n", path);
+    close(fd);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char *server;
+    int i, ret;
+
+    /* forward to the compile server, unless starting one */
+    server = getenv("JS2C_SERVER");
+    if (server && server[0] != '\0') {
+        for (i = 1; i < argc; i++) {
+            if (!strncmp(argv[i], "-S", 2))
+                break;
+        }
+        if (i == argc) {
+            ret = js2c_client(server, argc, argv);
+            if (ret >= 0)
+                return ret;
+        }
+    }
+    return js2c_main(argc, argv);
+}
@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "cutils.h"
+#include "quickjs.h"
+#include "js_std.h"
+
+/* Dispatcher of calls from any thread into a JS thread owning a context.
+   Requests are intrusive nodes of a multiple producer, single consumer
+   queue (D. Vyukov): posting is one atomic exchange and one store, so
+   producers never wait for each other or for the JS thread. The JS thread
+   runs all the queued requests on each wakeup, then the pending jobs and
+   timers of its context, and only sleeps (on a condition variable) when
+   the queue is empty. The mutex is only taken by a producer when the JS
+   thread sleeps, and on completion when a thread waits for a request. */
+
+/* requests run before the jobs and timers are given a turn */
+#define DISPATCH_BATCH 256
+/* time given to the timers between two batches, in ms: a timer re-armed
+   from its own callback must not keep the requests waiting */
+#define DISPATCH_TIMER_BUDGET 1
+
+struct js_std_dispatcher_t {
+    /* producers push at head, the JS thread pops at tail */
+    js_std_request_t *head;
+    js_std_request_t *tail;
+    js_std_request_t stub;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake_cond;   /* signaled when a request is posted */
+    pthread_cond_t done_cond;   /* broadcast when a request completes */
+    int sleeping;
+    int waiters;
+    int stopping;
+    int started;                /* 1 once init has run, -1 if it failed */
+    js_std_dispatch_init_func *init;
+    js_std_dispatch_fini_func *fini;
+    void *arg;
+    JSContext *ctx;
+    void *opaque;
+};
+
+static void queue_push(js_std_dispatcher_t *d, js_std_request_t *req) {
+    js_std_request_t *prev;
+
+    __atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&d->head, req, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+/* returns NULL if the queue is empty, or if the request pushed last is
+   not linked yet */
+static js_std_request_t *queue_pop(js_std_dispatcher_t *d) {
+    js_std_request_t *tail = d->tail, *next, *head;
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &d->stub) {
+        if (!next)
+            return NULL;
+        d->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        d->tail = next;
+        return tail;
+    }
+    head = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+    if (tail != head)
+        return NULL;
+    queue_push(d, &d->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        d->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static BOOL queue_empty(js_std_dispatcher_t *d) {
+    return __atomic_load_n(&d->head, __ATOMIC_SEQ_CST) == d->tail &&
+        d->tail == &d->stub;
+}
+
+static void request_complete(js_std_dispatcher_t *d, js_std_request_t *req) {
+    /* the request belongs to the callback, it may free it */
+    if (req->done) {
+        req->done(req, d->opaque);
+        return;
+    }
+    __atomic_store_n(&req->finished, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&d->waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&d->lock);
+        pthread_cond_broadcast(&d->done_cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+}
+
+/* sleep until a request is posted or the next timer expires */
+static void dispatch_wait(js_std_dispatcher_t *d) {
+    struct timespec ts;
+    int64_t delay;
+
+    delay = js_std_next_timer(d->ctx);
+    if (delay == 0)
+        return;
+    pthread_mutex_lock(&d->lock);
+    __atomic_store_n(&d->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (queue_empty(d) && !__atomic_load_n(&d->stopping, __ATOMIC_SEQ_CST)) {
+        if (delay < 0) {
+            pthread_cond_wait(&d->wake_cond, &d->lock);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += delay / 1000;
+            ts.tv_nsec += (delay % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&d->wake_cond, &d->lock, &ts);
+        }
+    }
+    __atomic_store_n(&d->sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void *dispatch_thread(void *arg) {
+    js_std_dispatcher_t *d = arg;
+    js_std_request_t *req;
+    int n;
+
+    d->ctx = d->init(d->arg, &d->opaque);
+    pthread_mutex_lock(&d->lock);
+    d->started = d->ctx ? 1 : -1;
+    pthread_cond_broadcast(&d->done_cond);
+    pthread_mutex_unlock(&d->lock);
+    if (!d->ctx)
+        return NULL;
+
+    for (;;) {
+        for (n = 0; n < DISPATCH_BATCH; n++) {
+            req = queue_pop(d);
+            if (!req)
+                break;
+            req->func(req, d->opaque);
+            request_complete(d, req);
+        }
+        js_std_loop(d->ctx, DISPATCH_TIMER_BUDGET);
+        if (n == DISPATCH_BATCH)
+            continue;
+        if (queue_empty(d)) {
+            /* the requests posted before the stop are run */
+            if (__atomic_load_n(&d->stopping, __ATOMIC_SEQ_CST))
+                break;
+            dispatch_wait(d);
+        } else if (n == 0) {
+            /* a producer is between its exchange and its store */
+            sched_yield();
+        }
+    }
+    if (d->fini)
+        d->fini(d->opaque);
+    return NULL;
+}
+
+/* start a JS thread. init runs on it to create its context, which it
+   returns (NULL on failure) along with the opaque given to the requests.
+   fini runs on it when the dispatcher is stopped. */
+js_std_dispatcher_t *js_std_dispatcher_start(js_std_dispatch_init_func *init,
+                                             js_std_dispatch_fini_func *fini,
+                                             void *arg) {
+    js_std_dispatcher_t *d;
+    pthread_condattr_t attr;
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+    d->head = &d->stub;
+    d->tail = &d->stub;
+    d->init = init;
+    d->fini = fini;
+    d->arg = arg;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->wake_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&d->done_cond, NULL);
+    if (pthread_create(&d->thread, NULL, dispatch_thread, d) != 0)
+        goto fail;
+    pthread_mutex_lock(&d->lock);
+    while (d->started == 0)
+        pthread_cond_wait(&d->done_cond, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+    if (d->started < 0) {
+        pthread_join(d->thread, NULL);
+        goto fail;
+    }
+    return d;
+ fail:
+    pthread_cond_destroy(&d->done_cond);
+    pthread_cond_destroy(&d->wake_cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    return NULL;
+}
+
+/* run the requests already posted, then stop the JS thread and wait for
+   it. No request may be posted once it is called. */
+void js_std_dispatcher_stop(js_std_dispatcher_t *d) {
+    if (!d)
+        return;
+    __atomic_store_n(&d->stopping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&d->lock);
+    pthread_cond_signal(&d->wake_cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+    pthread_cond_destroy(&d->done_cond);
+    pthread_cond_destroy(&d->wake_cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+/* queue req, from any thread. req->func and req->done must be set, the
+   request must stay valid until it completes. */
+int js_std_dispatcher_post(js_std_dispatcher_t *d, js_std_request_t *req) {
+    if (__atomic_load_n(&d->stopping, __ATOMIC_RELAXED))
+        return -1;
+    req->status = 0;
+    req->finished = 0;
+    queue_push(d, req);
+    if (__atomic_load_n(&d->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&d->lock);
+        pthread_cond_signal(&d->wake_cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return 0;
+}
+
+/* non zero once a request posted without done callback has completed */
+int js_std_request_finished(js_std_request_t *req) {
+    return __atomic_load_n(&req->finished, __ATOMIC_ACQUIRE);
+}
+
+/* wait for a request posted without done callback, returns its status.
+   Must not be called on the JS thread. */
+int js_std_request_wait(js_std_dispatcher_t *d, js_std_request_t *req) {
+    if (!js_std_request_finished(req)) {
+        pthread_mutex_lock(&d->lock);
+        __atomic_add_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&req->finished, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&d->done_cond, &d->lock);
+        __atomic_sub_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return req->status;
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "js_lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 16
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* a sequence is a token (4 bits of literal length, 4 bits of match length),
+   the literals, a 16 bit little endian offset and the match. The last
+   sequence only has literals. */
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                                size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        op = lz_put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15)
+        op = lz_put_length(op, match_len - 15);
+    return op;
+}
+
+size_t js_lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+/* dst must hold at least js_lz_compress_bound(len) bytes. Return the
+   compressed size, or 0 if out of memory. */
+size_t js_lz_compress(uint8_t *dst, const uint8_t *src, size_t len) {
+    const uint8_t *ip, *anchor, *ref, *end;
+    uint32_t *table, h;
+    size_t match_len;
+    uint8_t *op;
+
+    /* positions are stored plus one, 0 means empty */
+    table = calloc(1 << LZ_HASH_BITS, sizeof(table[0]));
+    if (!table)
+        return 0;
+    ip = src;
+    anchor = src;
+    end = src + len;
+    op = dst;
+    while (end - ip >= LZ_MIN_MATCH) {
+        h = lz_hash(lz_read32(ip));
+        ref = table[h] ? src + table[h] - 1 : NULL;
+        table[h] = ip - src + 1;
+        if (!ref || ip - ref > LZ_MAX_OFFSET ||
+            lz_read32(ref) != lz_read32(ip)) {
+            ip++;
+            continue;
+        }
+        match_len = LZ_MIN_MATCH;
+        while (ip + match_len < end && ref[match_len] == ip[match_len])
+            match_len++;
+        op = lz_put_sequence(op, anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+    op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+    free(table);
+    return op - dst;
+}
+
+static int lz_get_length(const uint8_t **pip, const uint8_t *iend, size_t *plen) {
+    const uint8_t *ip = *pip;
+    uint8_t b;
+    do {
+        if (ip >= iend)
+            return -1;
+        b = *ip++;
+        *plen += b;
+    } while (b == 255);
+    *pip = ip;
+    return 0;
+}
+
+/* decompress exactly dst_len bytes. Return 0 if OK, -1 if the input is
+   corrupted. */
+int js_lz_decompress(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len) {
+    const uint8_t *ip, *iend, *match;
+    uint8_t *op, *oend;
+    size_t len, offset;
+    uint8_t token;
+
+    ip = src;
+    iend = src + src_len;
+    op = dst;
+    oend = dst + dst_len;
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15 && lz_get_length(&ip, iend, &len) < 0)
+            return -1;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+        len = token & 15;
+        if (len == 15 && lz_get_length(&ip, iend, &len) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            /* overlapping match, repeats the last offset bytes */
+            while (len-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
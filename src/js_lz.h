@@ -0,0 +1,16 @@
+#ifndef JS_LZ_H
+#define JS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* LZ77 codec using the LZ4 block format, used to compress the embedded
+   bytecode */
+
+size_t js_lz_compress_bound(size_t);
+
+size_t js_lz_compress(uint8_t *, const uint8_t *, size_t);
+
+int js_lz_decompress(uint8_t *, size_t, const uint8_t *, size_t);
+
+#endif /* JS_LZ_H */
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cutils.h"
+#include "quickjs.h"
+#include "js_std.h"
+
+/* Size class pool allocator for QuickJS runtimes. Most allocations of the
+   engine (objects, shapes, strings, property tables) are small, so blocks
+   up to POOL_MAX_SIZE bytes are carved from large chunks and recycled
+   through per class free lists instead of going through malloc(). Each
+   block is preceded by a header holding its usable size, larger blocks
+   are allocated with malloc(). Chunks are only released by
+   js_std_pool_free(). A pool is not thread safe: it must only be used by
+   one runtime, or by runtimes used from the same thread. */
+
+/* the header keeps the blocks aligned like malloc() ones (max_align_t):
+   chunks and blocks are multiples of 16 bytes */
+#define POOL_HEADER_SIZE 16
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_CHUNK_SIZE (64 * 1024)
+
+typedef struct pool_block_t {
+    struct pool_block_t *next;
+} pool_block_t;
+
+/* blocks start POOL_HEADER_SIZE bytes after the chunk, which keeps them
+   16 byte aligned */
+typedef struct pool_chunk_t {
+    struct pool_chunk_t *next;
+} pool_chunk_t;
+
+struct js_std_pool_t {
+    pool_block_t *free_list[POOL_CLASS_COUNT];
+    pool_chunk_t *chunks;
+    uint8_t *cur, *end;
+};
+
+js_std_pool_t *js_std_pool_new(void) {
+    return calloc(1, sizeof(js_std_pool_t));
+}
+
+void js_std_pool_free(js_std_pool_t *pool) {
+    pool_chunk_t *c, *next;
+
+    if (!pool)
+        return;
+    for (c = pool->chunks; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(pool);
+}
+
+static inline size_t *pool_header(const void *ptr) {
+    return (size_t *)((uint8_t *)ptr - POOL_HEADER_SIZE);
+}
+
+static size_t pool_usable_size(const void *ptr) {
+    if (!ptr)
+        return 0;
+    return *pool_header(ptr);
+}
+
+static void *pool_alloc(js_std_pool_t *pool, size_t size) {
+    size_t class_idx, block_size;
+    pool_block_t *b;
+    pool_chunk_t *c;
+    size_t *h;
+
+    if (size > POOL_MAX_SIZE) {
+        h = malloc(POOL_HEADER_SIZE + size);
+        if (!h)
+            return NULL;
+        *h = size;
+        return (uint8_t *)h + POOL_HEADER_SIZE;
+    }
+    /* malloc(0) returns a block which can be freed */
+    if (size == 0)
+        size = 1;
+    class_idx = (size - 1) / POOL_GRANULE;
+    b = pool->free_list[class_idx];
+    if (b) {
+        pool->free_list[class_idx] = b->next;
+        return b;
+    }
+    block_size = POOL_HEADER_SIZE + (class_idx + 1) * POOL_GRANULE;
+    if ((size_t)(pool->end - pool->cur) < block_size) {
+        /* the end of the previous chunk is lost */
+        c = malloc(POOL_CHUNK_SIZE);
+        if (!c)
+            return NULL;
+        c->next = pool->chunks;
+        pool->chunks = c;
+        pool->cur = (uint8_t *)c + POOL_HEADER_SIZE;
+        pool->end = (uint8_t *)c + POOL_CHUNK_SIZE;
+    }
+    h = (size_t *)pool->cur;
+    pool->cur += block_size;
+    *h = (class_idx + 1) * POOL_GRANULE;
+    return (uint8_t *)h + POOL_HEADER_SIZE;
+}
+
+static void pool_release(js_std_pool_t *pool, void *ptr) {
+    size_t size = *pool_header(ptr);
+    pool_block_t *b;
+
+    if (size > POOL_MAX_SIZE) {
+        free(pool_header(ptr));
+        return;
+    }
+    b = ptr;
+    b->next = pool->free_list[size / POOL_GRANULE - 1];
+    pool->free_list[size / POOL_GRANULE - 1] = b;
+}
+
+static void *pool_malloc(JSMallocState *s, size_t size) {
+    void *ptr;
+
+    if (s->malloc_size + size > s->malloc_limit)
+        return NULL;
+    ptr = pool_alloc(s->opaque, size);
+    if (!ptr)
+        return NULL;
+    s->malloc_count++;
+    s->malloc_size += pool_usable_size(ptr) + POOL_HEADER_SIZE;
+    return ptr;
+}
+
+static void pool_free(JSMallocState *s, void *ptr) {
+    if (!ptr)
+        return;
+    s->malloc_count--;
+    s->malloc_size -= pool_usable_size(ptr) + POOL_HEADER_SIZE;
+    pool_release(s->opaque, ptr);
+}
+
+static void *pool_realloc(JSMallocState *s, void *ptr, size_t size) {
+    size_t old_size, *h;
+    void *new_ptr;
+
+    if (!ptr) {
+        if (size == 0)
+            return NULL;
+        return pool_malloc(s, size);
+    }
+    if (size == 0) {
+        pool_free(s, ptr);
+        return NULL;
+    }
+    old_size = pool_usable_size(ptr);
+    if (old_size > POOL_MAX_SIZE && size > POOL_MAX_SIZE) {
+        if (s->malloc_size + size - old_size > s->malloc_limit)
+            return NULL;
+        h = realloc(pool_header(ptr), POOL_HEADER_SIZE + size);
+        if (!h)
+            return NULL;
+        *h = size;
+        s->malloc_size += size - old_size;
+        return (uint8_t *)h + POOL_HEADER_SIZE;
+    }
+    /* the block is kept if the size class does not change */
+    if (old_size <= POOL_MAX_SIZE && size <= old_size &&
+        size > old_size - POOL_GRANULE)
+        return ptr;
+    new_ptr = pool_malloc(s, size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    pool_free(s, ptr);
+    return new_ptr;
+}
+
+const JSMallocFunctions js_std_pool_malloc_functions = {
+    pool_malloc,
+    pool_free,
+    pool_realloc,
+    pool_usable_size,
+};
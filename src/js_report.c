@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cutils.h"
+#include "js_report.h"
+
+/* The blobs are decoded with the serialization format of JS_WriteObject():
+   a version byte, the atom table, then the object. Blobs using a tag the
+   reader does not know (BigInt literals) are reported as incomplete. */
+
+enum {
+    BC_TAG_NULL = 1,
+    BC_TAG_UNDEFINED,
+    BC_TAG_BOOL_FALSE,
+    BC_TAG_BOOL_TRUE,
+    BC_TAG_INT32,
+    BC_TAG_FLOAT64,
+    BC_TAG_STRING,
+    BC_TAG_OBJECT,
+    BC_TAG_ARRAY,
+    BC_TAG_BIG_INT,
+    BC_TAG_BIG_FLOAT,
+    BC_TAG_TEMPLATE_OBJECT,
+    BC_TAG_FUNCTION_BYTECODE,
+    BC_TAG_MODULE,
+};
+
+/* has_debug in the flags of a function */
+#define BC_FLAG_HAS_DEBUG (1 << 10)
+
+#define BC_EXPORT_TYPE_LOCAL 0
+
+#define BC_MAX_DEPTH 1000
+
+typedef struct {
+    uint32_t name;          /* atom as written, see put_atom_name() */
+    int parent;
+    int line;               /* -1 without debug info */
+    uint32_t size;          /* serialized size, nested functions included */
+    uint32_t bytecode_size;
+    uint32_t cpool_count;
+    uint32_t closure_var_count;
+    uint32_t var_count;     /* arguments included */
+    uint32_t debug_size;
+} report_func_t;
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+    BOOL wide;
+} report_string_t;
+
+typedef struct {
+    const uint8_t *ptr, *end;
+    BOOL byte_swap;
+    BOOL error;
+    int depth;
+    report_string_t *atoms;
+    uint32_t atom_count;
+    size_t atom_size;
+    uint32_t string_count;
+    size_t string_size;
+    uint32_t template_count;
+    report_func_t *funcs;
+    int func_count, func_size;
+} bc_reader_t;
+
+struct js_report_t {
+    JSContext *ctx;
+    BOOL byte_swap;
+    uint32_t first_atom;    /* first atom of the atom table, 0 if unknown */
+    DynBuf blobs;
+    int blob_count;
+    size_t size, stored_size;
+};
+
+static uint32_t bc_get_u8(bc_reader_t *r) {
+    if (r->ptr >= r->end) {
+        r->error = TRUE;
+        return 0;
+    }
+    return *r->ptr++;
+}
+
+static uint32_t bc_get_u16(bc_reader_t *r) {
+    uint16_t v;
+    if (r->end - r->ptr < 2) {
+        r->error = TRUE;
+        r->ptr = r->end;
+        return 0;
+    }
+    memcpy(&v, r->ptr, 2);
+    r->ptr += 2;
+    if (r->byte_swap)
+        v = bswap16(v);
+    return v;
+}
+
+static uint32_t bc_get_leb128(bc_reader_t *r) {
+    uint32_t v = 0, c;
+    int i;
+    for (i = 0; i < 5; i++) {
+        c = bc_get_u8(r);
+        v |= (c & 0x7f) << (7 * i);
+        if (!(c & 0x80))
+            return v;
+    }
+    r->error = TRUE;
+    return 0;
+}
+
+static void bc_skip(bc_reader_t *r, size_t len) {
+    if (len > r->end - r->ptr) {
+        r->error = TRUE;
+        r->ptr = r->end;
+    } else {
+        r->ptr += len;
+    }
+}
+
+static void bc_get_string(bc_reader_t *r, report_string_t *s) {
+    uint32_t v = bc_get_leb128(r);
+    s->len = v >> 1;
+    s->wide = v & 1;
+    s->data = r->ptr;
+    bc_skip(r, (size_t)s->len << s->wide);
+}
+
+static void bc_get_value(bc_reader_t *r, int parent);
+
+static void bc_get_function(bc_reader_t *r, int parent) {
+    const uint8_t *start = r->ptr - 1;
+    report_func_t *f;
+    uint32_t flags, name, arg_count, var_count, closure_var_count;
+    uint32_t cpool_count, bytecode_size, local_count, debug_size, i;
+    int line, idx;
+
+    flags = bc_get_u16(r);
+    bc_get_u8(r); /* js_mode */
+    name = bc_get_leb128(r);
+    arg_count = bc_get_leb128(r);
+    var_count = bc_get_leb128(r);
+    bc_get_leb128(r); /* defined_arg_count */
+    bc_get_leb128(r); /* stack_size */
+    closure_var_count = bc_get_leb128(r);
+    cpool_count = bc_get_leb128(r);
+    bytecode_size = bc_get_leb128(r);
+    local_count = bc_get_leb128(r);
+    for (i = 0; i < local_count && !r->error; i++) {
+        bc_get_leb128(r); /* name */
+        bc_get_leb128(r); /* scope_level */
+        bc_get_leb128(r); /* scope_next */
+        bc_get_u8(r);
+    }
+    for (i = 0; i < closure_var_count && !r->error; i++) {
+        bc_get_leb128(r); /* name */
+        bc_get_leb128(r); /* var_idx */
+        bc_get_u8(r);
+    }
+    bc_skip(r, bytecode_size);
+    line = -1;
+    debug_size = 0;
+    if (flags & BC_FLAG_HAS_DEBUG) {
+        bc_get_leb128(r); /* filename */
+        line = bc_get_leb128(r);
+        debug_size = bc_get_leb128(r);
+        bc_skip(r, debug_size);
+    }
+    if (r->error)
+        return;
+
+    /* the functions are listed before the functions they define */
+    if (r->func_count == r->func_size) {
+        r->func_size = r->func_size + (r->func_size >> 1) + 4;
+        /* XXX: check for realloc failure */
+        r->funcs = realloc(r->funcs, sizeof(r->funcs[0]) * r->func_size);
+    }
+    idx = r->func_count++;
+    f = &r->funcs[idx];
+    f->name = name;
+    f->parent = parent;
+    f->line = line;
+    f->bytecode_size = bytecode_size;
+    f->cpool_count = cpool_count;
+    f->closure_var_count = closure_var_count;
+    f->var_count = arg_count + var_count;
+    f->debug_size = debug_size;
+    for (i = 0; i < cpool_count && !r->error; i++)
+        bc_get_value(r, idx);
+    r->funcs[idx].size = r->ptr - start;
+}
+
+static void bc_get_module(bc_reader_t *r, int parent) {
+    uint32_t i, n;
+
+    bc_get_leb128(r); /* module_name */
+    n = bc_get_leb128(r);
+    for (i = 0; i < n && !r->error; i++)
+        bc_get_leb128(r); /* required module */
+    n = bc_get_leb128(r);
+    for (i = 0; i < n && !r->error; i++) {
+        if (bc_get_u8(r) == BC_EXPORT_TYPE_LOCAL) {
+            bc_get_leb128(r); /* var_idx */
+        } else {
+            bc_get_leb128(r); /* req_module_idx */
+            bc_get_leb128(r); /* local_name */
+        }
+        bc_get_leb128(r); /* export_name */
+    }
+    n = bc_get_leb128(r);
+    for (i = 0; i < n && !r->error; i++)
+        bc_get_leb128(r); /* star export */
+    n = bc_get_leb128(r);
+    for (i = 0; i < n && !r->error; i++) {
+        bc_get_leb128(r); /* var_idx */
+        bc_get_leb128(r); /* import_name */
+        bc_get_leb128(r); /* req_module_idx */
+    }
+    bc_get_value(r, parent);
+}
+
+static void bc_get_value(bc_reader_t *r, int parent) {
+    report_string_t s;
+    uint32_t i, n;
+    int tag;
+
+    if (r->error || ++r->depth > BC_MAX_DEPTH) {
+        r->error = TRUE;
+        return;
+    }
+    tag = bc_get_u8(r);
+    switch (tag) {
+    case BC_TAG_NULL:
+    case BC_TAG_UNDEFINED:
+    case BC_TAG_BOOL_FALSE:
+    case BC_TAG_BOOL_TRUE:
+        break;
+    case BC_TAG_INT32:
+        bc_get_leb128(r);
+        break;
+    case BC_TAG_FLOAT64:
+        bc_skip(r, 8);
+        break;
+    case BC_TAG_STRING:
+        bc_get_string(r, &s);
+        r->string_count++;
+        r->string_size += (size_t)s.len << s.wide;
+        break;
+    case BC_TAG_OBJECT:
+        n = bc_get_leb128(r);
+        for (i = 0; i < n && !r->error; i++) {
+            bc_get_leb128(r); /* property name */
+            bc_get_value(r, parent);
+        }
+        break;
+    case BC_TAG_ARRAY:
+    case BC_TAG_TEMPLATE_OBJECT:
+        n = bc_get_leb128(r);
+        for (i = 0; i < n && !r->error; i++)
+            bc_get_value(r, parent);
+        /* followed by the raw strings */
+        if (tag == BC_TAG_TEMPLATE_OBJECT) {
+            bc_get_value(r, parent);
+            r->template_count++;
+        }
+        break;
+    case BC_TAG_FUNCTION_BYTECODE:
+        bc_get_function(r, parent);
+        break;
+    case BC_TAG_MODULE:
+        bc_get_module(r, parent);
+        break;
+    default:
+        r->error = TRUE;
+        break;
+    }
+    r->depth--;
+}
+
+static void bc_read(bc_reader_t *r, const uint8_t *buf, size_t len,
+                    BOOL byte_swap) {
+    uint32_t i;
+
+    memset(r, 0, sizeof(*r));
+    r->ptr = buf;
+    r->end = buf + len;
+    r->byte_swap = byte_swap;
+    bc_get_u8(r); /* version */
+    r->atom_count = bc_get_leb128(r);
+    if (r->atom_count > len) {
+        r->error = TRUE;
+        r->atom_count = 0;
+        return;
+    }
+    r->atoms = calloc(max_int(r->atom_count, 1), sizeof(r->atoms[0]));
+    for (i = 0; i < r->atom_count && !r->error; i++) {
+        bc_get_string(r, &r->atoms[i]);
+        r->atom_size += (size_t)r->atoms[i].len << r->atoms[i].wide;
+    }
+    bc_get_value(r, -1);
+    if (r->ptr != r->end)
+        r->error = TRUE;
+}
+
+static void bc_free(bc_reader_t *r) {
+    free(r->atoms);
+    free(r->funcs);
+}
+
+static void put_json_string(DynBuf *b, const char *str) {
+    const uint8_t *p;
+    dbuf_putc(b, '"');
+    for (p = (const uint8_t *)str; *p != '\0'; p++) {
+        if (*p < 0x20)
+            dbuf_printf(b, "\\u%04x", *p);
+        else if (*p == '"' || *p == '\\')
+            dbuf_printf(b, "\\%c", *p);
+        else
+            dbuf_putc(b, *p);
+    }
+    dbuf_putc(b, '"');
+}
+
+/* atom table strings are latin1 or UTF-16, non ASCII characters are
+   escaped */
+static void put_json_atom(DynBuf *b, const report_string_t *s) {
+    uint32_t i, c;
+    uint16_t w;
+
+    dbuf_putc(b, '"');
+    for (i = 0; i < s->len; i++) {
+        if (s->wide) {
+            memcpy(&w, s->data + 2 * i, 2);
+            c = w;
+        } else {
+            c = s->data[i];
+        }
+        if (c < 0x20 || c >= 0x80)
+            dbuf_printf(b, "\\u%04x", c);
+        else if (c == '"' || c == '\\')
+            dbuf_printf(b, "\\%c", c);
+        else
+            dbuf_putc(b, c);
+    }
+    dbuf_putc(b, '"');
+}
+
+/* atoms before first_atom are predefined by the engine, the others index
+   the atom table of the blob */
+static void put_atom_name(js_report_t *rep, const bc_reader_t *r,
+                          DynBuf *b, uint32_t v) {
+    uint32_t atom = v >> 1;
+    const char *str;
+
+    if (v & 1) {
+        dbuf_printf(b, "\"%u\"", atom);
+    } else if (atom == 0 || rep->first_atom == 0) {
+        dbuf_putstr(b, "null");
+    } else if (atom >= rep->first_atom) {
+        if (atom - rep->first_atom < r->atom_count)
+            put_json_atom(b, &r->atoms[atom - rep->first_atom]);
+        else
+            dbuf_putstr(b, "null");
+    } else {
+        str = JS_AtomToCString(rep->ctx, atom);
+        if (str) {
+            put_json_string(b, str);
+            JS_FreeCString(rep->ctx, str);
+        } else {
+            dbuf_putstr(b, "null");
+        }
+    }
+}
+
+/* the index of the first atom of the table depends on the number of atoms
+   predefined by the engine: it is found from the name of a function
+   compiled for that purpose */
+static uint32_t find_first_atom(JSContext *ctx) {
+    static const char probe_name[] = "js2c_report_probe";
+    static const char probe_source[] = "(function js2c_report_probe() {})";
+    bc_reader_t r;
+    uint8_t *buf;
+    size_t len;
+    uint32_t i, atom, first_atom;
+    JSValue obj;
+
+    obj = JS_Eval(ctx, probe_source, strlen(probe_source), "<report>",
+                  JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+    if (JS_IsException(obj))
+        return 0;
+    buf = JS_WriteObject(ctx, &len, obj, JS_WRITE_OBJ_BYTECODE);
+    JS_FreeValue(ctx, obj);
+    if (!buf)
+        return 0;
+    first_atom = 0;
+    bc_read(&r, buf, len, FALSE);
+    if (!r.error && r.func_count == 2 && !(r.funcs[1].name & 1)) {
+        atom = r.funcs[1].name >> 1;
+        for (i = 0; i < r.atom_count; i++) {
+            const report_string_t *s = &r.atoms[i];
+            if (!s->wide && s->len == strlen(probe_name) &&
+                !memcmp(s->data, probe_name, s->len)) {
+                if (atom > i)
+                    first_atom = atom - i;
+                break;
+            }
+        }
+    }
+    bc_free(&r);
+    js_free(ctx, buf);
+    return first_atom;
+}
+
+js_report_t *js_report_new(JSContext *ctx, int byte_swap) {
+    js_report_t *rep = malloc(sizeof(*rep));
+    if (!rep)
+        return NULL;
+    rep->ctx = ctx;
+    rep->byte_swap = byte_swap;
+    rep->first_atom = find_first_atom(ctx);
+    dbuf_init(&rep->blobs);
+    rep->blob_count = 0;
+    rep->size = 0;
+    rep->stored_size = 0;
+    return rep;
+}
+
+void js_report_free(js_report_t *rep) {
+    dbuf_free(&rep->blobs);
+    free(rep);
+}
+
+/* add a blob: its C name, module name and kind, its bytecode and the size
+   it has in the library once compressed */
+void js_report_add(js_report_t *rep, const char *name,
+                   const char *module_name, const char *kind,
+                   const uint8_t *buf, size_t len, size_t stored_len) {
+    DynBuf *b = &rep->blobs;
+    bc_reader_t r;
+    size_t bytecode_size, debug_size;
+    uint32_t cpool_count;
+    int i;
+
+    bc_read(&r, buf, len, rep->byte_swap);
+    bytecode_size = debug_size = 0;
+    cpool_count = 0;
+    for (i = 0; i < r.func_count; i++) {
+        bytecode_size += r.funcs[i].bytecode_size;
+        debug_size += r.funcs[i].debug_size;
+        cpool_count += r.funcs[i].cpool_count;
+    }
+    rep->size += len;
+    rep->stored_size += stored_len;
+
+    if (rep->blob_count++ > 0)
+        dbuf_putstr(b, ",\n");
+    dbuf_putstr(b, "    {\n      \"name\": ");
+    put_json_string(b, name);
+    dbuf_putstr(b, ",\n      \"module\": ");
+    put_json_string(b, module_name);
+    dbuf_putstr(b, ",\n      \"kind\": ");
+    put_json_string(b, kind);
+    dbuf_printf(b, ",\n"
+                "      \"size\": %u,\n"
+                "      \"stored_size\": %u,\n"
+                "      \"complete\": %s,\n"
+                "      \"atom_count\": %u,\n"
+                "      \"atom_size\": %u,\n"
+                "      \"string_count\": %u,\n"
+                "      \"string_size\": %u,\n"
+                "      \"function_count\": %d,\n"
+                "      \"bytecode_size\": %u,\n"
+                "      \"cpool_count\": %u,\n"
+                "      \"debug_size\": %u,\n"
+                "      \"functions\": [",
+                (unsigned int)len, (unsigned int)stored_len,
+                r.error ? "false" : "true",
+                r.atom_count, (unsigned int)r.atom_size,
+                r.string_count, (unsigned int)r.string_size,
+                r.func_count, (unsigned int)bytecode_size, cpool_count,
+                (unsigned int)debug_size);
+    for (i = 0; i < r.func_count; i++) {
+        const report_func_t *f = &r.funcs[i];
+        dbuf_putstr(b, i == 0 ? "\n        " : ",\n        ");
+        dbuf_putstr(b, "{\"name\": ");
+        put_atom_name(rep, &r, b, f->name);
+        dbuf_printf(b, ", \"parent\": %d, \"line\": %d, \"size\": %u, "
+                    "\"bytecode_size\": %u, \"cpool_count\": %u, "
+                    "\"closure_var_count\": %u, \"var_count\": %u, "
+                    "\"debug_size\": %u}",
+                    f->parent, f->line, f->size, f->bytecode_size,
+                    f->cpool_count, f->closure_var_count, f->var_count,
+                    f->debug_size);
+    }
+    dbuf_putstr(b, r.func_count > 0 ? "\n      ]\n    }" : "]\n    }");
+    bc_free(&r);
+}
+
+/* the template objects of tagged templates are objects of the constant
+   pool, created when the bytecode is read: a blob with template objects
+   cannot be read once and run in several contexts. Blobs which cannot be
+   decoded are not shared either. */
+int js_report_shareable(const uint8_t *buf, size_t len, int byte_swap) {
+    bc_reader_t r;
+    int ret;
+
+    bc_read(&r, buf, len, byte_swap);
+    ret = !r.error && r.template_count == 0;
+    bc_free(&r);
+    return ret;
+}
+
+int js_report_write(js_report_t *rep, const char *filename,
+                    const char *library) {
+    DynBuf b;
+    FILE *f;
+    int ret;
+
+    dbuf_init(&b);
+    dbuf_putstr(&b, "{\n  \"library\": ");
+    put_json_string(&b, library);
+    dbuf_printf(&b, ",\n  \"size\": %u,\n  \"stored_size\": %u,\n"
+                "  \"blobs\": [\n",
+                (unsigned int)rep->size, (unsigned int)rep->stored_size);
+    dbuf_put(&b, rep->blobs.buf, rep->blobs.size);
+    dbuf_putstr(&b, rep->blob_count > 0 ? "\n  ]\n}\n" : "  ]\n}\n");
+
+    ret = -1;
+    f = fopen(filename, "w");
+    if (f) {
+        if (fwrite(b.buf, 1, b.size, f) == b.size)
+            ret = 0;
+        if (fclose(f) != 0)
+            ret = -1;
+    }
+    dbuf_free(&b);
+    return ret;
+}
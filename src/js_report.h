@@ -0,0 +1,25 @@
+#ifndef JS_REPORT_H
+#define JS_REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "quickjs.h"
+
+/* JSON report of the bytecode written by JS_WriteObject() (js2c -R): for
+   each blob its size, atoms and string constants, and the bytecode, constant
+   pool and debug info size of each of its functions */
+
+typedef struct js_report_t js_report_t;
+
+js_report_t *js_report_new(JSContext *, int);
+
+void js_report_free(js_report_t *);
+
+void js_report_add(js_report_t *, const char *, const char *, const char *,
+                   const uint8_t *, size_t, size_t);
+
+int js_report_shareable(const uint8_t *, size_t, int);
+
+int js_report_write(js_report_t *, const char *, const char *);
+
+#endif /* JS_REPORT_H */
@@ -0,0 +1,1147 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cutils.h"
+#include "js_std.h"
+#include "js_shake.h"
+
+/* The sources are only tokenized: the analysis is conservative, an
+   identifier used anywhere in live code keeps the function of the same
+   name, even when it is a property name or a shadowing local. Only the
+   top level function declarations, the named imports and the named
+   re-exports are removed. Dynamic imports of a string literal keep all
+   the exports of the module, other dynamic imports disable the tree
+   shaking. */
+
+enum {
+    TOK_IDENT,
+    TOK_STRING,
+    TOK_PUNCT,
+};
+
+typedef struct {
+    int type;
+    int depth;          /* of braces */
+    size_t start;
+    size_t len;         /* strings include their quotes */
+} shake_token_t;
+
+/* owner of a token, for the references of the top level code */
+enum {
+    OWNER_NONE,
+    OWNER_DECL,         /* function, import or re-export, not top level code */
+    OWNER_EXPORT_LIST,  /* export { ... }, top level code without effect */
+};
+
+typedef struct {
+    char *name;
+    int tok_start, tok_end;
+    BOOL live;
+} shake_func_t;
+
+enum {
+    STMT_IMPORT,
+    STMT_REEXPORT,
+    STMT_EXPORT_LIST,
+};
+
+typedef struct {
+    int type;
+    int tok_start, tok_end;
+    int module;         /* imported module, -1 for an export list */
+    BOOL bare;          /* import 'module' */
+    BOOL used;
+} shake_stmt_t;
+
+/* binding of an import statement */
+typedef struct {
+    char *local;
+    char *name;         /* "default", or "*" for a namespace */
+    int stmt;
+    BOOL braced;        /* in { }, can be removed on its own */
+    int tok_start, tok_end;
+    BOOL used;
+} shake_import_t;
+
+typedef struct {
+    char *name;         /* exported name, "*" for export * */
+    char *local;        /* local name, or name in the module of stmt */
+    int stmt;           /* -1 for export function */
+    BOOL braced;
+    int tok_start, tok_end;
+    BOOL used;
+} shake_export_t;
+
+typedef struct {
+    char *name;
+    uint8_t *buf;
+    size_t len;
+    char *out;          /* source with the removed code blanked */
+    BOOL external;
+    BOOL loaded;
+    BOOL decl_only;     /* no top level code besides its statements */
+    int purity;         /* PURITY_xxx, see module_is_pure() */
+    BOOL has_eval;
+    shake_token_t *tokens;
+    int token_count, token_size;
+    uint8_t *owner;
+    shake_func_t *funcs;
+    int func_count, func_size;
+    shake_stmt_t *stmts;
+    int stmt_count, stmt_size;
+    shake_import_t *imports;
+    int import_count, import_size;
+    shake_export_t *exports;
+    int export_count, export_size;
+    char **used_exports;
+    int used_count, used_size;
+} shake_module_t;
+
+struct js_shake_t {
+    shake_module_t **modules;
+    int count, size;
+    js_shake_external_func *is_external;
+    void *opaque;
+    int *work;          /* module and function pairs, -1 for top level code */
+    int work_count, work_size;
+    BOOL disabled;
+};
+
+static void *shake_grow(void *tab, int *psize, int count, size_t elem_size) {
+    int size;
+    if (count < *psize)
+        return tab;
+    size = *psize + (*psize >> 1) + 4;
+    /* XXX: check for realloc failure */
+    tab = realloc(tab, elem_size * size);
+    *psize = size;
+    return tab;
+}
+
+static BOOL is_ident_start(int c) {
+    return c == '_' || c == '$' || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static BOOL is_ident_part(int c) {
+    return is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static void add_token(shake_module_t *m, int type, int depth,
+                      size_t start, size_t len) {
+    shake_token_t *t;
+    m->tokens = shake_grow(m->tokens, &m->token_size, m->token_count,
+                           sizeof(m->tokens[0]));
+    t = &m->tokens[m->token_count++];
+    t->type = type;
+    t->depth = depth;
+    t->start = start;
+    t->len = len;
+}
+
+static BOOL tok_is(const shake_module_t *m, int i, const char *str);
+
+/* a '/' after these keywords starts a regular expression */
+static const char *regexp_keywords[] = {
+    "return", "typeof", "new", "void", "await", "yield", "case", "default",
+    "in", "of", "instanceof", "delete", "throw", "else", "do",
+};
+
+/* returns 1 if a '/' following the last token starts a regular
+   expression, 0 if it is a division and -1 if it cannot be told from the
+   tokens (after '}', which ends a block or an expression, or after '++'
+   and '--'). after_value is set after a number or a template, which are
+   not tokens. */
+static int is_regexp_start(const shake_module_t *m, BOOL after_value) {
+    const shake_token_t *t;
+    int i, k, level, c;
+
+    if (after_value)
+        return 0;
+    i = m->token_count - 1;
+    if (i < 0)
+        return 1;
+    t = &m->tokens[i];
+    if (t->type == TOK_STRING)
+        return 0;
+    if (t->type == TOK_IDENT) {
+        for (k = 0; k < countof(regexp_keywords); k++) {
+            if (tok_is(m, i, regexp_keywords[k]))
+                return 1;
+        }
+        return 0;
+    }
+    c = m->buf[t->start];
+    if (c == ']')
+        return 0;
+    if (c == '}')
+        return -1;
+    if ((c == '+' || c == '-') && i > 0 && m->tokens[i - 1].type == TOK_PUNCT &&
+        m->tokens[i - 1].start + 1 == t->start && m->buf[t->start - 1] == c)
+        return -1;
+    if (c == ')') {
+        /* a regular expression only follows the condition of a statement */
+        level = 0;
+        for (; i >= 0; i--) {
+            if (m->tokens[i].type != TOK_PUNCT)
+                continue;
+            c = m->buf[m->tokens[i].start];
+            if (c == ')')
+                level++;
+            else if (c == '(' && --level == 0)
+                break;
+        }
+        if (i < 0)
+            return -1;
+        return tok_is(m, i - 1, "if") || tok_is(m, i - 1, "while") ||
+            tok_is(m, i - 1, "for") || tok_is(m, i - 1, "with");
+    }
+    return 1;
+}
+
+/* the identifiers of a template are references as they may be in a
+   substitution. The substitutions may contain strings and templates. */
+static int scan_template(shake_module_t *m, size_t *pi, int depth) {
+    const uint8_t *buf = m->buf;
+    size_t j, k, len = m->len;
+    int braces = 0;     /* non zero in a substitution */
+
+    j = *pi + 1;
+    while (j < len) {
+        int c = buf[j];
+        if (c == '\\') {
+            j += 2;
+        } else if (c == '`' && !braces) {
+            *pi = j + 1;
+            return 0;
+        } else if (c == '`') {
+            if (scan_template(m, &j, depth) < 0)
+                return -1;
+        } else if (c == '$' && !braces && j + 1 < len && buf[j + 1] == '{') {
+            braces = 1;
+            j += 2;
+        } else if (c == '{' && braces) {
+            braces++;
+            j++;
+        } else if (c == '}' && braces) {
+            braces--;
+            j++;
+        } else if ((c == '"' || c == '\'') && braces) {
+            for (j++; j < len && buf[j] != c && buf[j] != '\n'; j++) {
+                if (buf[j] == '\\')
+                    j++;
+            }
+            j++;
+        } else if (is_ident_start(c)) {
+            /* a '$' may start a substitution */
+            k = j;
+            while (j < len && is_ident_part(buf[j]) &&
+                   !(buf[j] == '$' && !braces && j + 1 < len &&
+                     buf[j + 1] == '{'))
+                j++;
+            add_token(m, TOK_IDENT, depth + 1, k, j - k);
+        } else {
+            j++;
+        }
+    }
+    return -1;
+}
+
+/* returns -1 if the source cannot be tokenized with certainty */
+static int tokenize(shake_module_t *m) {
+    const uint8_t *buf = m->buf;
+    size_t i, j, len = m->len;
+    int depth = 0, ret;
+    BOOL after_value = FALSE, in_class;
+
+    i = 0;
+    while (i < len) {
+        int c = buf[i];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < len && buf[i + 1] != '/' && buf[i + 1] != '*') {
+            ret = is_regexp_start(m, after_value);
+            if (ret < 0)
+                return -1;
+            if (ret) {
+                in_class = FALSE;
+                for (j = i + 1; j < len; j++) {
+                    if (buf[j] == '\n')
+                        return -1;
+                    if (buf[j] == '\\')
+                        j++;
+                    else if (buf[j] == '[')
+                        in_class = TRUE;
+                    else if (buf[j] == ']')
+                        in_class = FALSE;
+                    else if (buf[j] == '/' && !in_class)
+                        break;
+                }
+                if (j >= len)
+                    return -1;
+                for (j++; j < len && is_ident_part(buf[j]); j++)
+                    continue;
+                /* no references in it, a string for the analysis */
+                add_token(m, TOK_STRING, depth, i, j - i);
+                after_value = FALSE;
+                i = j;
+                continue;
+            }
+        }
+        after_value = FALSE;
+        if (c == '/' && i + 1 < len && buf[i + 1] == '/') {
+            while (i < len && buf[i] != '\n')
+                i++;
+        } else if (c == '/' && i + 1 < len && buf[i + 1] == '*') {
+            i += 2;
+            while (i + 1 < len && !(buf[i] == '*' && buf[i + 1] == '/'))
+                i++;
+            i += 2;
+        } else if (c == '"' || c == '\'') {
+            for (j = i + 1; j < len && buf[j] != c && buf[j] != '\n'; j++) {
+                if (buf[j] == '\\')
+                    j++;
+            }
+            j = min_int(j + 1, len);
+            add_token(m, TOK_STRING, depth, i, j - i);
+            i = j;
+        } else if (c == '`') {
+            if (scan_template(m, &i, depth) < 0)
+                return -1;
+            after_value = TRUE;
+        } else if (is_ident_start(c)) {
+            for (j = i; j < len && is_ident_part(buf[j]); j++)
+                continue;
+            add_token(m, TOK_IDENT, depth, i, j - i);
+            i = j;
+        } else if (c >= '0' && c <= '9') {
+            while (i < len && (is_ident_part(buf[i]) || buf[i] == '.'))
+                i++;
+            after_value = TRUE;
+        } else {
+            if (c == '}')
+                depth--;
+            add_token(m, TOK_PUNCT, depth, i, 1);
+            if (c == '{')
+                depth++;
+            i++;
+        }
+    }
+    return 0;
+}
+
+static BOOL tok_is(const shake_module_t *m, int i, const char *str) {
+    const shake_token_t *t;
+    if (i < 0 || i >= m->token_count)
+        return FALSE;
+    t = &m->tokens[i];
+    return t->len == strlen(str) && !memcmp(m->buf + t->start, str, t->len);
+}
+
+static BOOL tok_type(const shake_module_t *m, int i, int type) {
+    return i >= 0 && i < m->token_count && m->tokens[i].type == type;
+}
+
+static char *tok_str(const shake_module_t *m, int i) {
+    const shake_token_t *t = &m->tokens[i];
+    if (t->type == TOK_STRING)
+        return strndup((const char *)m->buf + t->start + 1,
+                       max_int(t->len, 2) - 2);
+    return strndup((const char *)m->buf + t->start, t->len);
+}
+
+/* same as the default module name normalization of QuickJS */
+static char *normalize_name(const char *base_name, const char *name) {
+    char *filename, *p;
+    const char *r;
+    int len;
+
+    if (name[0] != '.')
+        return strdup(name);
+    p = strrchr(base_name, '/');
+    len = p ? p - base_name : 0;
+    filename = malloc(len + strlen(name) + 2);
+    memcpy(filename, base_name, len);
+    filename[len] = '\0';
+    r = name;
+    for (;;) {
+        if (r[0] == '.' && r[1] == '/') {
+            r += 2;
+        } else if (r[0] == '.' && r[1] == '.' && r[2] == '/') {
+            if (filename[0] == '\0')
+                break;
+            p = strrchr(filename, '/');
+            if (!p)
+                p = filename;
+            else
+                p++;
+            if (!strcmp(p, ".") || !strcmp(p, ".."))
+                break;
+            if (p > filename)
+                p--;
+            *p = '\0';
+            r += 3;
+        } else {
+            break;
+        }
+    }
+    if (filename[0] != '\0')
+        strcat(filename, "/");
+    strcat(filename, r);
+    return filename;
+}
+
+static int get_module(js_shake_t *s, const char *name);
+
+/* module imported by the string token i */
+static int import_module(js_shake_t *s, int mi, int i) {
+    char *spec, *name;
+    int ret;
+
+    spec = tok_str(s->modules[mi], i);
+    name = normalize_name(s->modules[mi]->name, spec);
+    ret = get_module(s, name);
+    free(name);
+    free(spec);
+    return ret;
+}
+
+static int add_stmt(shake_module_t *m, int type, int tok_start, int module) {
+    shake_stmt_t *st;
+    m->stmts = shake_grow(m->stmts, &m->stmt_size, m->stmt_count,
+                          sizeof(m->stmts[0]));
+    st = &m->stmts[m->stmt_count];
+    memset(st, 0, sizeof(*st));
+    st->type = type;
+    st->tok_start = tok_start;
+    st->module = module;
+    return m->stmt_count++;
+}
+
+static void add_import(shake_module_t *m, int stmt, char *local, char *name,
+                       BOOL braced, int tok_start, int tok_end) {
+    shake_import_t *im;
+    m->imports = shake_grow(m->imports, &m->import_size, m->import_count,
+                            sizeof(m->imports[0]));
+    im = &m->imports[m->import_count++];
+    im->local = local;
+    im->name = name;
+    im->stmt = stmt;
+    im->braced = braced;
+    im->tok_start = tok_start;
+    im->tok_end = tok_end;
+    im->used = FALSE;
+}
+
+static void add_export(shake_module_t *m, int stmt, char *name, char *local,
+                       BOOL braced, int tok_start, int tok_end) {
+    shake_export_t *ex;
+    m->exports = shake_grow(m->exports, &m->export_size, m->export_count,
+                            sizeof(m->exports[0]));
+    ex = &m->exports[m->export_count++];
+    ex->name = name;
+    ex->local = local;
+    ex->stmt = stmt;
+    ex->braced = braced;
+    ex->tok_start = tok_start;
+    ex->tok_end = tok_end;
+    ex->used = FALSE;
+}
+
+/* skip an optional semicolon after the token i */
+static int stmt_end(const shake_module_t *m, int i) {
+    if (tok_is(m, i + 1, ";"))
+        return i + 1;
+    return i;
+}
+
+/* parse '{ a, b as c }' at i, calling add_import() or add_export(). The
+   range of a binding includes its comma. Returns the index of '}' or
+   -1. */
+static int parse_braces(shake_module_t *m, int i, int stmt, BOOL import) {
+    int start;
+    char *name, *local;
+
+    for (i++; i < m->token_count && !tok_is(m, i, "}"); i++) {
+        start = i;
+        if (!tok_type(m, i, TOK_IDENT))
+            return -1;
+        name = tok_str(m, i);
+        if (tok_is(m, i + 1, "as") && tok_type(m, i + 2, TOK_IDENT)) {
+            local = tok_str(m, i + 2);
+            i += 2;
+        } else {
+            local = strdup(name);
+        }
+        if (tok_is(m, i + 1, ","))
+            i++;
+        /* for an export, name is the local name and local the exported */
+        if (import)
+            add_import(m, stmt, local, name, TRUE, start, i);
+        else
+            add_export(m, stmt, local, name, TRUE, start, i);
+    }
+    return i < m->token_count ? i : -1;
+}
+
+static int parse_import(js_shake_t *s, int mi, int i) {
+    shake_module_t *m = s->modules[mi];
+    int start = i, stmt, j;
+
+    if (tok_type(m, i + 1, TOK_STRING)) {
+        j = import_module(s, mi, i + 1);
+        stmt = add_stmt(m, STMT_IMPORT, start, j);
+        m->stmts[stmt].bare = TRUE;
+        m->stmts[stmt].tok_end = stmt_end(m, i + 1);
+        return m->stmts[stmt].tok_end;
+    }
+    stmt = add_stmt(m, STMT_IMPORT, start, -1);
+    for (i++; i < m->token_count && !tok_is(m, i, "from"); i++) {
+        if (tok_is(m, i, ",")) {
+            continue;
+        } else if (tok_is(m, i, "*") && tok_is(m, i + 1, "as") &&
+                   tok_type(m, i + 2, TOK_IDENT)) {
+            add_import(m, stmt, tok_str(m, i + 2), strdup("*"), FALSE,
+                       i, i + 2);
+            i += 2;
+        } else if (tok_is(m, i, "{")) {
+            i = parse_braces(m, i, stmt, TRUE);
+            if (i < 0)
+                return -1;
+        } else if (tok_type(m, i, TOK_IDENT)) {
+            add_import(m, stmt, tok_str(m, i), strdup("default"), FALSE,
+                       i, i);
+        } else {
+            return -1;
+        }
+    }
+    if (!tok_type(m, i + 1, TOK_STRING))
+        return -1;
+    j = import_module(s, mi, i + 1);
+    m->stmts[stmt].module = j;
+    m->stmts[stmt].tok_end = stmt_end(m, i + 1);
+    return m->stmts[stmt].tok_end;
+}
+
+/* export { ... } [from 'module'] or export * [as ns] from 'module' */
+static int parse_export(js_shake_t *s, int mi, int i) {
+    shake_module_t *m = s->modules[mi];
+    int start = i, stmt, j;
+
+    stmt = add_stmt(m, STMT_EXPORT_LIST, start, -1);
+    if (tok_is(m, i + 1, "*")) {
+        i += 2;
+        if (tok_is(m, i, "as") && tok_type(m, i + 1, TOK_IDENT)) {
+            add_export(m, stmt, tok_str(m, i + 1), strdup("*"), FALSE,
+                       i - 1, i + 1);
+            i += 2;
+        } else {
+            add_export(m, stmt, strdup("*"), NULL, FALSE, i - 1, i - 1);
+        }
+        if (!tok_is(m, i, "from"))
+            return -1;
+    } else {
+        i = parse_braces(m, i + 1, stmt, FALSE);
+        if (i < 0)
+            return -1;
+        if (!tok_is(m, i + 1, "from")) {
+            m->stmts[stmt].tok_end = stmt_end(m, i);
+            return m->stmts[stmt].tok_end;
+        }
+        i++;
+    }
+    if (!tok_type(m, i + 1, TOK_STRING))
+        return -1;
+    j = import_module(s, mi, i + 1);
+    m->stmts[stmt].type = STMT_REEXPORT;
+    m->stmts[stmt].module = j;
+    m->stmts[stmt].tok_end = stmt_end(m, i + 1);
+    return m->stmts[stmt].tok_end;
+}
+
+/* function declaration at i (after the optional 'export' and 'async'
+   tokens starting at start), returns its last token or -1 if it is not
+   a named declaration */
+static int parse_function(shake_module_t *m, int start, int i,
+                          BOOL exported) {
+    shake_func_t *f;
+    int name, depth;
+
+    i++;
+    if (tok_is(m, i, "*"))
+        i++;
+    if (!tok_type(m, i, TOK_IDENT) || !tok_is(m, i + 1, "("))
+        return -1;
+    name = i;
+    depth = 0;
+    for (i++; i < m->token_count; i++) {
+        if (tok_is(m, i, "("))
+            depth++;
+        else if (tok_is(m, i, ")") && --depth == 0)
+            break;
+    }
+    if (!tok_is(m, i + 1, "{") || m->tokens[i + 1].depth != 0)
+        return -1;
+    for (i += 2; i < m->token_count; i++) {
+        if (m->tokens[i].depth == 0 && tok_is(m, i, "}"))
+            break;
+    }
+    if (i == m->token_count)
+        return -1;
+    m->funcs = shake_grow(m->funcs, &m->func_size, m->func_count,
+                          sizeof(m->funcs[0]));
+    f = &m->funcs[m->func_count++];
+    f->name = tok_str(m, name);
+    f->tok_start = start;
+    f->tok_end = i;
+    f->live = FALSE;
+    if (exported) {
+        add_export(m, -1, strdup(f->name), strdup(f->name), FALSE,
+                   start, start);
+    }
+    return i;
+}
+
+/* a 'function' keyword after these tokens is part of an expression */
+static BOOL is_expression_prefix(const shake_module_t *m, int i) {
+    static const char *keywords[] = {
+        "return", "typeof", "new", "void", "await", "yield", "case",
+        "default", "in", "of", "instanceof", "delete", "throw",
+    };
+    int k;
+
+    if (i < 0)
+        return FALSE;
+    if (m->tokens[i].type == TOK_PUNCT)
+        return strchr("=(,:?!|&+-*/[<>~^%.", m->buf[m->tokens[i].start]) != NULL;
+    for (k = 0; k < countof(keywords); k++) {
+        if (tok_is(m, i, keywords[k]))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void mark_owner(shake_module_t *m, int start, int end, int owner) {
+    int i;
+    for (i = start; i <= end && i < m->token_count; i++)
+        m->owner[i] = owner;
+}
+
+static int parse_module(js_shake_t *s, int mi) {
+    shake_module_t *m = s->modules[mi];
+    int i, j, k;
+
+    if (tokenize(m) < 0)
+        return -1;
+    for (i = 0; i < m->token_count; i++) {
+        if (m->tokens[i].depth != 0 || m->tokens[i].type != TOK_IDENT ||
+            tok_is(m, i - 1, "."))
+            continue;
+        j = i;
+        if (tok_is(m, i, "import")) {
+            if (tok_is(m, i + 1, "(") || tok_is(m, i + 1, "."))
+                continue;
+            j = parse_import(s, mi, i);
+        } else if (tok_is(m, i, "export")) {
+            if (tok_is(m, i + 1, "function")) {
+                j = parse_function(m, i, i + 1, TRUE);
+            } else if (tok_is(m, i + 1, "async") &&
+                       tok_is(m, i + 2, "function")) {
+                j = parse_function(m, i, i + 2, TRUE);
+            } else if (tok_is(m, i + 1, "{") || tok_is(m, i + 1, "*")) {
+                j = parse_export(s, mi, i);
+            } else {
+                continue;
+            }
+        } else if (tok_is(m, i, "function")) {
+            k = i;
+            if (tok_is(m, i - 1, "async"))
+                k = i - 1;
+            if (is_expression_prefix(m, k - 1) || tok_is(m, k - 1, "export"))
+                continue;
+            j = parse_function(m, k, i, FALSE);
+            if (j < 0)
+                continue;
+        } else {
+            if (tok_is(m, i, "eval"))
+                m->has_eval = TRUE;
+            continue;
+        }
+        if (j < 0)
+            return -1;
+        i = j;
+    }
+
+    /* the tokens which are not top level code */
+    m->owner = calloc(max_int(m->token_count, 1), 1);
+    for (i = 0; i < m->func_count; i++)
+        mark_owner(m, m->funcs[i].tok_start, m->funcs[i].tok_end, OWNER_DECL);
+    for (i = 0; i < m->stmt_count; i++) {
+        shake_stmt_t *st = &m->stmts[i];
+        mark_owner(m, st->tok_start, st->tok_end,
+                   st->type == STMT_EXPORT_LIST ? OWNER_EXPORT_LIST :
+                   OWNER_DECL);
+    }
+    m->decl_only = TRUE;
+    for (i = 0; i < m->token_count; i++) {
+        if (tok_is(m, i, "eval"))
+            m->has_eval = TRUE;
+        if (m->owner[i] == OWNER_NONE && !tok_is(m, i, ";"))
+            m->decl_only = FALSE;
+    }
+    return 0;
+}
+
+static int get_module(js_shake_t *s, const char *name) {
+    shake_module_t *m;
+    int i;
+
+    for (i = 0; i < s->count; i++) {
+        if (!strcmp(s->modules[i]->name, name))
+            return i;
+    }
+    s->modules = shake_grow(s->modules, &s->size, s->count,
+                            sizeof(s->modules[0]));
+    i = s->count++;
+    m = calloc(1, sizeof(*m));
+    s->modules[i] = m;
+    m->name = strdup(name);
+    if (s->is_external(name, s->opaque)) {
+        m->external = TRUE;
+        return i;
+    }
+    m->buf = js_load_file(NULL, &m->len, name);
+    if (!m->buf) {
+        /* reported by the compilation */
+        m->external = TRUE;
+        return i;
+    }
+    if (parse_module(s, i) < 0) {
+        fprintf(stderr, "Warning: '%s' cannot be analyzed, tree shaking is "
+                "disabled\n", name);
+        s->disabled = TRUE;
+    }
+    return i;
+}
+
+static void push_work(js_shake_t *s, int mi, int fi) {
+    s->work = shake_grow(s->work, &s->work_size, s->work_count + 1,
+                         sizeof(s->work[0]));
+    s->work[s->work_count++] = mi;
+    s->work[s->work_count++] = fi;
+}
+
+static void use_export(js_shake_t *s, int mi, const char *name);
+static void use_stmt(js_shake_t *s, int mi, int stmt);
+
+enum {
+    PURITY_UNKNOWN,
+    PURITY_PENDING,     /* being computed, an import cycle */
+    PURITY_PURE,
+    PURITY_IMPURE,
+};
+
+/* loading a module has no effect if it only has declarations and all its
+   imports and re-exports are of such modules. External modules, bare
+   imports and import cycles are assumed to have effects. */
+static BOOL module_is_pure(js_shake_t *s, int mi) {
+    shake_module_t *m = s->modules[mi];
+    int i;
+
+    if (m->purity == PURITY_UNKNOWN) {
+        m->purity = PURITY_PENDING;
+        if (m->external || !m->decl_only) {
+            m->purity = PURITY_IMPURE;
+            return FALSE;
+        }
+        for (i = 0; i < m->stmt_count; i++) {
+            shake_stmt_t *st = &m->stmts[i];
+            if (st->type == STMT_EXPORT_LIST)
+                continue;
+            if (st->bare || !module_is_pure(s, st->module)) {
+                m->purity = PURITY_IMPURE;
+                return FALSE;
+            }
+        }
+        m->purity = PURITY_PURE;
+    }
+    return m->purity == PURITY_PURE;
+}
+
+static void load_module(js_shake_t *s, int mi) {
+    shake_module_t *m = s->modules[mi];
+    int i;
+
+    if (m->external || m->loaded)
+        return;
+    m->loaded = TRUE;
+    push_work(s, mi, -1);
+    if (m->has_eval) {
+        for (i = 0; i < m->func_count; i++) {
+            m->funcs[i].live = TRUE;
+            push_work(s, mi, i);
+        }
+    }
+    for (i = 0; i < m->stmt_count; i++) {
+        shake_stmt_t *st = &s->modules[mi]->stmts[i];
+        if (st->type == STMT_EXPORT_LIST)
+            continue;
+        /* an import of a module with side effects cannot be removed */
+        if (st->type == STMT_REEXPORT || st->bare ||
+            !module_is_pure(s, st->module))
+            use_stmt(s, mi, i);
+    }
+}
+
+static void use_stmt(js_shake_t *s, int mi, int stmt) {
+    shake_module_t *m = s->modules[mi];
+    shake_stmt_t *st = &m->stmts[stmt];
+    int i, target;
+
+    if (st->used)
+        return;
+    st->used = TRUE;
+    target = st->module;
+    load_module(s, target);
+    /* the default and namespace bindings are kept with the statement */
+    for (i = 0; i < m->import_count; i++) {
+        if (m->imports[i].stmt == stmt && !m->imports[i].braced) {
+            m->imports[i].used = TRUE;
+            use_export(s, target, m->imports[i].name);
+        }
+    }
+}
+
+static void reference(js_shake_t *s, int mi, const char *name, size_t len) {
+    shake_module_t *m = s->modules[mi];
+    int i;
+
+    for (i = 0; i < m->func_count; i++) {
+        shake_func_t *f = &m->funcs[i];
+        if (!f->live && strlen(f->name) == len && !memcmp(f->name, name, len)) {
+            f->live = TRUE;
+            push_work(s, mi, i);
+        }
+    }
+    for (i = 0; i < m->import_count; i++) {
+        shake_import_t *im = &s->modules[mi]->imports[i];
+        if (im->used || strlen(im->local) != len ||
+            memcmp(im->local, name, len))
+            continue;
+        im->used = TRUE;
+        use_stmt(s, mi, im->stmt);
+        use_export(s, m->stmts[m->imports[i].stmt].module,
+                   m->imports[i].name);
+    }
+}
+
+static void use_export(js_shake_t *s, int mi, const char *name) {
+    shake_module_t *m = s->modules[mi];
+    BOOL found;
+    int i;
+
+    if (m->external)
+        return;
+    for (i = 0; i < m->used_count; i++) {
+        if (!strcmp(m->used_exports[i], name))
+            return;
+    }
+    m->used_exports = shake_grow(m->used_exports, &m->used_size,
+                                 m->used_count, sizeof(m->used_exports[0]));
+    m->used_exports[m->used_count++] = strdup(name);
+    load_module(s, mi);
+
+    found = FALSE;
+    for (i = 0; i < s->modules[mi]->export_count; i++) {
+        shake_export_t *ex = &s->modules[mi]->exports[i];
+        const char *local = ex->local;
+        if (strcmp(name, "*") && strcmp(ex->name, name))
+            continue;
+        if (!strcmp(ex->name, "*")) {
+            /* export * from, searched below */
+            if (!strcmp(name, "*"))
+                use_export(s, s->modules[mi]->stmts[ex->stmt].module, "*");
+            continue;
+        }
+        found = TRUE;
+        ex->used = TRUE;
+        if (ex->stmt < 0 ||
+            s->modules[mi]->stmts[ex->stmt].type == STMT_EXPORT_LIST)
+            reference(s, mi, local, strlen(local));
+        else
+            use_export(s, s->modules[mi]->stmts[ex->stmt].module, local);
+    }
+    if (found || !strcmp(name, "*"))
+        return;
+    for (i = 0; i < s->modules[mi]->export_count; i++) {
+        shake_export_t *ex = &s->modules[mi]->exports[i];
+        if (!strcmp(ex->name, "*") && !ex->local)
+            use_export(s, s->modules[mi]->stmts[ex->stmt].module, name);
+    }
+}
+
+/* references of a function, or of the top level code if fi < 0 */
+static void process_refs(js_shake_t *s, int mi, int fi) {
+    shake_module_t *m = s->modules[mi];
+    int i, start, end, target;
+
+    if (fi < 0) {
+        start = 0;
+        end = m->token_count - 1;
+    } else {
+        start = m->funcs[fi].tok_start;
+        end = m->funcs[fi].tok_end;
+    }
+    for (i = start; i <= end; i++) {
+        if (fi < 0 && m->owner[i] == OWNER_DECL)
+            continue;
+        if (m->tokens[i].type != TOK_IDENT)
+            continue;
+        /* property, but not spread */
+        if (tok_is(m, i - 1, ".") && !tok_is(m, i - 2, "."))
+            continue;
+        if (tok_is(m, i, "import") && tok_is(m, i + 1, "(")) {
+            if (tok_type(m, i + 2, TOK_STRING) && tok_is(m, i + 3, ")")) {
+                target = import_module(s, mi, i + 2);
+                use_export(s, target, "*");
+            } else if (!s->disabled) {
+                fprintf(stderr, "Warning: '%s' has a dynamic import, tree "
+                        "shaking is disabled\n", m->name);
+                s->disabled = TRUE;
+            }
+            continue;
+        }
+        reference(s, mi, (const char *)m->buf + m->tokens[i].start,
+                  m->tokens[i].len);
+    }
+}
+
+js_shake_t *js_shake_new(js_shake_external_func *is_external, void *opaque) {
+    js_shake_t *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->is_external = is_external;
+    s->opaque = opaque;
+    return s;
+}
+
+void js_shake_free(js_shake_t *s) {
+    int i, j;
+
+    for (i = 0; i < s->count; i++) {
+        shake_module_t *m = s->modules[i];
+        for (j = 0; j < m->func_count; j++)
+            free(m->funcs[j].name);
+        for (j = 0; j < m->import_count; j++) {
+            free(m->imports[j].local);
+            free(m->imports[j].name);
+        }
+        for (j = 0; j < m->export_count; j++) {
+            free(m->exports[j].name);
+            free(m->exports[j].local);
+        }
+        for (j = 0; j < m->used_count; j++)
+            free(m->used_exports[j]);
+        free(m->used_exports);
+        free(m->funcs);
+        free(m->imports);
+        free(m->exports);
+        free(m->stmts);
+        free(m->tokens);
+        free(m->owner);
+        free(m->buf);
+        free(m->out);
+        free(m->name);
+        free(m);
+    }
+    free(s->modules);
+    free(s->work);
+    free(s);
+}
+
+int js_shake_add_entry(js_shake_t *s, const char *filename) {
+    int mi = get_module(s, filename);
+    load_module(s, mi);
+    /* the exports of the input files are the interface of the library or
+       module set, they are used by its importers */
+    use_export(s, mi, "*");
+    return s->modules[mi]->external ? -1 : 0;
+}
+
+static void blank(shake_module_t *m, int tok_start, int tok_end) {
+    size_t i, start, end;
+
+    start = m->tokens[tok_start].start;
+    end = m->tokens[tok_end].start + m->tokens[tok_end].len;
+    for (i = start; i < end; i++) {
+        if (m->out[i] != '\n' && m->out[i] != '\r')
+            m->out[i] = ' ';
+    }
+}
+
+/* process the references of the entries, then blank the code which
+   is not used. Returns -1 if the tree shaking was disabled. */
+int js_shake_run(js_shake_t *s) {
+    shake_module_t *m;
+    int i, j, mi, fi;
+
+    while (s->work_count > 0 && !s->disabled) {
+        fi = s->work[--s->work_count];
+        mi = s->work[--s->work_count];
+        process_refs(s, mi, fi);
+    }
+    if (s->disabled)
+        return -1;
+
+    for (i = 0; i < s->count; i++) {
+        m = s->modules[i];
+        if (!m->loaded)
+            continue;
+        m->out = malloc(m->len + 1);
+        memcpy(m->out, m->buf, m->len);
+        m->out[m->len] = '\0';
+        for (j = 0; j < m->func_count; j++) {
+            if (!m->funcs[j].live)
+                blank(m, m->funcs[j].tok_start, m->funcs[j].tok_end);
+        }
+        for (j = 0; j < m->stmt_count; j++) {
+            if (m->stmts[j].type == STMT_IMPORT && !m->stmts[j].used)
+                blank(m, m->stmts[j].tok_start, m->stmts[j].tok_end);
+        }
+        for (j = 0; j < m->import_count; j++) {
+            shake_import_t *im = &m->imports[j];
+            if (im->braced && !im->used && m->stmts[im->stmt].used)
+                blank(m, im->tok_start, im->tok_end);
+        }
+        for (j = 0; j < m->export_count; j++) {
+            shake_export_t *ex = &m->exports[j];
+            if (ex->braced && !ex->used && ex->stmt >= 0 &&
+                m->stmts[ex->stmt].type == STMT_REEXPORT)
+                blank(m, ex->tok_start, ex->tok_end);
+        }
+    }
+    return 0;
+}
+
+/* source of a module after tree shaking, NULL if it is unchanged or was
+   not analyzed */
+const char *js_shake_get_source(js_shake_t *s, const char *name,
+                                size_t *plen) {
+    int i;
+
+    if (s->disabled)
+        return NULL;
+    for (i = 0; i < s->count; i++) {
+        if (s->modules[i]->out && !strcmp(s->modules[i]->name, name)) {
+            *plen = s->modules[i]->len;
+            return s->modules[i]->out;
+        }
+    }
+    return NULL;
+}
+
+static size_t token_range_size(const shake_module_t *m, int start, int end) {
+    return m->tokens[end].start + m->tokens[end].len - m->tokens[start].start;
+}
+
+/* print the removed functions, imports and modules if verbose, and their
+   total */
+void js_shake_report(js_shake_t *s, FILE *f, int verbose) {
+    const shake_module_t *m;
+    int i, j, func_count, import_count, module_count;
+    size_t size;
+
+    if (s->disabled)
+        return;
+    func_count = import_count = module_count = 0;
+    size = 0;
+    for (i = 0; i < s->count; i++) {
+        m = s->modules[i];
+        if (m->external)
+            continue;
+        if (!m->loaded) {
+            if (verbose)
+                fprintf(f, "tree shaking: removed module '%s'\n", m->name);
+            module_count++;
+            size += m->len;
+            continue;
+        }
+        for (j = 0; j < m->func_count; j++) {
+            if (m->funcs[j].live)
+                continue;
+            if (verbose)
+                fprintf(f, "tree shaking: removed function '%s' from '%s'\n",
+                        m->funcs[j].name, m->name);
+            func_count++;
+            size += token_range_size(m, m->funcs[j].tok_start,
+                                     m->funcs[j].tok_end);
+        }
+        for (j = 0; j < m->stmt_count; j++) {
+            const shake_stmt_t *st = &m->stmts[j];
+            if (st->type != STMT_IMPORT || st->used)
+                continue;
+            if (verbose)
+                fprintf(f, "tree shaking: removed import of '%s' from '%s'\n",
+                        s->modules[st->module]->name, m->name);
+            import_count++;
+        }
+    }
+    fprintf(f, "tree shaking: removed %d functions, %d imports and %d "
+            "modules (%u bytes of source)\n", func_count, import_count,
+            module_count, (unsigned int)size);
+}
+
+int js_shake_has_lexical_decl(const char *buf, size_t len) {
+    shake_module_t m;
+    size_t start;
+    int i, ret;
+
+    start = 0;
+    if (len >= 2 && buf[0] == '#' && buf[1] == '!') {
+        while (start < len && buf[start] != '\n')
+            start++;
+    }
+    memset(&m, 0, sizeof(m));
+    m.buf = (uint8_t *)buf + start;
+    m.len = len - start;
+    ret = tokenize(&m) < 0;
+    for (i = 0; i < m.token_count && !ret; i++) {
+        if (m.tokens[i].depth == 0 && m.tokens[i].type == TOK_IDENT &&
+            (tok_is(&m, i, "let") || tok_is(&m, i, "const") ||
+             tok_is(&m, i, "class")))
+            ret = TRUE;
+    }
+    free(m.tokens);
+    return ret;
+}
+
+int js_shake_dynamic_imports(const char *name, const char *buf, size_t len,
+                             char ***pnames) {
+    shake_module_t m;
+    char **names, *spec;
+    int i, count, size;
+
+    memset(&m, 0, sizeof(m));
+    m.buf = (uint8_t *)buf;
+    m.len = len;
+    if (tokenize(&m) < 0) {
+        free(m.tokens);
+        return -1;
+    }
+    names = NULL;
+    count = size = 0;
+    for (i = 0; i < m.token_count; i++) {
+        if (!tok_is(&m, i, "import") || tok_is(&m, i - 1, ".") ||
+            !tok_is(&m, i + 1, "(") || !tok_type(&m, i + 2, TOK_STRING) ||
+            !tok_is(&m, i + 3, ")"))
+            continue;
+        spec = tok_str(&m, i + 2);
+        names = shake_grow(names, &size, count, sizeof(names[0]));
+        names[count++] = normalize_name(name, spec);
+        free(spec);
+    }
+    free(m.tokens);
+    *pnames = names;
+    return count;
+}
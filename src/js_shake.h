@@ -0,0 +1,42 @@
+#ifndef JS_SHAKE_H
+#define JS_SHAKE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Tree shaking of ES modules before their compilation (js2c -T): the
+   static imports and exports are followed from the entry modules, and
+   the function declarations which cannot be reached are removed from the
+   sources, as well as the imports of side effect free modules whose
+   bindings are not used. The removed code is replaced with spaces so
+   that line numbers are kept. */
+
+typedef struct js_shake_t js_shake_t;
+
+/* returns non zero if the module is not a JS file compiled by js2c */
+typedef int js_shake_external_func(const char *module_name, void *opaque);
+
+js_shake_t *js_shake_new(js_shake_external_func *, void *);
+
+void js_shake_free(js_shake_t *);
+
+int js_shake_add_entry(js_shake_t *, const char *);
+
+int js_shake_run(js_shake_t *);
+
+const char *js_shake_get_source(js_shake_t *, const char *, size_t *);
+
+void js_shake_report(js_shake_t *, FILE *, int);
+
+/* the tokenizer is also used on the global scripts pre-evaluated by js2c
+   -p: non zero if the script may declare let, const or class bindings
+   outside of any block, or cannot be tokenized */
+int js_shake_has_lexical_decl(const char *, size_t);
+
+/* names of the modules imported with import('literal') by the module or
+   script of the given name, normalized like QuickJS does. Returns their
+   count, the names and the array must be freed, or -1 if the source
+   cannot be tokenized. */
+int js_shake_dynamic_imports(const char *, const char *, size_t, char ***);
+
+#endif /* JS_SHAKE_H */
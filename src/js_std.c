@@ -3,8 +3,12 @@
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <malloc.h>
 #include "cutils.h"
 #include "quickjs.h"
+#include "js_std.h"
+#include "js_lz.h"
 
 static JSValue js_print(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
     int i;
@@ -23,6 +27,699 @@ static JSValue js_print(JSContext *ctx, JSValueConst this_val, int argc, JSValue
     return JS_UNDEFINED;
 }
 
+/* state of a runtime created by js_std_new_runtime(). Allocations go
+   through track_malloc_functions, which forwards them to the allocator of
+   the options and records the peak of malloc_size. */
+struct js_std_runtime_t {
+    JSRuntime *rt;
+    const JSMallocFunctions *mf;
+    void *mf_opaque;
+    size_t max_stack_size;
+    /* copy of the JSMallocState, updated on each allocation */
+    size_t malloc_size, malloc_count, malloc_limit, malloc_peak;
+    int64_t gc_count;
+    /* pending timers of all the contexts, as a binary heap on deadline */
+    struct js_std_timer_t **timers;
+    int timer_count;
+    int timer_size;
+    int32_t timer_id;
+    struct js_std_timer_t *running_timer;
+    struct js_std_profile_t *profile;
+    /* the running JS code is interrupted after deadline (in us), 0 if none */
+    int64_t deadline;
+    BOOL timed_out;
+    /* context without user code holding the buffer, byteOffset and
+       byteLength getters of the typed arrays and DataViews, created on
+       first use by get_view_buffer() */
+    JSContext *view_ctx;
+    JSValue view_getters[2][3];
+};
+
+/* same as the default allocator of QuickJS */
+#define MALLOC_OVERHEAD 8
+
+static void *def_malloc(JSMallocState *s, size_t size) {
+    void *ptr;
+
+    if (s->malloc_size + size > s->malloc_limit)
+        return NULL;
+    ptr = malloc(size);
+    if (!ptr)
+        return NULL;
+    s->malloc_count++;
+    s->malloc_size += malloc_usable_size(ptr) + MALLOC_OVERHEAD;
+    return ptr;
+}
+
+static void def_free(JSMallocState *s, void *ptr) {
+    if (!ptr)
+        return;
+    s->malloc_count--;
+    s->malloc_size -= malloc_usable_size(ptr) + MALLOC_OVERHEAD;
+    free(ptr);
+}
+
+static void *def_realloc(JSMallocState *s, void *ptr, size_t size) {
+    size_t old_size;
+
+    if (!ptr) {
+        if (size == 0)
+            return NULL;
+        return def_malloc(s, size);
+    }
+    old_size = malloc_usable_size(ptr);
+    if (size == 0) {
+        s->malloc_count--;
+        s->malloc_size -= old_size + MALLOC_OVERHEAD;
+        free(ptr);
+        return NULL;
+    }
+    if (s->malloc_size + size - old_size > s->malloc_limit)
+        return NULL;
+    ptr = realloc(ptr, size);
+    if (!ptr)
+        return NULL;
+    s->malloc_size += malloc_usable_size(ptr) - old_size;
+    return ptr;
+}
+
+static size_t def_malloc_usable_size(const void *ptr) {
+    return malloc_usable_size((void *)ptr);
+}
+
+static const JSMallocFunctions def_malloc_functions = {
+    def_malloc,
+    def_free,
+    def_realloc,
+    def_malloc_usable_size,
+};
+
+/* js_malloc_usable_size() does not get the JSMallocState, so it cannot
+   tell the runtimes apart: the usable size is only given while all the
+   runtimes use the same function, otherwise it is 0, which QuickJS takes
+   as no room after the requested size */
+static size_t (*track_usable_size)(const void *);
+static BOOL track_usable_mixed;
+
+static void track_add_usable_size(size_t (*fn)(const void *)) {
+    size_t (*expected)(const void *) = NULL;
+
+    if (!fn || (!__atomic_compare_exchange_n(&track_usable_size, &expected,
+                                             fn, FALSE, __ATOMIC_SEQ_CST,
+                                             __ATOMIC_SEQ_CST) &&
+                expected != fn))
+        __atomic_store_n(&track_usable_mixed, TRUE, __ATOMIC_SEQ_CST);
+}
+
+/* the allocator of the options sees its own opaque in the JSMallocState,
+   a runtime is only used by one thread at a time */
+static inline js_std_runtime_t *track_enter(JSMallocState *s) {
+    js_std_runtime_t *srt = s->opaque;
+
+    s->opaque = srt->mf_opaque;
+    return srt;
+}
+
+static inline void track_leave(JSMallocState *s, js_std_runtime_t *srt) {
+    s->opaque = srt;
+    srt->malloc_size = s->malloc_size;
+    srt->malloc_count = s->malloc_count;
+    srt->malloc_limit = s->malloc_limit;
+    if (s->malloc_size > srt->malloc_peak)
+        srt->malloc_peak = s->malloc_size;
+}
+
+static void *track_malloc(JSMallocState *s, size_t size) {
+    js_std_runtime_t *srt = track_enter(s);
+    void *ptr;
+
+    ptr = srt->mf->js_malloc(s, size);
+    track_leave(s, srt);
+    return ptr;
+}
+
+static void track_free(JSMallocState *s, void *ptr) {
+    js_std_runtime_t *srt = track_enter(s);
+
+    srt->mf->js_free(s, ptr);
+    track_leave(s, srt);
+}
+
+static void *track_realloc(JSMallocState *s, void *ptr, size_t size) {
+    js_std_runtime_t *srt = track_enter(s);
+
+    ptr = srt->mf->js_realloc(s, ptr, size);
+    track_leave(s, srt);
+    return ptr;
+}
+
+static size_t track_malloc_usable_size(const void *ptr) {
+    size_t (*fn)(const void *);
+
+    if (__atomic_load_n(&track_usable_mixed, __ATOMIC_SEQ_CST))
+        return 0;
+    fn = __atomic_load_n(&track_usable_size, __ATOMIC_SEQ_CST);
+    return fn ? fn(ptr) : 0;
+}
+
+static const JSMallocFunctions track_malloc_functions = {
+    track_malloc,
+    track_free,
+    track_realloc,
+    track_malloc_usable_size,
+};
+
+js_std_runtime_t *js_std_new_runtime(const js_std_runtime_options_t *options) {
+    js_std_runtime_t *srt;
+
+    srt = calloc(1, sizeof(*srt));
+    if (!srt)
+        return NULL;
+    srt->mf = &def_malloc_functions;
+    if (options && options->mf) {
+        srt->mf = options->mf;
+        srt->mf_opaque = options->mf_opaque;
+    }
+    /* before the runtime allocates anything */
+    track_add_usable_size(srt->mf->js_malloc_usable_size);
+    srt->rt = JS_NewRuntime2(&track_malloc_functions, srt);
+    if (!srt->rt) {
+        free(srt);
+        return NULL;
+    }
+    if (options) {
+        if (options->memory_limit)
+            JS_SetMemoryLimit(srt->rt, options->memory_limit);
+        if (options->gc_threshold)
+            JS_SetGCThreshold(srt->rt, options->gc_threshold);
+        srt->max_stack_size = options->max_stack_size;
+    }
+    return srt;
+}
+
+static void profile_finish(struct js_std_profile_t *p);
+
+void js_std_free_runtime(js_std_runtime_t *srt) {
+    int i, j;
+
+    if (srt->profile)
+        profile_finish(srt->profile);
+    if (srt->view_ctx) {
+        for (i = 0; i < countof(srt->view_getters); i++) {
+            for (j = 0; j < countof(srt->view_getters[i]); j++)
+                JS_FreeValue(srt->view_ctx, srt->view_getters[i][j]);
+        }
+        JS_FreeContext(srt->view_ctx);
+    }
+    JS_FreeRuntime(srt->rt);
+    free(srt->timers);
+    free(srt);
+}
+
+JSRuntime *js_std_get_runtime(js_std_runtime_t *srt) {
+    return srt->rt;
+}
+
+JSContext *js_std_new_context(js_std_runtime_t *srt) {
+    JSContext *ctx;
+
+    ctx = JS_NewContext(srt->rt);
+    if (!ctx)
+        return NULL;
+    if (srt->max_stack_size)
+        JS_SetMaxStackSize(ctx, srt->max_stack_size);
+    JS_SetContextOpaque(ctx, srt);
+    return ctx;
+}
+
+js_std_runtime_t *js_std_get_state(JSContext *ctx) {
+    return JS_GetContextOpaque(ctx);
+}
+
+void js_std_run_gc(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+
+    JS_RunGC(JS_GetRuntime(ctx));
+    if (srt)
+        srt->gc_count++;
+}
+
+void js_std_get_stats(JSContext *ctx, js_std_stats_t *stats, int heap) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    JSMemoryUsage mu;
+
+    memset(stats, 0, sizeof(*stats));
+    if (srt) {
+        stats->malloc_size = srt->malloc_size;
+        stats->malloc_limit = srt->malloc_limit;
+        stats->malloc_count = srt->malloc_count;
+        stats->malloc_peak = srt->malloc_peak;
+        stats->gc_count = srt->gc_count;
+    }
+    /* walking the heap is proportional to its size */
+    if (!heap)
+        return;
+    JS_ComputeMemoryUsage(JS_GetRuntime(ctx), &mu);
+    stats->malloc_size = mu.malloc_size;
+    stats->malloc_limit = mu.malloc_limit;
+    stats->malloc_count = mu.malloc_count;
+    stats->memory_used_size = mu.memory_used_size;
+    stats->memory_used_count = mu.memory_used_count;
+    stats->atom_count = mu.atom_count;
+    stats->atom_size = mu.atom_size;
+    stats->str_count = mu.str_count;
+    stats->str_size = mu.str_size;
+    stats->obj_count = mu.obj_count;
+    stats->obj_size = mu.obj_size;
+    stats->prop_count = mu.prop_count;
+    stats->prop_size = mu.prop_size;
+    stats->shape_count = mu.shape_count;
+    stats->shape_size = mu.shape_size;
+    stats->js_func_count = mu.js_func_count;
+    stats->js_func_size = mu.js_func_size;
+    stats->js_func_code_size = mu.js_func_code_size;
+    stats->c_func_count = mu.c_func_count;
+    stats->array_count = mu.array_count;
+    stats->binary_object_count = mu.binary_object_count;
+    stats->binary_object_size = mu.binary_object_size;
+}
+
+/* sampling profiler. The interrupt handler, which QuickJS calls every few
+   thousand function calls and loop iterations, takes a sample once the
+   period has elapsed: the JS stack is read from the backtrace of an error
+   thrown and caught right away. Samples are kept in a ring buffer
+   allocated when the profiler starts, the oldest being overwritten. */
+
+#define PROFILE_INTERVAL_US 10000
+#define PROFILE_SAMPLE_COUNT 2048
+#define PROFILE_MAX_DEPTH 64
+
+typedef struct js_std_profile_t {
+    JSContext *ctx;         /* context whose stacks are sampled */
+    int64_t interval_us;
+    int64_t next_sample;
+    int sample_count;
+    int max_depth;
+    uint32_t *frames;       /* frames of each sample, innermost first */
+    uint16_t *depths;
+    int64_t total;          /* samples taken, the ring has the last ones */
+    BOOL sampling;
+    /* interned frame names, hash gives their index + 1 */
+    char **names;
+    int name_count, name_size;
+    uint32_t *hash;
+    int hash_size;
+    char *dump_filename;
+} js_std_profile_t;
+
+static int64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+}
+
+static uint32_t profile_hash(const char *str, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)str[i]) * 16777619u;
+    return h;
+}
+
+/* index of a frame name, -1 if out of memory */
+static int profile_intern(js_std_profile_t *p, const char *str, size_t len) {
+    uint32_t h, *tab;
+    char *name, **names;
+    int i, j, size;
+
+    if (2 * (p->name_count + 1) > p->hash_size) {
+        size = p->hash_size ? p->hash_size * 2 : 256;
+        tab = calloc(size, sizeof(tab[0]));
+        if (!tab)
+            return -1;
+        for (i = 0; i < p->name_count; i++) {
+            const char *n = p->names[i];
+            h = profile_hash(n, strlen(n)) & (size - 1);
+            while (tab[h])
+                h = (h + 1) & (size - 1);
+            tab[h] = i + 1;
+        }
+        free(p->hash);
+        p->hash = tab;
+        p->hash_size = size;
+    }
+    h = profile_hash(str, len) & (p->hash_size - 1);
+    while ((j = p->hash[h]) != 0) {
+        name = p->names[j - 1];
+        if (!strncmp(name, str, len) && name[len] == '\0')
+            return j - 1;
+        h = (h + 1) & (p->hash_size - 1);
+    }
+    if (p->name_count == p->name_size) {
+        size = p->name_size + (p->name_size >> 1) + 16;
+        names = realloc(p->names, sizeof(names[0]) * size);
+        if (!names)
+            return -1;
+        p->names = names;
+        p->name_size = size;
+    }
+    name = malloc(len + 1);
+    if (!name)
+        return -1;
+    memcpy(name, str, len);
+    name[len] = '\0';
+    p->names[p->name_count] = name;
+    p->hash[h] = ++p->name_count;
+    return p->name_count - 1;
+}
+
+/* frame of a backtrace line '    at func (file:line)', the line number is
+   dropped so that a function has one frame */
+static int profile_frame(js_std_profile_t *p, const char *line, size_t len) {
+    const char *end = line + len, *q;
+    char buf[256];
+    int i, n;
+
+    while (line < end && *line == ' ')
+        line++;
+    if (end - line > 3 && !memcmp(line, "at ", 3))
+        line += 3;
+    if (line == end)
+        return -1;
+    n = min_int(end - line, sizeof(buf) - 1);
+    memcpy(buf, line, n);
+    if (end[-1] == ')') {
+        for (q = end - 2; q > line && *q >= '0' && *q <= '9'; q--)
+            continue;
+        if (*q == ':' && q < end - 2) {
+            n = min_int(q - line, sizeof(buf) - 2);
+            buf[n++] = ')';
+        }
+    }
+    /* ';' separates the frames of the folded stacks */
+    for (i = 0; i < n; i++) {
+        if (buf[i] == ';')
+            buf[i] = ',';
+    }
+    return profile_intern(p, buf, n);
+}
+
+static void profile_sample(js_std_profile_t *p) {
+    JSContext *ctx = p->ctx;
+    JSValue exception, stack;
+    const char *str, *line, *end;
+    uint32_t *frames;
+    int slot, depth, frame;
+
+    JS_ThrowInternalError(ctx, "profile");
+    exception = JS_GetException(ctx);
+    stack = JS_GetPropertyStr(ctx, exception, "stack");
+    str = JS_ToCString(ctx, stack);
+    JS_FreeValue(ctx, stack);
+    JS_FreeValue(ctx, exception);
+    if (!str) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return;
+    }
+    slot = p->total % p->sample_count;
+    frames = &p->frames[slot * p->max_depth];
+    depth = 0;
+    for (line = str; *line != '\0' && depth < p->max_depth; line = end) {
+        end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+        frame = profile_frame(p, line, end - line);
+        if (frame >= 0)
+            frames[depth++] = frame;
+        if (*end == '\n')
+            end++;
+    }
+    JS_FreeCString(ctx, str);
+    p->depths[slot] = depth;
+    p->total++;
+}
+
+static int js_std_interrupt_handler(JSRuntime *rt, void *opaque) {
+    js_std_runtime_t *srt = opaque;
+    js_std_profile_t *p = srt->profile;
+    int64_t now;
+
+    now = get_time_us();
+    if (srt->deadline != 0 && now >= srt->deadline) {
+        srt->timed_out = TRUE;
+        return 1;
+    }
+    if (p && p->ctx && !p->sampling && now >= p->next_sample) {
+        p->next_sample = now + p->interval_us;
+        p->sampling = TRUE;
+        profile_sample(p);
+        p->sampling = FALSE;
+    }
+    return 0;
+}
+
+/* the interrupt handler is only installed while it has something to do */
+static void update_interrupt_handler(js_std_runtime_t *srt) {
+    if (srt->profile || srt->deadline != 0)
+        JS_SetInterruptHandler(srt->rt, js_std_interrupt_handler, srt);
+    else
+        JS_SetInterruptHandler(srt->rt, NULL, NULL);
+}
+
+static void profile_free(js_std_profile_t *p) {
+    int i;
+    for (i = 0; i < p->name_count; i++)
+        free(p->names[i]);
+    free(p->names);
+    free(p->hash);
+    free(p->frames);
+    free(p->depths);
+    free(p->dump_filename);
+    free(p);
+}
+
+/* write the samples as folded stacks, 'outer;...;inner count' per line.
+   Identical stacks are merged, in the order of their first sample. */
+static int profile_write(js_std_profile_t *p, FILE *f) {
+    int n, i, j, d, first, size, *counts, *tab;
+    uint32_t h, *frames;
+
+    n = p->total < p->sample_count ? p->total : p->sample_count;
+    first = p->total < p->sample_count ? 0 : p->total % p->sample_count;
+    size = 16;
+    while (size < 2 * n)
+        size *= 2;
+    tab = malloc(sizeof(tab[0]) * size);
+    counts = calloc(max_int(n, 1), sizeof(counts[0]));
+    if (!tab || !counts) {
+        free(tab);
+        free(counts);
+        return -1;
+    }
+    memset(tab, -1, sizeof(tab[0]) * size);
+    for (i = 0; i < n; i++) {
+        int slot = (first + i) % p->sample_count;
+        frames = &p->frames[slot * p->max_depth];
+        h = profile_hash((const char *)frames,
+                         p->depths[slot] * sizeof(frames[0]));
+        for (h &= size - 1; (j = tab[h]) >= 0; h = (h + 1) & (size - 1)) {
+            if (p->depths[j] == p->depths[slot] &&
+                !memcmp(&p->frames[j * p->max_depth], frames,
+                        p->depths[slot] * sizeof(frames[0])))
+                break;
+        }
+        if (j < 0)
+            tab[h] = j = slot;
+        counts[(j - first + p->sample_count) % p->sample_count]++;
+    }
+    for (i = 0; i < n; i++) {
+        int slot = (first + i) % p->sample_count;
+        if (counts[i] == 0 || p->depths[slot] == 0)
+            continue;
+        frames = &p->frames[slot * p->max_depth];
+        for (d = p->depths[slot] - 1; d >= 0; d--) {
+            fputs(p->names[frames[d]], f);
+            if (d > 0)
+                fputc(';', f);
+        }
+        fprintf(f, " %d\n", counts[i]);
+    }
+    free(tab);
+    free(counts);
+    return n;
+}
+
+/* a context replacing a freed one (<>_reset()) keeps being profiled */
+static void profile_adopt(js_std_profile_t *p, JSContext *ctx) {
+    if (!p->ctx)
+        p->ctx = ctx;
+}
+
+/* end of a runtime: the samples of a profile started by JS2C_PROFILE (see
+   js_std_init()) are appended to its file */
+static void profile_finish(js_std_profile_t *p) {
+    FILE *f;
+
+    if (p->dump_filename) {
+        f = fopen(p->dump_filename, "a");
+        if (f) {
+            profile_write(p, f);
+            fclose(f);
+        }
+    }
+    profile_free(p);
+}
+
+int js_std_profile_start(JSContext *ctx,
+                         const js_std_profile_options_t *options) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    js_std_profile_t *p;
+
+    if (!srt)
+        return -1;
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->ctx = ctx;
+    p->interval_us = PROFILE_INTERVAL_US;
+    p->sample_count = PROFILE_SAMPLE_COUNT;
+    p->max_depth = PROFILE_MAX_DEPTH;
+    if (options) {
+        if (options->interval_us > 0)
+            p->interval_us = options->interval_us;
+        if (options->sample_count > 0)
+            p->sample_count = options->sample_count;
+        if (options->max_depth > 0)
+            p->max_depth = min_int(options->max_depth, UINT16_MAX);
+    }
+    p->frames = malloc(sizeof(p->frames[0]) * p->sample_count * p->max_depth);
+    p->depths = malloc(sizeof(p->depths[0]) * p->sample_count);
+    if (!p->frames || !p->depths) {
+        profile_free(p);
+        return -1;
+    }
+    p->next_sample = get_time_us() + p->interval_us;
+    if (srt->profile)
+        profile_free(srt->profile);
+    srt->profile = p;
+    update_interrupt_handler(srt);
+    return 0;
+}
+
+void js_std_profile_stop(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+
+    if (!srt || !srt->profile)
+        return;
+    profile_free(srt->profile);
+    srt->profile = NULL;
+    update_interrupt_handler(srt);
+}
+
+/* returns the number of samples written, -1 if the profiler is not
+   running */
+int js_std_profile_dump(JSContext *ctx, FILE *f) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+
+    if (!srt || !srt->profile)
+        return -1;
+    return profile_write(srt->profile, f);
+}
+
+/* deadlines. QuickJS throws an uncatchable error when the interrupt
+   handler returns 1, so the JS code cannot ignore the timeout. */
+
+/* the JS code running after timeout_us is interrupted, a negative
+   timeout_us removes the deadline */
+void js_std_set_deadline(JSContext *ctx, int64_t timeout_us) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+
+    if (!srt)
+        return;
+    srt->deadline = timeout_us < 0 ? 0 : get_time_us() + timeout_us;
+    srt->timed_out = FALSE;
+    update_interrupt_handler(srt);
+}
+
+/* TRUE if the deadline interrupted the JS code since it was set */
+int js_std_timed_out(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    return srt && srt->timed_out;
+}
+
+void js_std_latency_add(js_std_latency_t *lat, int64_t us, int status) {
+    int i;
+
+    lat->count++;
+    if (status == JS_STD_TIMEOUT)
+        lat->timeouts++;
+    else if (status < 0)
+        lat->errors++;
+    lat->total_us += us;
+    if (us > lat->max_us)
+        lat->max_us = us;
+    for (i = 0; i < JS_STD_LATENCY_BUCKETS - 1 && us >= ((int64_t)1 << i); i++)
+        continue;
+    lat->buckets[i]++;
+}
+
+/* upper bound in us of the latency of the fraction p of the calls, from the
+   bucket holding it */
+int64_t js_std_latency_percentile(const js_std_latency_t *lat, double p) {
+    int64_t n, sum;
+    int i;
+
+    if (lat->count == 0)
+        return 0;
+    n = (int64_t)(p * lat->count + 0.5);
+    if (n < 1)
+        n = 1;
+    sum = 0;
+    for (i = 0; i < JS_STD_LATENCY_BUCKETS - 1; i++) {
+        sum += lat->buckets[i];
+        if (sum >= n)
+            return min_int64((int64_t)1 << i, lat->max_us);
+    }
+    return lat->max_us;
+}
+
+/* call func with a deadline of budget_us (none if negative), adding its
+   latency to lat if not NULL. On timeout JS_EXCEPTION is returned and
+   js_std_timed_out() is TRUE. A deadline set by an outer call is kept if
+   it is earlier. */
+JSValue js_std_call_timed(JSContext *ctx, JSValueConst func,
+                          JSValueConst this_obj, int argc, JSValueConst *argv,
+                          int64_t budget_us, js_std_latency_t *lat) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    int64_t start, deadline, saved_deadline;
+    JSValue val;
+    int status;
+
+    start = get_time_us();
+    saved_deadline = 0;
+    if (srt) {
+        saved_deadline = srt->deadline;
+        if (budget_us >= 0) {
+            deadline = start + budget_us;
+            if (saved_deadline == 0 || deadline < saved_deadline)
+                srt->deadline = deadline;
+        }
+        srt->timed_out = FALSE;
+        update_interrupt_handler(srt);
+    }
+    val = JS_Call(ctx, func, this_obj, argc, argv);
+    status = 0;
+    if (JS_IsException(val))
+        status = srt && srt->timed_out ? JS_STD_TIMEOUT : -1;
+    if (srt) {
+        srt->deadline = saved_deadline;
+        update_interrupt_handler(srt);
+    }
+    if (lat)
+        js_std_latency_add(lat, get_time_us() - start, status);
+    return val;
+}
+
 void js_std_dump_error(JSContext *ctx) {
     JSValue exception_val, val;
     const char *stack;
@@ -45,10 +742,402 @@ void js_std_dump_error(JSContext *ctx) {
     JS_FreeValue(ctx, exception_val);
 }
 
+/* event loop: timers, pending jobs and async calls */
+
+typedef struct js_std_timer_t {
+    int64_t deadline; /* in ms */
+    int64_t interval; /* 0 for setTimeout() */
+    int32_t id;
+    int index; /* in the heap, -1 once cleared by its own callback */
+    JSContext *ctx;
+    JSValue func;
+    int argc;
+    JSValue argv[0];
+} js_std_timer_t;
+
+static int64_t get_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+}
+
+static BOOL timer_before(const js_std_timer_t *a, const js_std_timer_t *b) {
+    /* timers with the same deadline fire in creation order */
+    if (a->deadline != b->deadline)
+        return a->deadline < b->deadline;
+    return a->id < b->id;
+}
+
+static void timer_heap_set(js_std_runtime_t *srt, int i, js_std_timer_t *t) {
+    srt->timers[i] = t;
+    t->index = i;
+}
+
+static void timer_heap_up(js_std_runtime_t *srt, int i) {
+    js_std_timer_t *t = srt->timers[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!timer_before(t, srt->timers[parent]))
+            break;
+        timer_heap_set(srt, i, srt->timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(srt, i, t);
+}
+
+static void timer_heap_down(js_std_runtime_t *srt, int i) {
+    js_std_timer_t *t = srt->timers[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= srt->timer_count)
+            break;
+        if (child + 1 < srt->timer_count &&
+            timer_before(srt->timers[child + 1], srt->timers[child]))
+            child++;
+        if (!timer_before(srt->timers[child], t))
+            break;
+        timer_heap_set(srt, i, srt->timers[child]);
+        i = child;
+    }
+    timer_heap_set(srt, i, t);
+}
+
+static int timer_heap_push(js_std_runtime_t *srt, js_std_timer_t *t) {
+    js_std_timer_t **timers;
+    int size;
+
+    if (srt->timer_count >= srt->timer_size) {
+        size = max_int(16, srt->timer_size * 3 / 2);
+        timers = realloc(srt->timers, sizeof(timers[0]) * size);
+        if (!timers)
+            return -1;
+        srt->timers = timers;
+        srt->timer_size = size;
+    }
+    timer_heap_set(srt, srt->timer_count++, t);
+    timer_heap_up(srt, t->index);
+    return 0;
+}
+
+static void timer_heap_remove(js_std_runtime_t *srt, js_std_timer_t *t) {
+    int i = t->index;
+
+    srt->timer_count--;
+    if (i == srt->timer_count)
+        return;
+    timer_heap_set(srt, i, srt->timers[srt->timer_count]);
+    timer_heap_up(srt, i);
+    timer_heap_down(srt, i);
+}
+
+static void timer_free(js_std_timer_t *t) {
+    int i;
+
+    JS_FreeValue(t->ctx, t->func);
+    for (i = 0; i < t->argc; i++)
+        JS_FreeValue(t->ctx, t->argv[i]);
+    js_free(t->ctx, t);
+}
+
+static JSValue js_std_add_timer(JSContext *ctx, int argc, JSValueConst *argv,
+                                BOOL repeat) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    js_std_timer_t *t;
+    int64_t delay;
+    int i, nargs;
+
+    if (!srt)
+        return JS_ThrowInternalError(ctx, "no event loop in this context");
+    if (!JS_IsFunction(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "not a function");
+    delay = 0;
+    if (argc > 1 && JS_ToInt64(ctx, &delay, argv[1]))
+        return JS_EXCEPTION;
+    if (delay < 0)
+        delay = 0;
+    if (repeat && delay == 0)
+        delay = 1;
+    nargs = max_int(argc - 2, 0);
+    t = js_mallocz(ctx, sizeof(*t) + sizeof(t->argv[0]) * nargs);
+    if (!t)
+        return JS_EXCEPTION;
+    t->ctx = ctx;
+    t->deadline = get_time_ms() + delay;
+    t->interval = repeat ? delay : 0;
+    /* ids stay positive, 0 is never a valid id */
+    if (srt->timer_id == INT32_MAX)
+        srt->timer_id = 0;
+    t->id = ++srt->timer_id;
+    t->func = JS_DupValue(ctx, argv[0]);
+    t->argc = nargs;
+    for (i = 0; i < nargs; i++)
+        t->argv[i] = JS_DupValue(ctx, argv[i + 2]);
+    if (timer_heap_push(srt, t) < 0) {
+        timer_free(t);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    return JS_NewInt32(ctx, t->id);
+}
+
+static JSValue js_set_timeout(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    return js_std_add_timer(ctx, argc, argv, FALSE);
+}
+
+static JSValue js_set_interval(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    return js_std_add_timer(ctx, argc, argv, TRUE);
+}
+
+static JSValue js_clear_timer(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    js_std_timer_t *t;
+    int32_t id;
+    int i;
+
+    if (!srt || JS_ToInt32(ctx, &id, argv[0]))
+        return JS_UNDEFINED;
+    for (i = 0; i < srt->timer_count; i++) {
+        t = srt->timers[i];
+        if (t->id == id && t->ctx == ctx) {
+            timer_heap_remove(srt, t);
+            /* an interval cleared by its callback is freed after it */
+            if (t == srt->running_timer)
+                t->index = -1;
+            else
+                timer_free(t);
+            break;
+        }
+    }
+    return JS_UNDEFINED;
+}
+
+/* run the first timer if it expired. Returns 1 if a timer ran. */
+static int js_std_run_timer(js_std_runtime_t *srt, int64_t now) {
+    js_std_timer_t *t;
+    JSContext *ctx;
+    JSValue ret;
+
+    if (srt->timer_count == 0 || srt->timers[0]->deadline > now)
+        return 0;
+    t = srt->timers[0];
+    ctx = t->ctx;
+    if (t->interval) {
+        /* rescheduled first, so that the callback can clear it */
+        t->deadline = now + t->interval;
+        timer_heap_down(srt, 0);
+        srt->running_timer = t;
+        ret = JS_Call(ctx, t->func, JS_UNDEFINED, t->argc,
+                      (JSValueConst *)t->argv);
+        srt->running_timer = NULL;
+        if (t->index < 0)
+            timer_free(t);
+    } else {
+        timer_heap_remove(srt, t);
+        ret = JS_Call(ctx, t->func, JS_UNDEFINED, t->argc,
+                      (JSValueConst *)t->argv);
+        timer_free(t);
+    }
+    if (JS_IsException(ret))
+        js_std_dump_error(ctx);
+    JS_FreeValue(ctx, ret);
+    return 1;
+}
+
+/* execute the pending jobs (promise reactions) of the runtime */
+int js_std_run_jobs(JSContext *ctx) {
+    JSContext *ctx1;
+    int ret, count;
+
+    count = 0;
+    for (;;) {
+        ret = JS_ExecutePendingJob(JS_GetRuntime(ctx), &ctx1);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+            js_std_dump_error(ctx1);
+        count++;
+    }
+    return count;
+}
+
+/* run the pending jobs and the expired timers for at most budget_ms (-1
+   for no limit), without waiting. One expired timer is always run, so a
+   budget of 0 makes progress. Returns 1 if timers are still pending, 0
+   otherwise. */
+int js_std_loop(JSContext *ctx, int64_t budget_ms) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    int64_t start;
+
+    start = get_time_ms();
+    for (;;) {
+        js_std_run_jobs(ctx);
+        if (!srt)
+            return 0;
+        if (!js_std_run_timer(srt, get_time_ms()))
+            break;
+        if (budget_ms >= 0 && get_time_ms() - start >= budget_ms) {
+            js_std_run_jobs(ctx);
+            break;
+        }
+    }
+    return srt->timer_count != 0;
+}
+
+/* delay in ms until the next timer expires, -1 if there is none */
+int64_t js_std_next_timer(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    int64_t delay;
+
+    if (!srt || srt->timer_count == 0)
+        return -1;
+    delay = srt->timers[0]->deadline - get_time_ms();
+    return delay < 0 ? 0 : delay;
+}
+
+/* settles the state object of an async call (func_data[0]) */
+static JSValue js_std_settle(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *func_data) {
+    JS_SetPropertyStr(ctx, func_data[0], "value",
+                      JS_DupValue(ctx, argc > 0 ? argv[0] : JS_UNDEFINED));
+    JS_SetPropertyStr(ctx, func_data[0], "state", JS_NewInt32(ctx, magic));
+    return JS_UNDEFINED;
+}
+
+/* call func and return an object tracking its result, which is settled
+   when the returned promise (if any) is. Its state is polled with
+   js_std_async_state(), the event loop must run for it to change. */
+JSValue js_std_call_async(JSContext *ctx, JSValueConst func, JSValueConst this_obj, int argc, JSValueConst *argv) {
+    JSValue res, ret, then, args[2], val;
+    int i;
+
+    res = JS_NewObject(ctx);
+    if (JS_IsException(res))
+        return res;
+    JS_SetPropertyStr(ctx, res, "state", JS_NewInt32(ctx, JS_STD_PENDING));
+    ret = JS_Call(ctx, func, this_obj, argc, argv);
+    if (JS_IsException(ret)) {
+        JS_SetPropertyStr(ctx, res, "value", JS_GetException(ctx));
+        JS_SetPropertyStr(ctx, res, "state", JS_NewInt32(ctx, JS_STD_REJECTED));
+        return res;
+    }
+    then = JS_UNDEFINED;
+    if (JS_IsObject(ret))
+        then = JS_GetPropertyStr(ctx, ret, "then");
+    if (!JS_IsFunction(ctx, then)) {
+        JS_FreeValue(ctx, then);
+        JS_SetPropertyStr(ctx, res, "value", ret);
+        JS_SetPropertyStr(ctx, res, "state", JS_NewInt32(ctx, JS_STD_FULFILLED));
+        return res;
+    }
+    args[0] = JS_NewCFunctionData(ctx, js_std_settle, 1, JS_STD_FULFILLED,
+                                  1, (JSValueConst *)&res);
+    args[1] = JS_NewCFunctionData(ctx, js_std_settle, 1, JS_STD_REJECTED,
+                                  1, (JSValueConst *)&res);
+    val = JS_Call(ctx, then, ret, 2, (JSValueConst *)args);
+    for (i = 0; i < 2; i++)
+        JS_FreeValue(ctx, args[i]);
+    JS_FreeValue(ctx, then);
+    JS_FreeValue(ctx, ret);
+    if (JS_IsException(val)) {
+        JS_FreeValue(ctx, res);
+        return val;
+    }
+    JS_FreeValue(ctx, val);
+    return res;
+}
+
+int js_std_async_state(JSContext *ctx, JSValueConst res) {
+    JSValue val;
+    int32_t state;
+
+    val = JS_GetPropertyStr(ctx, res, "state");
+    if (JS_ToInt32(ctx, &state, val))
+        state = JS_STD_REJECTED;
+    JS_FreeValue(ctx, val);
+    return state;
+}
+
+/* value or rejection reason of a settled async call */
+JSValue js_std_async_result(JSContext *ctx, JSValueConst res) {
+    return JS_GetPropertyStr(ctx, res, "value");
+}
+
+/* run the event loop until the async call is settled or timeout_ms (-1
+   for no limit) elapsed, sleeping until the next timer when idle. Returns
+   the state of the call. */
+int js_std_await(JSContext *ctx, JSValueConst res, int64_t timeout_ms) {
+    int64_t start, delay, elapsed;
+    struct timespec ts;
+    int state;
+
+    start = get_time_ms();
+    for (;;) {
+        /* a timer re-armed from its callback must not hide the timeout */
+        if (timeout_ms >= 0)
+            js_std_loop(ctx, max_int64(timeout_ms - (get_time_ms() - start), 0));
+        else
+            js_std_loop(ctx, 0);
+        state = js_std_async_state(ctx, res);
+        if (state != JS_STD_PENDING)
+            break;
+        delay = js_std_next_timer(ctx);
+        if (delay < 0)
+            break; /* nothing can settle it anymore */
+        if (timeout_ms >= 0) {
+            elapsed = get_time_ms() - start;
+            if (elapsed >= timeout_ms)
+                break;
+            delay = min_int64(delay, timeout_ms - elapsed);
+        }
+        ts.tv_sec = delay / 1000;
+        ts.tv_nsec = (delay % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+    }
+    return state;
+}
+
+/* free the timers of a context, must be called before JS_FreeContext() */
+void js_std_cleanup(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    js_std_timer_t *t;
+    int i, n;
+
+    if (!srt)
+        return;
+    if (srt->profile && srt->profile->ctx == ctx)
+        srt->profile->ctx = NULL;
+    n = 0;
+    for (i = 0; i < srt->timer_count; i++) {
+        t = srt->timers[i];
+        if (t->ctx == ctx)
+            timer_free(t);
+        else
+            timer_heap_set(srt, n++, t);
+    }
+    srt->timer_count = n;
+    for (i = n / 2 - 1; i >= 0; i--)
+        timer_heap_down(srt, i);
+}
+
 void js_std_init(JSContext *ctx) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
     JSValue global_obj, console, args;
+    const char *filename;
     int i;
 
+    /* JS2C_PROFILE=file profiles every runtime, the folded stacks are
+       appended to file when the runtime is freed */
+    filename = getenv("JS2C_PROFILE");
+    if (filename && *filename != '\0' && srt && !srt->profile &&
+        js_std_profile_start(ctx, NULL) == 0)
+        srt->profile->dump_filename = strdup(filename);
+    /* the context freed by <>_reset() was cleaned up before this one is
+       initialized */
+    if (srt && srt->profile)
+        profile_adopt(srt->profile, ctx);
+
     /* XXX: should these global definitions be enumerable? */
     global_obj = JS_GetGlobalObject(ctx);
 
@@ -59,6 +1148,15 @@ void js_std_init(JSContext *ctx) {
 
     JS_SetPropertyStr(ctx, global_obj, "print",
                       JS_NewCFunction(ctx, js_print, "print", 1));
+
+    JS_SetPropertyStr(ctx, global_obj, "setTimeout",
+                      JS_NewCFunction(ctx, js_set_timeout, "setTimeout", 2));
+    JS_SetPropertyStr(ctx, global_obj, "setInterval",
+                      JS_NewCFunction(ctx, js_set_interval, "setInterval", 2));
+    JS_SetPropertyStr(ctx, global_obj, "clearTimeout",
+                      JS_NewCFunction(ctx, js_clear_timer, "clearTimeout", 1));
+    JS_SetPropertyStr(ctx, global_obj, "clearInterval",
+                      JS_NewCFunction(ctx, js_clear_timer, "clearInterval", 1));
     
     JS_FreeValue(ctx, global_obj);
 }
@@ -181,3 +1279,483 @@ void js_std_eval_binary(JSContext *ctx, const uint8_t *buf, size_t buf_len, int
         JS_FreeValue(ctx, val);
     }
 }
+
+JSValue js_std_new_buffer(JSContext *ctx, uint8_t *buf, size_t len,
+                          JSFreeArrayBufferDataFunc *free_func, void *opaque) {
+    return JS_NewArrayBuffer(ctx, buf, len, free_func, opaque, FALSE);
+}
+
+static const struct {
+    const char *name;
+    uint8_t size_log2;
+} typed_array_types[] = {
+    [JS_STD_INT8_ARRAY] = { "Int8Array", 0 },
+    [JS_STD_UINT8_ARRAY] = { "Uint8Array", 0 },
+    [JS_STD_UINT8C_ARRAY] = { "Uint8ClampedArray", 0 },
+    [JS_STD_INT16_ARRAY] = { "Int16Array", 1 },
+    [JS_STD_UINT16_ARRAY] = { "Uint16Array", 1 },
+    [JS_STD_INT32_ARRAY] = { "Int32Array", 2 },
+    [JS_STD_UINT32_ARRAY] = { "Uint32Array", 2 },
+    [JS_STD_FLOAT32_ARRAY] = { "Float32Array", 2 },
+    [JS_STD_FLOAT64_ARRAY] = { "Float64Array", 3 },
+};
+
+/* the view is built by the global constructor, QuickJS has no C API for
+   it */
+static JSValue new_typed_array_view(JSContext *ctx, js_std_typed_array_t type,
+                                    JSValueConst buffer) {
+    JSValue global_obj, ctor, obj;
+
+    global_obj = JS_GetGlobalObject(ctx);
+    ctor = JS_GetPropertyStr(ctx, global_obj, typed_array_types[type].name);
+    JS_FreeValue(ctx, global_obj);
+    obj = JS_CallConstructor(ctx, ctor, 1, &buffer);
+    JS_FreeValue(ctx, ctor);
+    return obj;
+}
+
+/* typed array of len elements over buf */
+JSValue js_std_new_typed_array(JSContext *ctx, js_std_typed_array_t type,
+                               void *buf, size_t len,
+                               JSFreeArrayBufferDataFunc *free_func,
+                               void *opaque) {
+    JSValue buffer, obj;
+
+    if ((unsigned int)type >= countof(typed_array_types))
+        return JS_ThrowRangeError(ctx, "invalid typed array type");
+    buffer = js_std_new_buffer(ctx, buf,
+                               len << typed_array_types[type].size_log2,
+                               free_func, opaque);
+    if (JS_IsException(buffer))
+        return buffer;
+    obj = new_typed_array_view(ctx, type, buffer);
+    JS_FreeValue(ctx, buffer);
+    return obj;
+}
+
+static const char view_getters_source[] =
+    "[Object.getPrototypeOf(Uint8Array.prototype), DataView.prototype]"
+    ".map(p => ['buffer', 'byteOffset', 'byteLength']"
+    ".map(n => Object.getOwnPropertyDescriptor(p, n).get))";
+
+/* the properties of a view may be redefined by the scripts, and this
+   QuickJS version has no C API to get them, so the original getters are
+   taken from a context where no script ran */
+static int init_view_getters(js_std_runtime_t *srt) {
+    JSContext *ctx;
+    JSValue val, getters;
+    int i, j;
+
+    ctx = JS_NewContext(srt->rt);
+    if (!ctx)
+        return -1;
+    val = JS_Eval(ctx, view_getters_source, sizeof(view_getters_source) - 1,
+                  "<views>", JS_EVAL_TYPE_GLOBAL);
+    if (JS_IsException(val)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        JS_FreeContext(ctx);
+        return -1;
+    }
+    for (i = 0; i < countof(srt->view_getters); i++) {
+        getters = JS_GetPropertyUint32(ctx, val, i);
+        for (j = 0; j < countof(srt->view_getters[i]); j++)
+            srt->view_getters[i][j] = JS_GetPropertyUint32(ctx, getters, j);
+        JS_FreeValue(ctx, getters);
+    }
+    JS_FreeValue(ctx, val);
+    srt->view_ctx = ctx;
+    return 0;
+}
+
+/* the buffer of obj if it is a typed array or a DataView, JS_UNDEFINED
+   otherwise. If poffset is not NULL, the byte offset and length of the
+   view are stored in poffset and plen. Only the original getters are
+   called, the exception of the caller is kept. */
+static JSValue get_view_buffer(JSContext *ctx, JSValueConst obj,
+                               uint32_t *poffset, uint32_t *plen) {
+    js_std_runtime_t *srt = js_std_get_state(ctx);
+    JSValue exception, buffer, val;
+    uint32_t *fields[2] = { poffset, plen };
+    int i, j;
+
+    if (!JS_IsObject(obj))
+        return JS_UNDEFINED;
+    if (!srt || (!srt->view_ctx && init_view_getters(srt) < 0))
+        return JS_UNDEFINED;
+    /* the getters throw if obj is not a view of their kind */
+    exception = JS_GetException(ctx);
+    buffer = JS_UNDEFINED;
+    for (i = 0; i < countof(srt->view_getters); i++) {
+        buffer = JS_Call(srt->view_ctx, srt->view_getters[i][0], obj, 0, NULL);
+        if (!JS_IsException(buffer))
+            break;
+        JS_FreeValue(srt->view_ctx, JS_GetException(srt->view_ctx));
+        buffer = JS_UNDEFINED;
+    }
+    if (poffset && i < countof(srt->view_getters)) {
+        for (j = 0; j < countof(fields); j++) {
+            val = JS_Call(srt->view_ctx, srt->view_getters[i][j + 1], obj,
+                          0, NULL);
+            if (JS_ToUint32(srt->view_ctx, fields[j], val)) {
+                JS_FreeValue(srt->view_ctx, JS_GetException(srt->view_ctx));
+                *fields[j] = 0;
+            }
+            JS_FreeValue(srt->view_ctx, val);
+        }
+    }
+    if (!JS_IsNull(exception))
+        JS_Throw(ctx, exception);
+    return buffer;
+}
+
+/* contents of an ArrayBuffer or of a view (typed array, DataView), without
+   copying. Returns NULL with an exception if obj has no buffer. */
+uint8_t *js_std_get_buffer(JSContext *ctx, size_t *psize, JSValueConst obj) {
+    JSValue buffer;
+    uint8_t *buf;
+    size_t size;
+    uint32_t offset, len;
+
+    buffer = get_view_buffer(ctx, obj, &offset, &len);
+    if (!JS_IsObject(buffer))
+        return JS_GetArrayBuffer(ctx, psize, obj);
+    buf = JS_GetArrayBuffer(ctx, &size, buffer);
+    JS_FreeValue(ctx, buffer);
+    if (!buf)
+        return NULL;
+    if ((size_t)offset + len > size) {
+        JS_ThrowRangeError(ctx, "out of bound view");
+        return NULL;
+    }
+    *psize = len;
+    return buf + offset;
+}
+
+/* detach an ArrayBuffer or the buffer of a typed array or DataView, so
+   that JS cannot access the memory anymore. Other objects are left as
+   is, without running any of their getters. */
+void js_std_detach_buffer(JSContext *ctx, JSValueConst obj) {
+    JSValue buffer;
+
+    if (!JS_IsObject(obj))
+        return;
+    /* does nothing if obj is not an ArrayBuffer */
+    JS_DetachArrayBuffer(ctx, obj);
+    buffer = get_view_buffer(ctx, obj, NULL, NULL);
+    if (JS_IsObject(buffer))
+        JS_DetachArrayBuffer(ctx, buffer);
+    JS_FreeValue(ctx, buffer);
+}
+
+/* call func, then detach the buffer arguments: caller owned memory can be
+   lent to JS for the duration of the call only */
+JSValue js_std_call_detach(JSContext *ctx, JSValueConst func,
+                           JSValueConst this_obj, int argc,
+                           JSValueConst *argv) {
+    JSValue ret;
+    int i;
+
+    ret = JS_Call(ctx, func, this_obj, argc, argv);
+    for (i = 0; i < argc; i++) {
+        if (JS_IsObject(argv[i]))
+            js_std_detach_buffer(ctx, argv[i]);
+    }
+    return ret;
+}
+
+static JSValue get_global_function(JSContext *ctx, const char *name) {
+    JSValue global_obj, func;
+
+    global_obj = JS_GetGlobalObject(ctx);
+    func = JS_GetPropertyStr(ctx, global_obj, name);
+    JS_FreeValue(ctx, global_obj);
+    if (!JS_IsException(func) && !JS_IsFunction(ctx, func)) {
+        JS_FreeValue(ctx, func);
+        return JS_ThrowTypeError(ctx, "%s is not a function", name);
+    }
+    return func;
+}
+
+/* call the global function name for each of the n inputs, the function is
+   looked up once. Returns -1 if a call throws, the error is printed. */
+static int call_batch(JSContext *ctx, const char *name, const void *in,
+                      void *out, size_t n, BOOL is_float) {
+    JSValue func, arg, val;
+    size_t i;
+    int ret;
+
+    func = get_global_function(ctx, name);
+    if (JS_IsException(func))
+        goto exception;
+    for (i = 0; i < n; i++) {
+        if (is_float)
+            arg = JS_NewFloat64(ctx, ((const double *)in)[i]);
+        else
+            arg = JS_NewInt64(ctx, ((const int64_t *)in)[i]);
+        val = JS_Call(ctx, func, JS_UNDEFINED, 1, (JSValueConst *)&arg);
+        JS_FreeValue(ctx, arg);
+        if (JS_IsException(val))
+            ret = -1;
+        else if (is_float)
+            ret = JS_ToFloat64(ctx, &((double *)out)[i], val);
+        else
+            ret = JS_ToInt64(ctx, &((int64_t *)out)[i], val);
+        JS_FreeValue(ctx, val);
+        if (ret) {
+            JS_FreeValue(ctx, func);
+            goto exception;
+        }
+    }
+    JS_FreeValue(ctx, func);
+    return 0;
+ exception:
+    js_std_dump_error(ctx);
+    return -1;
+}
+
+int js_std_call_batch_int64(JSContext *ctx, const char *name,
+                            const int64_t *in, int64_t *out, size_t n) {
+    return call_batch(ctx, name, in, out, n, FALSE);
+}
+
+int js_std_call_batch_float64(JSContext *ctx, const char *name,
+                              const double *in, double *out, size_t n) {
+    return call_batch(ctx, name, in, out, n, TRUE);
+}
+
+/* call the global function name once with the whole batch: name(in, out)
+   where in and out are typed arrays of n elements. out is over the C
+   array, in over a copy so that the function cannot write to the const
+   input. Both buffers are detached when the function returns. */
+int js_std_call_batch_typed(JSContext *ctx, const char *name,
+                            js_std_typed_array_t type, const void *in,
+                            void *out, size_t n) {
+    JSValue func, buffers[2], args[2], val;
+    uint8_t *copy;
+    size_t size;
+    int i, ret;
+
+    if ((unsigned int)type >= countof(typed_array_types)) {
+        JS_ThrowRangeError(ctx, "invalid typed array type");
+        goto exception;
+    }
+    func = get_global_function(ctx, name);
+    if (JS_IsException(func))
+        goto exception;
+    size = n << typed_array_types[type].size_log2;
+    copy = malloc(size ? size : 1);
+    if (!copy) {
+        JS_FreeValue(ctx, func);
+        JS_ThrowOutOfMemory(ctx);
+        goto exception;
+    }
+    memcpy(copy, in, size);
+    buffers[0] = js_std_new_buffer(ctx, copy, size, NULL, NULL);
+    buffers[1] = js_std_new_buffer(ctx, out, size, NULL, NULL);
+    args[0] = args[1] = JS_EXCEPTION;
+    for (i = 0; i < 2; i++) {
+        if (JS_IsException(buffers[i]))
+            break;
+        args[i] = new_typed_array_view(ctx, type, buffers[i]);
+        if (JS_IsException(args[i]))
+            break;
+    }
+    if (i < 2)
+        val = JS_EXCEPTION;
+    else
+        val = JS_Call(ctx, func, JS_UNDEFINED, 2, (JSValueConst *)args);
+    ret = JS_IsException(val) ? -1 : 0;
+    /* the buffers themselves, a replaced constructor may have kept them */
+    for (i = 0; i < 2; i++) {
+        JS_DetachArrayBuffer(ctx, buffers[i]);
+        JS_FreeValue(ctx, buffers[i]);
+        JS_FreeValue(ctx, args[i]);
+    }
+    JS_FreeValue(ctx, val);
+    JS_FreeValue(ctx, func);
+    free(copy);
+    if (ret == 0)
+        return 0;
+ exception:
+    js_std_dump_error(ctx);
+    return -1;
+}
+
+/* decompress bytecode embedded with js2c -z into a scratch buffer */
+static uint8_t *js_std_decompress(JSContext *ctx, const uint8_t *buf, size_t buf_len, size_t raw_len) {
+    uint8_t *raw;
+
+    raw = js_malloc(ctx, raw_len);
+    if (!raw)
+        return NULL;
+    if (js_lz_decompress(raw, raw_len, buf, buf_len) < 0) {
+        js_free(ctx, raw);
+        JS_ThrowInternalError(ctx, "corrupted compressed bytecode");
+        return NULL;
+    }
+    return raw;
+}
+
+void js_std_eval_binary_lz(JSContext *ctx, const uint8_t *buf, size_t buf_len, size_t raw_len, int load_only) {
+    uint8_t *raw;
+
+    raw = js_std_decompress(ctx, buf, buf_len, raw_len);
+    if (!raw) {
+        js_std_dump_error(ctx);
+        exit(1);
+    }
+    js_std_eval_binary(ctx, raw, raw_len, load_only);
+    js_free(ctx, raw);
+}
+
+/* read the bytecode of a global script once, to be run in several
+   contexts of the runtime with js_std_eval_function(). raw_len is the
+   uncompressed size, 0 if not compressed. The functions of the script
+   only hold atoms and constants of the runtime, so the contexts share
+   them and each one gets its own globals. */
+JSValue js_std_read_binary(JSContext *ctx, const uint8_t *buf, size_t buf_len, size_t raw_len) {
+    uint8_t *raw;
+    JSValue obj;
+
+    if (raw_len) {
+        raw = js_std_decompress(ctx, buf, buf_len, raw_len);
+        if (!raw)
+            goto exception;
+        obj = JS_ReadObject(ctx, raw, raw_len, JS_READ_OBJ_BYTECODE);
+        js_free(ctx, raw);
+    } else {
+        obj = JS_ReadObject(ctx, buf, buf_len, JS_READ_OBJ_BYTECODE);
+    }
+    if (JS_IsException(obj))
+        goto exception;
+    if (JS_VALUE_GET_TAG(obj) != JS_TAG_FUNCTION_BYTECODE) {
+        JS_FreeValue(ctx, obj);
+        JS_ThrowTypeError(ctx, "bytecode of a global script expected");
+        goto exception;
+    }
+    return obj;
+ exception:
+    js_std_dump_error(ctx);
+    exit(1);
+}
+
+/* run a script read by js_std_read_binary() in ctx */
+void js_std_eval_function(JSContext *ctx, JSValueConst fun) {
+    JSValue val;
+
+    val = JS_EvalFunction(ctx, JS_DupValue(ctx, fun));
+    if (JS_IsException(val)) {
+        js_std_dump_error(ctx);
+        exit(1);
+    }
+    JS_FreeValue(ctx, val);
+}
+
+/* define the global bindings of a snapshot written by js2c -p */
+void js_std_eval_snapshot(JSContext *ctx, const uint8_t *buf, size_t buf_len) {
+    JSValue obj, global_obj;
+    JSPropertyEnum *tab;
+    uint32_t len, i;
+
+    obj = JS_ReadObject(ctx, buf, buf_len, 0);
+    if (JS_IsException(obj))
+        goto exception;
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, obj,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+        JS_FreeValue(ctx, obj);
+        goto exception;
+    }
+    global_obj = JS_GetGlobalObject(ctx);
+    for (i = 0; i < len; i++) {
+        /* same attributes as a global 'var' declaration */
+        JS_DefinePropertyValue(ctx, global_obj, tab[i].atom,
+                               JS_GetProperty(ctx, obj, tab[i].atom),
+                               JS_PROP_ENUMERABLE | JS_PROP_WRITABLE);
+        JS_FreeAtom(ctx, tab[i].atom);
+    }
+    js_free(ctx, tab);
+    JS_FreeValue(ctx, global_obj);
+    JS_FreeValue(ctx, obj);
+    return;
+ exception:
+    js_std_dump_error(ctx);
+    exit(1);
+}
+
+void js_std_eval_snapshot_lz(JSContext *ctx, const uint8_t *buf, size_t buf_len, size_t raw_len) {
+    uint8_t *raw;
+
+    raw = js_std_decompress(ctx, buf, buf_len, raw_len);
+    if (!raw) {
+        js_std_dump_error(ctx);
+        exit(1);
+    }
+    js_std_eval_snapshot(ctx, raw, raw_len);
+    js_free(ctx, raw);
+}
+
+static const js_std_module_t *find_module(const js_std_module_t *tab,
+                                          const char *module_name) {
+    const js_std_module_t *e;
+
+    for (e = tab; e->name != NULL; e++) {
+        if (!strcmp(e->name, module_name))
+            return e;
+    }
+    return NULL;
+}
+
+static JSModuleDef *load_module(JSContext *ctx, const js_std_module_t *e) {
+    JSModuleDef *m;
+    JSValue obj;
+
+    if (e->raw_size) {
+        uint8_t *raw = js_std_decompress(ctx, e->buf, e->size, e->raw_size);
+        if (!raw)
+            return NULL;
+        obj = JS_ReadObject(ctx, raw, e->raw_size, JS_READ_OBJ_BYTECODE);
+        js_free(ctx, raw);
+    } else {
+        obj = JS_ReadObject(ctx, e->buf, e->size, JS_READ_OBJ_BYTECODE);
+    }
+    if (JS_IsException(obj))
+        return NULL;
+    if (js_module_set_import_meta(ctx, obj, 0, 0) < 0) {
+        JS_FreeValue(ctx, obj);
+        return NULL;
+    }
+    /* the module is already referenced, so we must free it */
+    m = JS_VALUE_GET_PTR(obj);
+    JS_FreeValue(ctx, obj);
+    return m;
+}
+
+/* module loader resolving imports from a NULL terminated table of embedded
+   modules (opaque), so that a module is only read when first imported */
+JSModuleDef *js_std_module_loader(JSContext *ctx, const char *module_name, void *opaque) {
+    const js_std_module_t *e;
+
+    e = find_module(opaque, module_name);
+    if (!e) {
+        JS_ThrowReferenceError(ctx, "could not load module '%s'", module_name);
+        return NULL;
+    }
+    return load_module(ctx, e);
+}
+
+/* same as js_std_module_loader() with a NULL terminated array of module
+   sets (opaque), searched in order. The context keeps the modules it has
+   loaded, so a module of a set shared by several libraries is only read
+   once per context. */
+JSModuleDef *js_std_module_set_loader(JSContext *ctx, const char *module_name, void *opaque) {
+    const js_std_module_set_t * const *sets = opaque;
+    const js_std_module_t *e;
+
+    for (; *sets != NULL; sets++) {
+        e = find_module((*sets)->modules, module_name);
+        if (e)
+            return load_module(ctx, e);
+    }
+    JS_ThrowReferenceError(ctx, "could not load module '%s'", module_name);
+    return NULL;
+}
@@ -1,5 +1,165 @@
+#ifndef JS_STD_H
+#define JS_STD_H
+
 #include "quickjs.h"
 
+/* embedded bytecode of a module, looked up by name when it is imported */
+typedef struct js_std_module_t {
+    const char *name;
+    const uint8_t *buf;
+    uint32_t size;
+    uint32_t raw_size; /* uncompressed size, 0 if not compressed */
+} js_std_module_t;
+
+/* modules built into their own library by js2c -B, shared by the libraries
+   importing them */
+typedef struct js_std_module_set_t {
+    const char *name;
+    const js_std_module_t *modules; /* NULL terminated */
+} js_std_module_set_t;
+
+/* settings of the runtime created by js_std_new_runtime(), a zero field
+   keeps the QuickJS default */
+typedef struct js_std_runtime_options_t {
+    const JSMallocFunctions *mf; /* allocator, NULL to use malloc() */
+    void *mf_opaque;
+    size_t memory_limit;
+    size_t gc_threshold;
+    size_t max_stack_size; /* applied by js_std_new_context() */
+} js_std_runtime_options_t;
+
+/* size class pool allocator, usable as mf with a js_std_pool_t as
+   mf_opaque. The pool must outlive the runtime. */
+typedef struct js_std_pool_t js_std_pool_t;
+
+extern const JSMallocFunctions js_std_pool_malloc_functions;
+
+js_std_pool_t *js_std_pool_new(void);
+
+void js_std_pool_free(js_std_pool_t *);
+
+/* state of a runtime created by js_std_new_runtime(), its contexts
+   created by js_std_new_context() reach it through their opaque */
+typedef struct js_std_runtime_t js_std_runtime_t;
+
+js_std_runtime_t *js_std_new_runtime(const js_std_runtime_options_t *);
+
+void js_std_free_runtime(js_std_runtime_t *);
+
+JSRuntime *js_std_get_runtime(js_std_runtime_t *);
+
+JSContext *js_std_new_context(js_std_runtime_t *);
+
+js_std_runtime_t *js_std_get_state(JSContext *);
+
+/* memory statistics of a runtime. Fields are only ever appended. */
+typedef struct js_std_stats_t {
+    int64_t malloc_size;
+    int64_t malloc_limit;
+    int64_t malloc_count;
+    int64_t malloc_peak;    /* high-water mark of malloc_size */
+    int64_t gc_count;       /* collections run by js_std_run_gc() */
+    /* the following fields are only set with heap != 0 */
+    int64_t memory_used_size;
+    int64_t memory_used_count;
+    int64_t atom_count;
+    int64_t atom_size;
+    int64_t str_count;
+    int64_t str_size;
+    int64_t obj_count;
+    int64_t obj_size;
+    int64_t prop_count;
+    int64_t prop_size;
+    int64_t shape_count;
+    int64_t shape_size;
+    int64_t js_func_count;
+    int64_t js_func_size;
+    int64_t js_func_code_size;
+    int64_t c_func_count;
+    int64_t array_count;
+    int64_t binary_object_count;
+    int64_t binary_object_size;
+} js_std_stats_t;
+
+void js_std_get_stats(JSContext *, js_std_stats_t *, int heap);
+
+void js_std_run_gc(JSContext *);
+
+/* sampling profiler of the JS stacks of a context, a zero field keeps the
+   default */
+typedef struct js_std_profile_options_t {
+    int interval_us;    /* sampling period, 10 ms by default */
+    int sample_count;   /* samples kept, 2048 by default */
+    int max_depth;      /* frames kept per sample, 64 by default */
+} js_std_profile_options_t;
+
+int js_std_profile_start(JSContext *, const js_std_profile_options_t *);
+
+void js_std_profile_stop(JSContext *);
+
+int js_std_profile_dump(JSContext *, FILE *);
+
+/* deadlines and latency of the calls, see js_std.c */
+#define JS_STD_TIMEOUT (-2)
+
+#define JS_STD_LATENCY_BUCKETS 32
+
+/* latency histogram: bucket i counts the calls which took less than 2^i us
+   (and at least 2^(i-1) us), the last one the longer calls */
+typedef struct js_std_latency_t {
+    int64_t count;
+    int64_t errors;     /* exceptions other than timeouts */
+    int64_t timeouts;
+    int64_t total_us;
+    int64_t max_us;
+    int64_t buckets[JS_STD_LATENCY_BUCKETS];
+} js_std_latency_t;
+
+void js_std_set_deadline(JSContext *, int64_t);
+
+int js_std_timed_out(JSContext *);
+
+void js_std_latency_add(js_std_latency_t *, int64_t, int);
+
+int64_t js_std_latency_percentile(const js_std_latency_t *, double);
+
+JSValue js_std_call_timed(JSContext *, JSValueConst, JSValueConst, int,
+                          JSValueConst *, int64_t, js_std_latency_t *);
+
+/* calls posted from any thread to a JS thread owning a context, see
+   js_dispatch.c */
+typedef struct js_std_request_t js_std_request_t;
+
+typedef void js_std_request_func(js_std_request_t *req, void *opaque);
+
+struct js_std_request_t {
+    js_std_request_func *func; /* run on the JS thread */
+    js_std_request_func *done; /* run on the JS thread after func, NULL to
+                                  wait with js_std_request_wait() */
+    int status;                /* set by func */
+    /* private */
+    js_std_request_t *next;
+    int finished;
+};
+
+typedef struct js_std_dispatcher_t js_std_dispatcher_t;
+
+typedef JSContext *js_std_dispatch_init_func(void *arg, void **popaque);
+
+typedef void js_std_dispatch_fini_func(void *opaque);
+
+js_std_dispatcher_t *js_std_dispatcher_start(js_std_dispatch_init_func *,
+                                             js_std_dispatch_fini_func *,
+                                             void *);
+
+void js_std_dispatcher_stop(js_std_dispatcher_t *);
+
+int js_std_dispatcher_post(js_std_dispatcher_t *, js_std_request_t *);
+
+int js_std_request_finished(js_std_request_t *);
+
+int js_std_request_wait(js_std_dispatcher_t *, js_std_request_t *);
+
 void js_std_dump_error(JSContext *);
 
 void js_std_init(JSContext *);
@@ -8,4 +168,84 @@ uint8_t *js_load_file(JSContext *, size_t *, const char *);
 
 void js_std_eval_binary(JSContext *, const uint8_t *, size_t, int);
 
+void js_std_eval_binary_lz(JSContext *, const uint8_t *, size_t, size_t, int);
+
+JSValue js_std_read_binary(JSContext *, const uint8_t *, size_t, size_t);
+
+void js_std_eval_function(JSContext *, JSValueConst);
+
+void js_std_eval_snapshot(JSContext *, const uint8_t *, size_t);
+
+void js_std_eval_snapshot_lz(JSContext *, const uint8_t *, size_t, size_t);
+
+/* element types of js_std_new_typed_array() */
+typedef enum js_std_typed_array_t {
+    JS_STD_INT8_ARRAY,
+    JS_STD_UINT8_ARRAY,
+    JS_STD_UINT8C_ARRAY,
+    JS_STD_INT16_ARRAY,
+    JS_STD_UINT16_ARRAY,
+    JS_STD_INT32_ARRAY,
+    JS_STD_UINT32_ARRAY,
+    JS_STD_FLOAT32_ARRAY,
+    JS_STD_FLOAT64_ARRAY,
+} js_std_typed_array_t;
+
+/* zero copy buffers: the ArrayBuffer uses the C memory directly. free_func
+   is called when the ArrayBuffer is collected or detached, with a NULL
+   free_func the memory stays owned by the caller, which must then detach
+   the buffer before releasing it. */
+JSValue js_std_new_buffer(JSContext *, uint8_t *, size_t,
+                          JSFreeArrayBufferDataFunc *, void *);
+
+JSValue js_std_new_typed_array(JSContext *, js_std_typed_array_t, void *,
+                               size_t, JSFreeArrayBufferDataFunc *, void *);
+
+uint8_t *js_std_get_buffer(JSContext *, size_t *, JSValueConst);
+
+void js_std_detach_buffer(JSContext *, JSValueConst);
+
+JSValue js_std_call_detach(JSContext *, JSValueConst, JSValueConst, int,
+                           JSValueConst *);
+
+/* batch calls of a global function, see js_std.c */
+int js_std_call_batch_int64(JSContext *, const char *, const int64_t *,
+                            int64_t *, size_t);
+
+int js_std_call_batch_float64(JSContext *, const char *, const double *,
+                              double *, size_t);
+
+int js_std_call_batch_typed(JSContext *, const char *, js_std_typed_array_t,
+                            const void *, void *, size_t);
+
+/* event loop */
+enum {
+    JS_STD_PENDING,
+    JS_STD_FULFILLED,
+    JS_STD_REJECTED,
+};
+
+int js_std_run_jobs(JSContext *);
+
+int js_std_loop(JSContext *, int64_t);
+
+int64_t js_std_next_timer(JSContext *);
+
+JSValue js_std_call_async(JSContext *, JSValueConst, JSValueConst, int,
+                          JSValueConst *);
+
+int js_std_async_state(JSContext *, JSValueConst);
+
+JSValue js_std_async_result(JSContext *, JSValueConst);
+
+int js_std_await(JSContext *, JSValueConst, int64_t);
+
+void js_std_cleanup(JSContext *);
+
 int js_module_set_import_meta(JSContext *, JSValueConst, JS_BOOL, JS_BOOL);
+
+JSModuleDef *js_std_module_loader(JSContext *, const char *, void *);
+
+JSModuleDef *js_std_module_set_loader(JSContext *, const char *, void *);
+
+#endif /* JS_STD_H */
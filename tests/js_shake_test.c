@@ -0,0 +1,139 @@
+/* tests of the tokenizer and of the tree shaking of js2c -T */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "js_shake.h"
+
+static int failures;
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static int has_lexical_decl(const char *src) {
+    return js_shake_has_lexical_decl(src, strlen(src));
+}
+
+/* a let hidden in something read as a regexp, or a brace of a regexp
+   read as a block, changes the result */
+static void test_regexp_division(void) {
+    CHECK(has_lexical_decl("a / 2; let x; b / 3;"));
+    CHECK(has_lexical_decl("f(a) / 2; let x; b / 3;"));
+    CHECK(has_lexical_decl("a[0] / 2; let x; b / 3;"));
+    CHECK(has_lexical_decl("a = 1 / 2; let x; b = 3 / 4;"));
+    CHECK(has_lexical_decl("if (a) /}/.test(b); let x;"));
+    CHECK(has_lexical_decl("x = /[/]{/; let y;"));
+    CHECK(has_lexical_decl("return /{/; let y;"));
+    CHECK(!has_lexical_decl("x = a / b; { let y; }"));
+    CHECK(!has_lexical_decl("x = /let y;/;"));
+}
+
+static void test_templates(void) {
+    CHECK(has_lexical_decl("var s = `{`; let x;"));
+    CHECK(has_lexical_decl("var s = `${ {a: 1}.a }}`; let x;"));
+    CHECK(has_lexical_decl("var s = `a${ `{` }b`; let x;"));
+    CHECK(has_lexical_decl("var s = `${ \"`\" }{`; let x;"));
+    CHECK(!has_lexical_decl("var s = `let x`;"));
+    /* cannot be tokenized */
+    CHECK(has_lexical_decl("var s = `${ a "));
+}
+
+static void test_lexical_decl(void) {
+    CHECK(has_lexical_decl("#!/usr/bin/env qjs\nconst a = 1;"));
+    CHECK(has_lexical_decl("class A {}"));
+    CHECK(!has_lexical_decl("function f() { let a; }"));
+    CHECK(!has_lexical_decl("var a = \"let b\"; // let c\n/* const d */"));
+}
+
+static char dir[] = "/tmp/js_shake_testXXXXXX";
+
+static char *write_module(const char *name, const char *src) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    FILE *f;
+
+    sprintf(path, "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (f) {
+        fputs(src, f);
+        fclose(f);
+    }
+    return path;
+}
+
+static int is_external(const char *module_name, void *opaque) {
+    return 0;
+}
+
+static int source_has(js_shake_t *s, const char *path, const char *str) {
+    const char *src;
+    size_t len;
+
+    src = js_shake_get_source(s, path, &len);
+    return src && strstr(src, str) != NULL;
+}
+
+static void test_shake(void) {
+    js_shake_t *s;
+    char *main_path, *lib_path, *util_path;
+
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        failures++;
+        return;
+    }
+    main_path = write_module("main.mjs",
+        "import { used } from \"./lib.mjs\";\n"
+        "export function api() { return used(); }\n"
+        "function unused() { return 1; }\n"
+        "function tmpl() { return 2; }\n"
+        "var s = `${ tmpl() }`;\n");
+    lib_path = write_module("lib.mjs",
+        "export function used() { return 1; }\n"
+        "export function dropped() { return 2; }\n");
+    /* an entry of a module set only has exports */
+    util_path = write_module("util.mjs",
+        "export function a() { return b(); }\n"
+        "function b() { return 1; }\n"
+        "export default function c() { return 2; }\n"
+        "function d() { return 3; }\n");
+
+    s = js_shake_new(is_external, NULL);
+    CHECK(js_shake_add_entry(s, main_path) == 0);
+    CHECK(js_shake_add_entry(s, util_path) == 0);
+    CHECK(js_shake_run(s) == 0);
+    CHECK(source_has(s, main_path, "function api"));
+    CHECK(source_has(s, main_path, "function tmpl"));
+    CHECK(!source_has(s, main_path, "function unused"));
+    CHECK(source_has(s, lib_path, "function used"));
+    CHECK(!source_has(s, lib_path, "function dropped"));
+    CHECK(source_has(s, util_path, "function a"));
+    CHECK(source_has(s, util_path, "function b"));
+    CHECK(source_has(s, util_path, "function c"));
+    CHECK(!source_has(s, util_path, "function d"));
+    js_shake_free(s);
+
+    unlink(main_path);
+    unlink(lib_path);
+    unlink(util_path);
+    rmdir(dir);
+    free(main_path);
+    free(lib_path);
+    free(util_path);
+}
+
+int main(void) {
+    test_regexp_division();
+    test_templates();
+    test_lexical_decl();
+    test_shake();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}